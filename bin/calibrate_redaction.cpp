@@ -0,0 +1,218 @@
+// Copyright (C) 2011 Andrew W. Senior andrew.senior[AT]gmail.com
+// Part of the Jpeg-Redaction-Library to read, parse, edit redact and
+// write JPEG/EXIF/JFIF images.
+// See https://github.com/asenior/Jpeg-Redaction-Library
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+// Time redactions of some images to fit the RedactionCostModel used by
+// Jpeg::EstimateRedaction, and compare the estimates with what
+// redacting them takes.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/time.h>
+
+#include <string>
+#include <vector>
+#include "jpeg.h"
+#include "jpeg_marker.h"
+#include "redaction.h"
+
+namespace jpeg_redaction {
+  double Now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+  }
+
+  bool ReadFile(const char *filename, std::vector<unsigned char> *data) {
+    FILE *pFile = fopen(filename, "rb");
+    if (pFile == NULL)
+      return false;
+    fseek(pFile, 0, SEEK_END);
+    data->resize(ftell(pFile));
+    fseek(pFile, 0, SEEK_SET);
+    const bool ok = (data->empty() ||
+		     fread(&(*data)[0], 1, data->size(), pFile) == data->size());
+    fclose(pFile);
+    return ok;
+  }
+
+  // One image and the redactions it's timed with.
+  class Sample {
+  public:
+    // The whole image, and a grid of small regions making many strips.
+    void MakeRedactions(int width, int height) {
+      whole_.AddRegion(Redaction::Region(0, width, 0, height));
+      for (int y = 0; y + 16 <= height; y += 64)
+	for (int x = 0; x + 16 <= width; x += 64)
+	  grid_.AddRegion(Redaction::Region(x, x + 16, y, y + 16));
+    }
+    std::string filename_;
+    std::vector<unsigned char> data_;
+    Redaction whole_;
+    Redaction grid_;
+    RedactionEstimate parse_estimate_;
+    RedactionEstimate whole_estimate_;
+    RedactionEstimate grid_estimate_;
+    // The fastest of the timed runs of each.
+    double parse_seconds_;
+    double whole_seconds_;
+    double grid_seconds_;
+    int grid_output_bytes_;
+  };
+
+  // Decode the image with a copy of redaction (or none) repeats times,
+  // returning the fastest time, and the size of the redacted scan.
+  double TimeDecode(const Sample &sample, const Redaction *redaction,
+		    int repeats, int *output_bytes) {
+    double best = -1;
+    for (int r = 0; r < repeats; ++r) {
+      Jpeg jpeg;
+      if (!jpeg.LoadFromMemory(&sample.data_[0], sample.data_.size(), true))
+	throw("Can't load image for timing");
+      Redaction *copy = redaction ? redaction->Copy() : NULL;
+      const double start = Now();
+      jpeg.DecodeImage(copy, NULL);
+      const double seconds = Now() - start;
+      delete copy;
+      if (best < 0 || seconds < best)
+	best = seconds;
+      if (output_bytes) {
+	JpegMarker *sos = jpeg.GetMarker(Jpeg::jpeg_sos);
+	*output_bytes = sos->GetBitLength() / 8 - sos->ScanHeaderLength();
+      }
+    }
+    return best;
+  }
+
+  int Calibrate(const std::vector<std::string> &filenames, int repeats) {
+    std::vector<Sample> samples(filenames.size());
+    // Start from a model of the parse alone, so the estimates give the
+    // counts and the time they predict is only per byte.
+    RedactionCostModel counting;
+    counting.seconds_per_image_ = 0;
+    counting.seconds_per_scan_byte_ = 1;
+    counting.seconds_per_redacted_mcu_ = 0;
+    counting.seconds_per_strip_ = 0;
+    for (int i = 0; i < samples.size(); ++i) {
+      Sample &sample = samples[i];
+      sample.filename_ = filenames[i];
+      if (!ReadFile(filenames[i].c_str(), &sample.data_)) {
+	fprintf(stderr, "Can't read %s\n", filenames[i].c_str());
+	return 1;
+      }
+      Jpeg header;
+      if (!header.LoadFromMemory(&sample.data_[0], sample.data_.size(),
+				 false))
+	throw("Can't load image header");
+      sample.MakeRedactions(header.GetWidth(), header.GetHeight());
+      Redaction none;
+      sample.parse_estimate_ = header.EstimateRedaction(none, counting);
+      sample.whole_estimate_ = header.EstimateRedaction(sample.whole_,
+							counting);
+      sample.grid_estimate_ = header.EstimateRedaction(sample.grid_,
+						       counting);
+      sample.parse_seconds_ = TimeDecode(sample, NULL, repeats, NULL);
+      sample.whole_seconds_ = TimeDecode(sample, &sample.whole_,
+					 repeats, NULL);
+      sample.grid_seconds_ = TimeDecode(sample, &sample.grid_, repeats,
+					&sample.grid_output_bytes_);
+    }
+
+    // Fit parse time = image + byte * bytes over the images, where
+    // bytes is the scan bytes the estimate counts (with the embedded
+    // JPEGs' as seconds_ in the counting model).
+    RedactionCostModel model;
+    double sx = 0, sy = 0, sxx = 0, sxy = 0;
+    const int n = samples.size();
+    for (int i = 0; i < n; ++i) {
+      const double x = samples[i].parse_estimate_.seconds_;
+      const double y = samples[i].parse_seconds_;
+      sx += x; sy += y; sxx += x * x; sxy += x * y;
+    }
+    const double det = n * sxx - sx * sx;
+    if (n > 1 && det > 0) {
+      model.seconds_per_scan_byte_ = (n * sxy - sx * sy) / det;
+      model.seconds_per_image_ = (sy - model.seconds_per_scan_byte_ * sx) / n;
+    } else {
+      model.seconds_per_scan_byte_ = sy / sx;
+      model.seconds_per_image_ = 0;
+    }
+    if (model.seconds_per_image_ < 0)
+      model.seconds_per_image_ = 0;
+    // The rest is the extra time over parsing, shared out by MCU (from
+    // the whole image, which is one strip) and then by strip (from the
+    // grid).
+    double extra = 0, mcus = 0;
+    for (int i = 0; i < n; ++i) {
+      extra += samples[i].whole_seconds_ - samples[i].parse_seconds_;
+      mcus += samples[i].whole_estimate_.mcus_redacted_;
+    }
+    model.seconds_per_redacted_mcu_ = (extra > 0) ? extra / mcus : 0;
+    double strips = 0;
+    extra = 0;
+    for (int i = 0; i < n; ++i) {
+      extra += samples[i].grid_seconds_ - samples[i].parse_seconds_ -
+	model.seconds_per_redacted_mcu_ *
+	samples[i].grid_estimate_.mcus_redacted_;
+      strips += samples[i].grid_estimate_.strips_;
+    }
+    model.seconds_per_strip_ = (extra > 0 && strips > 0) ? extra / strips : 0;
+
+    printf("RedactionCostModel() : seconds_per_image_(%.1e),\n"
+	   "    seconds_per_scan_byte_(%.1e),\n"
+	   "    seconds_per_redacted_mcu_(%.1e),\n"
+	   "    seconds_per_strip_(%.1e)\n",
+	   model.seconds_per_image_, model.seconds_per_scan_byte_,
+	   model.seconds_per_redacted_mcu_, model.seconds_per_strip_);
+    printf("%-30s %12s %12s %12s %12s %12s\n", "image", "grid ms",
+	   "estimate ms", "grid bytes", "expected", "max");
+    for (int i = 0; i < n; ++i) {
+      Jpeg header;
+      header.LoadFromMemory(&samples[i].data_[0], samples[i].data_.size(),
+			    false);
+      const RedactionEstimate estimate =
+	header.EstimateRedaction(samples[i].grid_, model);
+      printf("%-30s %12.3f %12.3f %12d %12lld %12lld\n",
+	     samples[i].filename_.c_str(), 1000 * samples[i].grid_seconds_,
+	     1000 * estimate.seconds_, samples[i].grid_output_bytes_,
+	     estimate.expected_output_bytes_, estimate.max_output_bytes_);
+    }
+    return 0;
+  }
+} // namespace jpeg_redaction
+
+int main(int argc, char **argv) {
+  int repeats = 5;
+  std::vector<std::string> filenames;
+  for (int i = 1; i < argc; ++i) {
+    if (std::string(argv[i]) == "-n" && i + 1 < argc)
+      repeats = atoi(argv[++i]);
+    else
+      filenames.push_back(argv[i]);
+  }
+  if (filenames.empty() || repeats < 1) {
+    fprintf(stderr, "Usage: %s [-n repeats] image.jpg ...\n", argv[0]);
+    return 1;
+  }
+  try {
+    return jpeg_redaction::Calibrate(filenames, repeats);
+  } catch (const char *error) {
+    fprintf(stderr, "Error: <%s> at outer level\n", error);
+    return 1;
+  }
+}
@@ -0,0 +1,70 @@
+// Copyright (C) 2011 Andrew W. Senior andrew.senior[AT]gmail.com
+// Part of the Jpeg-Redaction-Library to read, parse, edit redact and
+// write JPEG/EXIF/JFIF images.
+// See https://github.com/asenior/Jpeg-Redaction-Library
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+// Binary to redact the frames of a Motion JPEG stream, given a file
+// of per-frame regions.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "mjpeg.h"
+
+int main(int argc, char **argv) {
+  if (argc < 4) {
+    fprintf(stderr, "%s <infile> <outfile> <regionsfile> [threads]\n"
+	    "regionsfile has lines of <frame> <l,r,t,b[:method];...>\n"
+	    "Output is concatenated JPEG images.\n", argv[0]);
+    exit(1);
+  }
+  int threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (argc > 4)
+    threads = atoi(argv[4]);
+  jpeg_redaction::Mjpeg mjpeg;
+  if (!mjpeg.LoadFromFile(argv[1])) {
+    fprintf(stderr, "No frames found in %s\n", argv[1]);
+    return 1;
+  }
+  if (mjpeg.LoadRegions(argv[3]) < 0)
+    return 1;
+  FILE *pFile = fopen(argv[2], "wb");
+  if (pFile == NULL) {
+    fprintf(stderr, "Couldn't open %s\n", argv[2]);
+    return 1;
+  }
+  struct timeval start, end;
+  gettimeofday(&start, NULL);
+  int dropped;
+  try {
+    dropped = mjpeg.Redact(pFile, threads);
+  } catch (const char *error) {
+    fprintf(stderr, "Error: <%s> at outer level\n", error);
+    fclose(pFile);
+    return 1;
+  }
+  fclose(pFile);
+  gettimeofday(&end, NULL);
+  const double seconds = (end.tv_sec - start.tv_sec) +
+    (end.tv_usec - start.tv_usec) / 1e6;
+  printf("%d frames (%d dropped) in %.3fs with %d threads: %.1f fps\n",
+	 mjpeg.NumFrames(), dropped, seconds, threads,
+	 seconds > 0 ? mjpeg.NumFrames() / seconds : 0.0);
+  return dropped ? 1 : 0;
+}
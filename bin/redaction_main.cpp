@@ -83,7 +83,7 @@ int main(int argc, char **argv) {
   if (argc - start_arg <= 2) {
     fprintf(stderr, "%s <infile> <outfile> <l,r,t,b[:method];...>\n"
 	    "method is one of [c]opystrip, [S]olid, [p]ixellate,"
-	    "[i]nverse pixellate\n", argv[0]);
+	    "[i]nverse pixellate, [o]verlay\n", argv[0]);
     exit(1);
   }
   filename = argv[start_arg];
@@ -20,6 +20,8 @@
 // Class to apply bit operations to a (JPEG) bit stream.
 #ifndef INCLUDE_JPEG_REDACTION_LIBRARY_BIT_SHIFTS
 #define INCLUDE_JPEG_REDACTION_LIBRARY_BIT_SHIFTS
+#include <string.h>
+#include <vector>
 #include "debug_flag.h"
 
 namespace jpeg_redaction {
@@ -131,6 +133,67 @@ public:
     ShiftTail(data, length, start, insert_length);
     return Overwrite(data, *length, start, insertion, insert_length);
   }
+  // Append length bits of src, starting at bit src_start, to the end
+  // of dest which currently holds *dest_bits bits. Unused bits at the end
+  // of dest must be zero, and are left zero.
+  static void AppendBits(std::vector<unsigned char> *dest,
+			 int *dest_bits,
+			 const unsigned char *src,
+			 int src_start,
+			 int length) {
+    if (length < 0)
+      throw("AppendBits: length is negative");
+    if (length == 0) return;
+    dest->resize((*dest_bits + length + 7) / 8, 0);
+    // Bit by bit until the destination is byte aligned.
+    while (length > 0 && (*dest_bits % 8) != 0) {
+      if ((src[src_start / 8] >> (7 - src_start % 8)) & 1)
+	(*dest)[*dest_bits / 8] |= 0x80 >> (*dest_bits % 8);
+      ++src_start;
+      ++*dest_bits;
+      --length;
+    }
+    // Then whole bytes.
+    const int whole_bytes = length / 8;
+    unsigned char *out = &(*dest)[0] + *dest_bits / 8;
+    const unsigned char *in = src + src_start / 8;
+    const int shift = src_start % 8;
+    if (shift == 0) {
+      memcpy(out, in, whole_bytes);
+    } else {
+      for (int i = 0; i < whole_bytes; ++i)
+	out[i] = (in[i] << shift) | (in[i + 1] >> (8 - shift));
+    }
+    src_start += whole_bytes * 8;
+    *dest_bits += whole_bytes * 8;
+    length -= whole_bytes * 8;
+    // And any bits that are left.
+    if (length > 0) {
+      unsigned char byte = src[src_start / 8] << shift;
+      if (shift + length > 8)
+	byte |= src[src_start / 8 + 1] >> (8 - shift);
+      byte &= 0xff << (8 - length);
+      (*dest)[*dest_bits / 8] = byte;
+      *dest_bits += length;
+    }
+  }
+  // Are length bits of a, from bit a_start, the same as those of b from
+  // bit b_start.
+  static bool EqualBits(const unsigned char *a, int a_start,
+			const unsigned char *b, int b_start, int length) {
+    for (int i = 0; i < length; ++i)
+      if (((a[(a_start + i) / 8] >> (7 - (a_start + i) % 8)) & 1) !=
+	  ((b[(b_start + i) / 8] >> (7 - (b_start + i) % 8)) & 1))
+	return false;
+    return true;
+  }
+  // Cut data down to its first bits, clearing the unused bits at the end.
+  static void Truncate(std::vector<unsigned char> *data, int bits) {
+    if (bits > data->size() * 8) throw("too many bits in Truncate");
+    data->resize((bits + 7) / 8);
+    if (bits % 8 != 0)
+      data->back() &= 0xff << (8 - bits % 8);
+  }
   // Pad the last byte with ones.
   static int PadLastByte(std::vector<unsigned char> *data, int bits) {
     if (bits > data->size() * 8) throw("too many bits in PadLastByte");
@@ -143,6 +206,13 @@ public:
       data->back() |= unused_bits_mask;
     }
   }
+  // 32 bit FNV-1a hash of length bytes of data.
+  static unsigned int Fnv1a(const unsigned char *data, int length) {
+    unsigned int hash = 2166136261u;
+    for (int i = 0; i < length; ++i)
+      hash = (hash ^ data[i]) * 16777619u;
+    return hash;
+  }
 }; 
 }  // namespace jpeg_redaction
 #endif  // INCLUDE_JPEG_REDACTION_LIBRARY_BIT_SHIFTS
@@ -19,10 +19,15 @@
 // jpeg.cpp: implementation of the Jpeg class to store all the information
 // from a JPEG file.
 
+#include <pthread.h>
+#include <algorithm>
 #include "debug_flag.h"
 #include "jpeg.h"
 #include "jpeg_dht.h"
+#include "jpeg_dqt.h"
 #include "jpeg_decoder.h"
+#include "jpeg_decoder_cache.h"
+#include "jpeg_encoder.h"
 #include "jpeg_marker.h"
 #include "redaction.h"
 #include "photoshop_3block.h"
@@ -60,6 +65,69 @@ namespace jpeg_redaction {
     return rv == 0;
   }
 
+  bool Jpeg::LoadFromMemory(const unsigned char *data, int length,
+			    bool loadall) {
+    FILE *pFile = fmemopen((void *)data, length, "rb");
+    if (pFile == NULL) {
+      fprintf(stderr, "Couldn't open %d bytes of memory\n", length);
+      return false;
+    }
+    int rv;
+    try {
+      rv = LoadFromFile(pFile, loadall, 0);
+    } catch (...) {
+      fclose(pFile);
+      throw;
+    }
+    fclose(pFile);
+    return rv == 0;
+  }
+
+  Status Jpeg::Load(const char *filename, bool loadall) {
+    filename_ = filename;
+    FILE *pFile = fopen(filename, "rb");
+    if (pFile == NULL)
+      return Status(Status::kCantOpen, "Couldn't open file", -1, -1);
+    const Status status = Load(pFile, loadall);
+    fclose(pFile);
+    return status;
+  }
+
+  Status Jpeg::Load(const unsigned char *data, int length, bool loadall) {
+    FILE *pFile = fmemopen((void *)data, length, "rb");
+    if (pFile == NULL)
+      return Status(Status::kCantOpen, "Couldn't open the memory", -1, -1);
+    const Status status = Load(pFile, loadall);
+    fclose(pFile);
+    return status;
+  }
+
+  // The loaders throw strings, or ints for failed reads (-1, -2, -10)
+  // and bad EXIF headers (-4, -6). Running out of data is reported as
+  // truncation whichever was thrown.
+  Status Jpeg::Load(FILE *pFile, bool loadall) {
+    std::string message;
+    int code = 0;
+    try {
+      LoadFromFile(pFile, loadall, 0);
+      return Status();
+    } catch (const char *error) {
+      message = error;
+    } catch (int error) {
+      code = error;
+      message = (error == -4 || error == -6) ? "Bad EXIF header" :
+	"Couldn't read the data";
+    } catch (...) {
+      // Such as running out of memory for a bad length.
+      return Status(Status::kMalformed, "Couldn't load the image",
+		    ftell(pFile), -1);
+    }
+    const int offset = ftell(pFile);
+    if (feof(pFile) || code == -10)
+      return Status(Status::kTruncated, message, offset, -1);
+    return Status(Status::kMalformed, message, offset, -1);
+  }
+
   const char *Jpeg::MarkerName(int marker) const {
     if (marker >= jpeg_app && marker < jpeg_app + 0xf) {
       return "APPn";
@@ -168,7 +236,7 @@ namespace jpeg_redaction {
 	if (0) {
 	  DumpHex(data, blocksize);
 	}
-	const int bits_per_sample = data[0];
+	bits_per_sample_ = data[0];
 	height_ = data[1] * 256 + data[2];
 	width_ = data[3] * 256 + data[4];
 	int components = data[5];
@@ -192,8 +260,12 @@ namespace jpeg_redaction {
 	if (debug > 0)
 	  printf(" sz %d nextloc %d\n", blocksize, blockloc + blocksize + 2);
 	JpegMarker *d = AddMarker(marker, blockloc, blocksize, pFile, loadall);
-	if (marker == jpeg_dht && loadall) {
-	  BuildDHTs(d);
+	// With a cache the tables are only built if it doesn't have them.
+	if (marker == jpeg_dht && loadall && decoder_cache_ == NULL) {
+	  BuildDHTs(d, &dhts_);
+	}
+	if (marker == jpeg_dqt && loadall && decoder_cache_ == NULL) {
+	  BuildDQTs(d, &dqts_);
 	}
 	continue;
       }
@@ -204,9 +276,7 @@ namespace jpeg_redaction {
 	if (!arch_big_endian)
 	  ByteSwapInPlace(&blocksize, 1);
 	JpegMarker *dri = AddMarker(marker, blockloc, blocksize, pFile, true);
-	restartinterval_ = *(short*)(&dri->data_[0]);
-	if (!arch_big_endian)
-	  ByteSwapInPlace(&restartinterval_, 1);
+	restartinterval_ = (dri->data_[0] << 8) | dri->data_[1];
 	if (debug > 1)
 	  printf("Restart interval %d\n", restartinterval_);
 	continue;
@@ -339,6 +409,9 @@ namespace jpeg_redaction {
     for (int i = 0; i < dhts_.size(); ++i) {
       delete dhts_[i];
     }
+    for (int i = 0; i < dqts_.size(); ++i) {
+      delete dqts_[i];
+    }
     for (int i = 0; i < components_.size(); ++i) {
       delete components_[i];
     }
@@ -468,7 +541,8 @@ namespace jpeg_redaction {
   }
 
   // Having loaded a dht block into memory actually construct the DHTs.
-  void Jpeg::BuildDHTs(const JpegMarker *dht_block) {
+  void Jpeg::BuildDHTs(const JpegMarker *dht_block,
+		       std::vector<JpegDHT*> *dhts) {
     unsigned char *data = (unsigned char *)(&dht_block->data_[0]);
     int length = dht_block->length_ - 2;
     int bytes_used = 0;
@@ -480,10 +554,236 @@ namespace jpeg_redaction {
       if (debug > 0)
 	printf("DHT %d %d%d. Bytes=%d total = %d length = %d\n",
 	       table, dht->class_, dht->id_, bytes, bytes_used, length);
-      dhts_.push_back(dht);
+      dhts->push_back(dht);
       ++table;
     }
   }
+  // Having loaded a dqt block into memory construct the DQTs.
+  void Jpeg::BuildDQTs(const JpegMarker *dqt_block,
+		       std::vector<JpegDQT*> *dqts) {
+    const unsigned char *data = &dqt_block->data_[0];
+    const int length = dqt_block->length_ - 2;
+    int bytes_used = 0;
+    while (bytes_used < length) {
+      JpegDQT *dqt = new JpegDQT;
+      try {
+	bytes_used += dqt->Build(data + bytes_used, length - bytes_used);
+      } catch (const char *error) {
+	delete dqt;
+	throw(error);
+      }
+      dqts->push_back(dqt);
+    }
+  }
+
+  void Jpeg::BuildTables() {
+    if (!dhts_.empty() || !dqts_.empty())
+      return;
+    for (int i = 0; i < markers_.size(); ++i) {
+      if (markers_[i]->marker_ == jpeg_dht)
+	BuildDHTs(markers_[i], &dhts_);
+      if (markers_[i]->marker_ == jpeg_dqt)
+	BuildDQTs(markers_[i], &dqts_);
+    }
+  }
+
+  int Jpeg::LumaDCGain(const std::vector<JpegDQT*> &dqts) const {
+    // Without a table, assume the finest quantizer.
+    int dc_quantizer = 1;
+    if (!components_.empty()) {
+      for (int i = 0; i < dqts.size(); ++i)
+	if (dqts[i]->id_ == components_[0]->table_)
+	  dc_quantizer = dqts[i]->GetDCQuantizer();
+    }
+    return JpegDQT::DCGain(dc_quantizer, bits_per_sample_);
+  }
+
+  void Jpeg::GetMCUGeometry(int *mcu_width, int *mcu_height,
+			    int *mcus_wide, int *mcus_high) const {
+    int h_factor = 1;
+    int v_factor = 1;
+    for (int i = 0; i < components_.size(); ++i) {
+      if (components_[i]->h_factor_ > h_factor)
+	h_factor = components_[i]->h_factor_;
+      if (components_[i]->v_factor_ > v_factor)
+	v_factor = components_[i]->v_factor_;
+    }
+    *mcu_width = 8 * h_factor;
+    *mcu_height = 8 * v_factor;
+    *mcus_wide = (width_ + *mcu_width - 1) / *mcu_width;
+    *mcus_high = (height_ + *mcu_height - 1) / *mcu_height;
+  }
+
+  RedactionEstimate Jpeg::EstimateRedaction(
+      const Redaction &redaction, const RedactionCostModel &model) const {
+    // Bits a redacted block can take: a DC difference (up to 16 bits of
+    // code and 11 of magnitude) and an EOB of up to 16 bits, or for an
+    // overlay block 64 coefficients of up to 27 bits. A recoded DC may
+    // grow by a whole DC code. Codes are at least 1 bit.
+    const int kMaxRedactedBlockBits = 43;
+    const int kMaxOverlayBlockBits = 64 * 27;
+    const int kMaxDCBits = 27;
+    const int kMinRedactedBlockBits = 2;
+    // What they take in practice (see bin/calibrate_redaction).
+    const int kRedactedBlockBits = 8;
+    const int kOverlayBlockBits = 160;
+    RedactionEstimate estimate;
+    const JpegMarker *sos_block = NULL;
+    for (int i = 0; i < markers_.size(); ++i)
+      if (markers_[i]->marker_ == jpeg_sos)
+	sos_block = markers_[i];
+    if (sos_block == NULL || components_.empty())
+      throw("No scan to estimate the redaction of");
+    estimate.scan_bytes_ =
+      sos_block->length_ - 2 - sos_block->ScanHeaderLength();
+    int blocks_per_mcu = 0;
+    for (int i = 0; i < components_.size(); ++i)
+      blocks_per_mcu += components_[i]->h_factor_ * components_[i]->v_factor_;
+    int mcu_width, mcu_height, mcus_wide, mcus_high;
+    GetMCUGeometry(&mcu_width, &mcu_height, &mcus_wide, &mcus_high);
+    estimate.mcus_ = mcus_wide * mcus_high;
+
+    Redaction::Plan plan;
+    plan.Compile(redaction, mcu_width, mcu_height, mcus_wide, mcus_high);
+    long long min_bits = 0;
+    long long max_bits = 8LL * estimate.scan_bytes_;
+    long long expected_bits = 0;
+    int last_interval = -1;
+    for (int mcu = 0; mcu < estimate.mcus_; ++mcu) {
+      const Redaction::Plan::mcu_action action = plan.GetAction(mcu);
+      if (action == Redaction::Plan::action_edge) {
+	++estimate.mcus_edge_;
+	max_bits += components_.size() * kMaxDCBits;
+      }
+      if (action == Redaction::Plan::action_start)
+	++estimate.strips_;
+      const int label = plan.GetLabel(mcu);
+      if (label < 0)
+	continue;
+      ++estimate.mcus_redacted_;
+      if (restartinterval_ > 0 && mcu / restartinterval_ != last_interval) {
+	last_interval = mcu / restartinterval_;
+	++estimate.restart_intervals_touched_;
+      }
+      min_bits += blocks_per_mcu * kMinRedactedBlockBits;
+      if (plan.GetLabelRegion(label).GetRedactionMethod() ==
+	  Redaction::redact_overlay) {
+	max_bits += blocks_per_mcu * kMaxOverlayBlockBits;
+	expected_bits += blocks_per_mcu * kOverlayBlockBits;
+      } else {
+	max_bits += blocks_per_mcu * kMaxRedactedBlockBits;
+	expected_bits += blocks_per_mcu * kRedactedBlockBits;
+      }
+    }
+    // The MCUs outside the regions are copied, at the image's mean rate.
+    const double kept = (estimate.mcus_ == 0) ? 0 :
+      (estimate.mcus_ - estimate.mcus_redacted_) /
+      (double)estimate.mcus_;
+    expected_bits += (long long)(8 * estimate.scan_bytes_ * kept);
+    estimate.min_output_bytes_ = (min_bits + 7) / 8;
+    estimate.expected_output_bytes_ = (expected_bits + 7) / 8;
+    estimate.max_output_bytes_ = (max_bits + 7) / 8;
+    estimate.max_strip_bytes_ =
+      (estimate.mcus_redacted_ > 0) ? estimate.scan_bytes_ : 0;
+
+    // The scan, the redacted scan and the strips; the DC planes and the
+    // preview image; the plan, and the DCs kept for a new thumbnail.
+    const long long blocks = (long long)estimate.mcus_ * blocks_per_mcu;
+    const long long luma_blocks = (long long)estimate.mcus_ *
+      components_[0]->h_factor_ * components_[0]->v_factor_;
+    const bool regenerate = RegeneratesThumbnail(&redaction);
+    estimate.peak_memory_bytes_ = estimate.scan_bytes_ +
+      std::max((long long)estimate.scan_bytes_, estimate.max_output_bytes_) +
+      estimate.max_strip_bytes_ +
+      blocks * sizeof(int) + luma_blocks + 13LL * estimate.mcus_;
+    if (regenerate)
+      estimate.peak_memory_bytes_ += (long long)estimate.mcus_redacted_ *
+	blocks_per_mcu * 3 * sizeof(int);
+
+    // Averaged pixellation parses the scan twice.
+    int parses = 1;
+    if (redaction.AveragesPixellation() &&
+	(plan.UsesMethod(Redaction::redact_pixellate) ||
+	 plan.UsesMethod(Redaction::redact_inverse_pixellate)))
+      parses = 2;
+    estimate.seconds_ = model.seconds_per_image_ +
+      parses * model.seconds_per_scan_byte_ * estimate.scan_bytes_ +
+      model.seconds_per_redacted_mcu_ * estimate.mcus_redacted_ +
+      model.seconds_per_strip_ * estimate.strips_;
+
+    if (!regenerate) {
+      std::vector<Jpeg *> embedded = GetEmbeddedJpegs();
+      for (int i = 0; i < embedded.size(); ++i) {
+	Redaction *scaled = redaction.Copy();
+	try {
+	  scaled->Scale(embedded[i]->GetWidth(), embedded[i]->GetHeight(),
+			GetWidth(), GetHeight());
+	  estimate.AddConcurrent(embedded[i]->EstimateRedaction(*scaled,
+								 model));
+	} catch (const char *error) {
+	  delete scaled;
+	  throw(error);
+	}
+	delete scaled;
+      }
+    }
+    return estimate;
+  }
+
+  void Jpeg::DecoderSetupKey(std::vector<unsigned char> *key) const {
+    key->clear();
+    for (int i = 0; i < markers_.size(); ++i) {
+      const JpegMarker *marker = markers_[i];
+      if (marker->marker_ != jpeg_sof0 && marker->marker_ != jpeg_sof2 &&
+	  marker->marker_ != jpeg_dht && marker->marker_ != jpeg_dqt)
+	continue;
+      key->push_back(marker->marker_ & 0xff);
+      key->push_back(marker->data_.size() >> 8);
+      key->push_back(marker->data_.size() & 0xff);
+      key->insert(key->end(), marker->data_.begin(), marker->data_.end());
+    }
+  }
+
+  const JpegDecoderSetup *Jpeg::GetDecoderSetup(JpegDecoderSetup *local) {
+    if (decoder_cache_ != NULL) {
+      std::vector<unsigned char> key;
+      DecoderSetupKey(&key);
+      const JpegDecoderSetup *cached = decoder_cache_->Find(key);
+      if (cached)
+	return cached;
+      // Build the tables for the setup to own.
+      JpegDecoderSetup *setup = new JpegDecoderSetup;
+      std::vector<JpegDQT*> dqts;
+      try {
+	for (int i = 0; i < markers_.size(); ++i) {
+	  if (markers_[i]->marker_ == jpeg_dht)
+	    BuildDHTs(markers_[i], &setup->owned_dhts_);
+	  if (markers_[i]->marker_ == jpeg_dqt)
+	    BuildDQTs(markers_[i], &dqts);
+	}
+	setup->Init(width_, height_, setup->owned_dhts_, dqts, components_,
+		    LumaDCGain(dqts));
+      } catch (const char *error) {
+	for (int i = 0; i < dqts.size(); ++i)
+	  delete dqts[i];
+	delete setup;
+	throw(error);
+      }
+      for (int i = 0; i < dqts.size(); ++i)
+	delete dqts[i];
+      cached = decoder_cache_->Insert(key, setup);
+      if (cached)
+	return cached;
+      delete setup;
+      if (debug > 0)
+	printf("Decoder cache is full\n");
+    }
+    BuildTables();
+    local->Init(width_, height_, dhts_, dqts_, components_,
+		LumaDCGain(dqts_));
+    return local;
+  }
+
   // First find the IFD with tags 0x201 & 0x202.
   // should contain data_
   Jpeg *Jpeg::GetThumbnail() {
@@ -495,74 +795,327 @@ namespace jpeg_redaction {
     return NULL;
   }
 
-  // Redact the thumbnail 
-  // Returns: 0: no thumbnail found N:  N thumbnails found and redacted
-  // <0 failed to redact thumbnail.
-  int Jpeg::RedactThumbnail(Redaction *redaction) {
+  std::vector<Jpeg *> Jpeg::GetEmbeddedJpegs() const {
+    std::vector<Jpeg *> jpegs;
+    for (int i = 0 ; i < ifds_.size(); ++i) {
+      if (ifds_[i]->GetJpeg() &&
+	  ifds_[i]->FindTag(TiffTag::tag_ThumbnailOffset))
+	jpegs.push_back(ifds_[i]->GetJpeg());
+    }
+    return jpegs;
+  }
+
+  // Redacting an embedded JPEG with its own scaled redactions.
+  class Jpeg::EmbeddedRedaction {
+  public:
+    EmbeddedRedaction(Jpeg *jpeg, bool variants) :
+      jpeg_(jpeg), variants_(variants), error_(NULL), threaded_(false) {}
+    ~EmbeddedRedaction() {
+      for (int i = 0; i < redactions_.size(); ++i)
+	delete redactions_[i];
+    }
+    void AddRedaction(Redaction *redaction) {
+      redactions_.push_back(redaction);
+    }
+    // Run on a new thread. If debugging (to keep the output in order)
+    // or if the thread can't be made, it's left for Finish to run.
+    void Start() {
+      if (debug == 0)
+	threaded_ = (pthread_create(&thread_, NULL, RunThread, this) == 0);
+    }
+    // Wait for it to finish, or run it, and return any error it caught.
+    const char *Finish() {
+      if (threaded_) {
+	pthread_join(thread_, NULL);
+	threaded_ = false;
+      } else {
+	Run();
+      }
+      return error_;
+    }
+
+  protected:
+    static void *RunThread(void *task) {
+      static_cast<EmbeddedRedaction *>(task)->Run();
+      return NULL;
+    }
+    void Run() {
+      try {
+	if (variants_)
+	  jpeg_->DecodeImage(redactions_, NULL);
+	else
+	  jpeg_->DecodeImage(redactions_[0], NULL);
+      } catch (const char *error) {
+	error_ = error;
+      } catch (...) {
+	error_ = "Unknown error redacting an embedded JPEG";
+      }
+    }
+
+    Jpeg *jpeg_;
+    bool variants_;
+    std::vector<Redaction *> redactions_;
+    const char *error_;
+    pthread_t thread_;
+    bool threaded_;
+  };
+
+  void Jpeg::StartEmbeddedRedactions(
+      const std::vector<Redaction *> &redactions, bool variants,
+      std::vector<EmbeddedRedaction *> *tasks) {
+    std::vector<Jpeg *> jpegs = GetEmbeddedJpegs();
+    for (int j = 0; j < jpegs.size(); ++j) {
+      EmbeddedRedaction *task = new EmbeddedRedaction(jpegs[j], variants);
+      try {
+	for (int i = 0; i < redactions.size(); ++i) {
+	  Redaction *scaled = redactions[i] ?
+	    redactions[i]->Copy() : new Redaction;
+	  task->AddRedaction(scaled);
+	  scaled->Scale(jpegs[j]->GetWidth(), jpegs[j]->GetHeight(),
+			GetWidth(), GetHeight());
+	}
+      } catch (const char *error) {
+	delete task;
+	FinishEmbeddedRedactions(tasks, false);
+	throw(error);
+      }
+      tasks->push_back(task);
+      task->Start();
+    }
+  }
+
+  void Jpeg::FinishEmbeddedRedactions(
+      std::vector<EmbeddedRedaction *> *tasks, bool report_errors) {
+    const char *error = NULL;
+    for (int i = 0; i < tasks->size(); ++i) {
+      const char *task_error = (*tasks)[i]->Finish();
+      if (error == NULL)
+	error = task_error;
+      delete (*tasks)[i];
+    }
+    tasks->clear();
+    if (report_errors && error != NULL)
+      throw(error);
+  }
+
+  bool Jpeg::RegeneratesThumbnail(const Redaction *redaction) const {
+    return redaction && redaction->RegeneratesThumbnail() &&
+      bits_per_sample_ == 8 &&
+      (components_.size() == 1 || components_.size() == 3);
+  }
+
+  void Jpeg::RegenerateThumbnails(const JpegDecoder &decoder) {
+    std::vector<TiffIfd *> thumbnail_ifds;
+    for (int i = 0 ; i < ifds_.size(); ++i)
+      if (ifds_[i]->GetJpeg() &&
+	  ifds_[i]->FindTag(TiffTag::tag_ThumbnailOffset))
+	thumbnail_ifds.push_back(ifds_[i]);
+    if (thumbnail_ifds.empty())
+      return;
+    // The DC image has a sample per luma block. The thumbnail fits it
+    // in kThumbnailSize, keeping the aspect ratio, with each pixel the
+    // mean over a box of DC samples.
+    const int dc_width = (width_ + 7) / 8;
+    const int dc_height = (height_ + 7) / 8;
+    const int longest = std::max(dc_width, dc_height);
+    const int size = std::min((int)kThumbnailSize, longest);
+    const int width = std::max(1, dc_width * size / longest);
+    const int height = std::max(1, dc_height * size / longest);
+    int max_h = 1;
+    int max_v = 1;
+    for (int comp = 0; comp < components_.size(); ++comp) {
+      max_h = std::max(max_h, components_[comp]->h_factor_);
+      max_v = std::max(max_v, components_[comp]->v_factor_);
+    }
+    std::vector<std::vector<unsigned char> > planes(components_.size());
+    std::vector<unsigned char> samples;
+    for (int comp = 0; comp < components_.size(); ++comp) {
+      decoder.GetRedactedDCSamples(comp, &samples);
+      const int hf = components_[comp]->h_factor_;
+      const int vf = components_[comp]->v_factor_;
+      const int plane_width = decoder.GetDCPlaneWidth(comp);
+      planes[comp].resize(width * height);
+      for (int y = 0; y < height; ++y) {
+	const int y0 = y * dc_height / height;
+	const int y1 = std::max(y0 + 1, (y + 1) * dc_height / height);
+	for (int x = 0; x < width; ++x) {
+	  const int x0 = x * dc_width / width;
+	  const int x1 = std::max(x0 + 1, (x + 1) * dc_width / width);
+	  int sum = 0;
+	  for (int dy = y0; dy < y1; ++dy)
+	    for (int dx = x0; dx < x1; ++dx)
+	      sum += samples[(dy * vf / max_v) * plane_width + dx * hf / max_h];
+	  const int count = (x1 - x0) * (y1 - y0);
+	  planes[comp][y * width + x] = (sum + count / 2) / count;
+	}
+      }
+    }
+    std::vector<unsigned char> encoded;
+    JpegEncoder::EncodeImage(width, height, planes, kThumbnailQuality,
+			     &encoded);
     if (debug > 0)
-      printf("Redacting thumbnail\n");
-    int return_val = 0;
-    Jpeg *thumbnail = GetThumbnail();
-    if (thumbnail == NULL)
-      return 0;
-    
-    // Get thumbnail width/height
-    const int width = thumbnail->GetWidth();
-    const int height = thumbnail->GetHeight();
-    // scale the redaction object
-    Redaction *thumbnail_redaction = redaction->Copy();
-    thumbnail_redaction->Scale(width, height, GetWidth(), GetHeight());
-    // Call redaction to redact the SOS block.
-    thumbnail->DecodeImage(thumbnail_redaction, NULL);
-    delete thumbnail_redaction;
+      printf("Regenerated %dx%d thumbnail\n", width, height);
+    for (int i = 0; i < thumbnail_ifds.size(); ++i) {
+      Jpeg *thumbnail = new Jpeg;
+      try {
+	if (!thumbnail->LoadFromMemory(&encoded[0], encoded.size(), true))
+	  throw("Couldn't load the regenerated thumbnail");
+      } catch (const char *error) {
+	delete thumbnail;
+	throw(error);
+      }
+      thumbnail_ifds[i]->SetJpeg(thumbnail);
+    }
+  }
+
+  int Jpeg::RedactThumbnail(Redaction *redaction) {
+    std::vector<EmbeddedRedaction *> tasks;
+    StartEmbeddedRedactions(std::vector<Redaction *>(1, redaction), false,
+			    &tasks);
+    const int num_redacted = tasks.size();
+    FinishEmbeddedRedactions(&tasks, true);
+    return num_redacted;
   }
 
   // Parse the JPEG image stream, applying redaction if provided.
   void Jpeg::DecodeImage(Redaction *redaction,
 			 const char *pgm_save_filename) {
+    const Status status = DecodeAndRedact(redaction, pgm_save_filename, NULL);
+    // An image left unredacted mustn't be mistaken for a redacted one.
+    if (status.GetCode() == Status::kCantRedact)
+      throw("Couldn't write the redacted data");
+    if (status.GetCode() == Status::kEmbeddedNotRedacted) {
+      fprintf(stderr, "%s\n", status.ToString().c_str());
+      throw("Couldn't redact an embedded JPEG");
+    }
+    if (!status.Ok())
+      fprintf(stderr, "In Decoder: Caught error %s\n",
+	      status.ToString().c_str());
+  }
+
+  Status Jpeg::Decode(Redaction *redaction,
+		      std::vector<ScanDamage> *damage) {
+    if (softype_ != 0)
+      return Status(Status::kUnsupported, "Only baseline JPEGs are decoded",
+		    -1, -1);
+    const JpegMarker *sos_block = GetMarker(jpeg_sos);
+    if (sos_block == NULL || sos_block->data_.empty())
+      return Status(Status::kMalformed, "No scan data to decode", -1, -1);
+    try {
+      return DecodeAndRedact(redaction, NULL, damage);
+    } catch (const char *error) {
+      return Status(Status::kMalformed, error, -1, -1);
+    } catch (int) {
+      return Status(Status::kMalformed, "Couldn't decode the image", -1, -1);
+    } catch (...) {
+      return Status(Status::kMalformed, "Couldn't decode the image", -1, -1);
+    }
+  }
+
+  Status Jpeg::DecodeAndRedact(Redaction *redaction,
+			       const char *pgm_save_filename,
+			       std::vector<ScanDamage> *damage) {
+    // The embedded JPEGs are redacted while this one is decoded, unless
+    // they're to be made afresh from its DCs.
+    const bool regenerate = RegeneratesThumbnail(redaction);
+    std::vector<EmbeddedRedaction *> embedded;
+    if (redaction && !regenerate)
+      StartEmbeddedRedactions(std::vector<Redaction *>(1, redaction), false,
+			      &embedded);
+    Status status;
+    try {
+      status = DecodeScan(redaction, pgm_save_filename, regenerate, damage);
+    } catch (...) {
+      FinishEmbeddedRedactions(&embedded, false);
+      throw;
+    }
+    if (debug > 0 && redaction && !regenerate)
+      printf("Redacting thumbnail\n");
+    // By now the scan may be redacted, so this is told apart from an
+    // error that left it as it was.
+    try {
+      FinishEmbeddedRedactions(&embedded, true);
+    } catch (const char *error) {
+      return Status(Status::kEmbeddedNotRedacted, error, -1, -1);
+    }
+    return status;
+  }
+
+  void Jpeg::DecodeImage(const std::vector<Redaction *> &redactions,
+			 const char *pgm_save_filename) {
+    // The embedded JPEGs get the same set of variants.
+    std::vector<EmbeddedRedaction *> embedded;
+    StartEmbeddedRedactions(redactions, true, &embedded);
+    try {
+      const Status status = DecodeScan(redactions, pgm_save_filename);
+      if (status.GetCode() == Status::kCantRedact)
+	throw("Couldn't write the redacted data");
+      if (!status.Ok())
+	fprintf(stderr, "In Decoder: Caught error %s\n",
+		status.ToString().c_str());
+    } catch (...) {
+      FinishEmbeddedRedactions(&embedded, false);
+      throw;
+    }
+    FinishEmbeddedRedactions(&embedded, true);
+  }
+
+  Status Jpeg::DecodeScan(Redaction *redaction,
+			  const char *pgm_save_filename,
+			  bool regenerate_thumbnail,
+			  std::vector<ScanDamage> *damage) {
     JpegMarker *sos_block = GetMarker(jpeg_sos);
     unsigned char *data = (unsigned char *)(&sos_block->data_[0]);
     const int data_length = sos_block->length_ - 2;
     // First 2 bytes are slice, 00 0c 03 01 00 02 11 03 11 00 3f 00
     // then 03
-    // then addl info 9 more bytes.
+    // then addl info 9 more bytes (3 components).
     // Then huffman bits.
     // const int check_offset = 0;
     // const int check_len = 64;
-    data += 10;
+    const int header_length = sos_block->ScanHeaderLength();
+    data += header_length;
 
-    JpegDecoder decoder(width_, height_, data, 8 * (data_length - 10),
-			dhts_, &components_);
+    JpegDecoderSetup local_setup;
+    const JpegDecoderSetup *setup = GetDecoderSetup(&local_setup);
+    JpegDecoder decoder(width_, height_, data,
+			8 * (data_length - header_length),
+			*setup, &components_);
     if (debug > 0)
       printf("\n\nDecoding %lu\n", sos_block->data_.size());
     //  DumpHex((unsigned char*)&sos_block->data_[check_offset], check_len);
-    try {
-      decoder.Decode(redaction);
-    } catch (const char *text) {
-      fprintf(stderr, "In Decoder: Caught error %s\n", text);
-      //    throw(text);
-    }
-    decoder.ReorderImageData();
+    decoder.SetRecordRedactedDC(regenerate_thumbnail);
+    decoder.SetRestarts(restartinterval_, sos_block->restart_offsets_);
+    decoder.Decode(redaction);
+    if (damage)
+      *damage = decoder.GetDamage();
+    // Blocks the decoder didn't reach are left grey.
+    if (regenerate_thumbnail)
+      RegenerateThumbnails(decoder);
     if (pgm_save_filename != NULL) {
       int rv = decoder.WriteImageData(pgm_save_filename);
       if (rv != 0)
 	fprintf(stderr, "Couldn't write the decoded grey image to %s\n",
 		pgm_save_filename);
     }
-    if (redaction && redaction->NumRegions() > 0) {
-      // Keep the 10 byte header.
+    if (redaction && redaction->HasRegions()) {
+      // Keep the scan header.
       const std::vector<unsigned char> &redacted_data =
 	decoder.GetRedactedData();
+      // The scan is left as it was if the redaction couldn't be written.
+      if (!decoder.OutputOk())
+	return decoder.GetStatus();
       if (debug > 0)
 	printf("Redacted data length %lu bytes %d bits\n",
 	       redacted_data.size(),
 	       decoder.GetBitLength());
-      sos_block->data_.erase(sos_block->data_.begin() + 10,
+      sos_block->data_.erase(sos_block->data_.begin() + header_length,
 			     sos_block->data_.end());
       sos_block->data_.insert(sos_block->data_.end(),
 			      redacted_data.begin(),
 			      redacted_data.end());
-      sos_block->SetBitLength(decoder.GetBitLength() + 10 * 8);
+      sos_block->SetBitLength(decoder.GetBitLength() + header_length * 8);
+      sos_block->restart_offsets_ = decoder.GetRestartOffsets();
       if (debug > 0)
 	printf("sos block now %zu bytes\n", sos_block->data_.size());
     }
@@ -570,28 +1123,495 @@ namespace jpeg_redaction {
     if (debug > 0)
       printf("DecodeImage H %d W %d\n", width_, height_);
     //  DumpHex((unsigned char*)&sos_block->data_[check_offset], check_len);
-    if (redaction) RedactThumbnail(redaction);
+    return decoder.GetStatus();
+  }
+
+  Status Jpeg::DecodeScan(const std::vector<Redaction *> &redactions,
+			  const char *pgm_save_filename) {
+    JpegMarker *sos_block = GetMarker(jpeg_sos);
+    unsigned char *data = (unsigned char *)(&sos_block->data_[0]);
+    const int data_length = sos_block->length_ - 2;
+    const int header_length = sos_block->ScanHeaderLength();
+    data += header_length;
+
+    JpegDecoderSetup local_setup;
+    const JpegDecoderSetup *setup = GetDecoderSetup(&local_setup);
+    JpegDecoder decoder(width_, height_, data,
+			8 * (data_length - header_length),
+			*setup, &components_);
+    decoder.SetRestarts(restartinterval_, sos_block->restart_offsets_);
+    decoder.Decode(redactions);
+    if (pgm_save_filename != NULL) {
+      int rv = decoder.WriteImageData(pgm_save_filename);
+      if (rv != 0)
+	fprintf(stderr, "Couldn't write the decoded grey image to %s\n",
+		pgm_save_filename);
+    }
+    variant_scans_.resize(redactions.size());
+    variant_bits_.resize(redactions.size());
+    variant_restarts_.resize(redactions.size());
+    for (int i = 0; i < decoder.NumOutputs(); ++i) {
+      if (redactions[i] && redactions[i]->HasRegions()) {
+	variant_scans_[i] = decoder.GetRedactedData(i);
+	// No variants are kept if one couldn't be written.
+	if (!decoder.OutputOk()) {
+	  variant_scans_.clear();
+	  variant_bits_.clear();
+	  variant_restarts_.clear();
+	  return decoder.GetStatus();
+	}
+	variant_bits_[i] = decoder.GetBitLength(i);
+	variant_restarts_[i] = decoder.GetRestartOffsets(i);
+      } else {
+	// Unredacted: keep the original data.
+	variant_scans_[i].assign(sos_block->data_.begin() + header_length,
+				 sos_block->data_.end());
+	variant_bits_[i] = 8 * (data_length - header_length);
+	variant_restarts_[i] = sos_block->restart_offsets_;
+      }
+      if (debug > 0)
+	printf("Variant %d: %zu bytes %d bits\n",
+	       i, variant_scans_[i].size(), variant_bits_[i]);
+    }
+    return decoder.GetStatus();
+  }
+
+  void Jpeg::SelectVariant(int variant) {
+    if (variant < 0 || variant >= variant_scans_.size())
+      throw("No such variant in SelectVariant");
+    JpegMarker *sos_block = GetMarker(jpeg_sos);
+    const int header_length = sos_block->ScanHeaderLength();
+    sos_block->data_.resize(header_length);
+    sos_block->data_.insert(sos_block->data_.end(),
+			    variant_scans_[variant].begin(),
+			    variant_scans_[variant].end());
+    sos_block->SetBitLength(variant_bits_[variant] + header_length * 8);
+    sos_block->restart_offsets_ = variant_restarts_[variant];
+    std::vector<Jpeg *> embedded = GetEmbeddedJpegs();
+    for (int i = 0; i < embedded.size(); ++i)
+      if (embedded[i]->NumVariants() > variant)
+	embedded[i]->SelectVariant(variant);
+  }
+
+  int Jpeg::SaveVariants(const std::vector<std::string> &filenames) {
+    if (filenames.size() != variant_scans_.size())
+      throw("Need one filename per variant in SaveVariants");
+    for (int i = 0; i < filenames.size(); ++i) {
+      SelectVariant(i);
+      if (Save(filenames[i].c_str()) != 0)
+	return 1;
+    }
+    return 0;
   }
 
   int Jpeg::ReverseRedaction(const Redaction &redaction) {
     JpegMarker *sos_block = GetMarker(jpeg_sos);
-    // For each strip insert it into the JPEG data.
-    int data_bits = sos_block->GetBitLength();
+    if (redaction.NumStrips() == 0)
+      return 0;
+    if (!sos_block->restart_offsets_.empty())
+      throw("Can't reverse the redaction of a scan with restarts");
+    const unsigned char *redacted = &sos_block->data_[0];
+    const int redacted_bits = sos_block->GetBitLength();
     if (debug > 0)
       printf("Before patching size %zu bytes %d bits.\n",
-	     sos_block->data_.size(), data_bits);
-    // We pass the data with the header in it, so start at this bit.
-    int offset = 10 * 8;
+	     sos_block->data_.size(), redacted_bits);
+    // Build the restored scan in one sweep: copy the redacted data up to
+    // each strip, then the strip's original bits in place of its
+    // redacted ones.
+    // The data has the header in it, so strips start after this bit.
+    const int header_bits = sos_block->ScanHeaderLength() * 8;
+    std::vector<unsigned char> restored;
+    restored.reserve(sos_block->data_.size() + sos_block->data_.size() / 2);
+    int restored_bits = 0;
+    // The next bit of the redacted data to copy.
+    int read_bit = 0;
     for (int i = 0; i < redaction.NumStrips(); ++i) {
+      const JpegStrip *strip = redaction.GetStrip(i);
+      // Everything before the strip is as in the original, so the
+      // strip starts at its original position.
+      const int unchanged = header_bits + strip->GetSrcStart() - restored_bits;
+      if (unchanged < 0 || read_bit + unchanged > redacted_bits)
+	throw("Strips out of order in ReverseRedaction");
       if (debug > 0)
-	printf("Patching in strip %d\n", i);
-      // If we patch all the strips in, they need no offset.
-      int shift = redaction.GetStrip(i)->PatchIn(offset, &sos_block->data_,
-						 &data_bits);
-      sos_block->SetBitLength(data_bits);
-      //      offset += shift;
+	printf("Patching in strip %d at %d: %d->%d\n", i,
+	       restored_bits + unchanged, strip->GetReplacedByBits(),
+	       strip->GetBits());
+      BitShifts::AppendBits(&restored, &restored_bits, redacted, read_bit,
+			    unchanged);
+      read_bit += unchanged;
+      BitShifts::AppendBits(&restored, &restored_bits,
+			    redaction.GetStripData(i), 0, strip->GetBits());
+      read_bit += strip->GetReplacedByBits();
+    }
+    if (read_bit > redacted_bits)
+      throw("Strips overrun the data in ReverseRedaction");
+    BitShifts::AppendBits(&restored, &restored_bits, redacted, read_bit,
+			  redacted_bits - read_bit);
+    BitShifts::PadLastByte(&restored, restored_bits);
+    sos_block->data_.swap(restored);
+    sos_block->SetBitLength(restored_bits);
+    return 0;
+  }
+  int Jpeg::RestoreRegions(Redaction *redaction,
+			    const std::vector<int> &regions) {
+    JpegMarker *sos_block = GetMarker(jpeg_sos);
+    if (redaction->NumStrips() == 0)
+      return 0;
+    if (!sos_block->restart_offsets_.empty())
+      throw("Can't restore the regions of a scan with restarts");
+    const unsigned char *redacted = &sos_block->data_[0];
+    const int redacted_bits = sos_block->GetBitLength();
+    const int header_bits = sos_block->ScanHeaderLength() * 8;
+    const int num_components = components_.size();
+    // Which MCUs the regions that stay redacted cover.
+    int mcu_width, mcu_height, mcus_wide, mcus_high;
+    GetMCUGeometry(&mcu_width, &mcu_height, &mcus_wide, &mcus_high);
+    Redaction::Plan kept;
+    kept.Compile(*redaction, mcu_width, mcu_height, mcus_wide, mcus_high,
+		 &regions);
+    // Only needed where a strip follows straight on from another whose
+    // fate differs, so made on demand.
+    JpegDecoderSetup local_setup;
+    JpegDecoder *decoder = NULL;
+    std::vector<unsigned char> restored;
+    restored.reserve(sos_block->data_.size() + sos_block->data_.size() / 2);
+    int restored_bits = 0;
+    // The next bit of the redacted data to copy, and where that is in
+    // the original.
+    int read_bit = 0;
+    int src_bit = 0;
+    // The strips that stay redacted, and their data.
+    std::vector<JpegStrip> kept_strips;
+    std::vector<unsigned char> kept_data;
+    int kept_data_bits = 0;
+    bool previous_restored = false;
+    std::vector<int> src_dc(num_components);
+    std::vector<int> dest_dc(num_components);
+    try {
+      for (int i = 0; i < redaction->NumStrips(); ++i) {
+	JpegStrip strip = *redaction->GetStrip(i);
+	// Between the strips the data is original.
+	const int unchanged = header_bits + strip.GetSrcStart() - src_bit;
+	if (unchanged < 0 || read_bit + unchanged > redacted_bits)
+	  throw("Strips out of order in RestoreRegions");
+	BitShifts::AppendBits(&restored, &restored_bits, redacted, read_bit,
+			      unchanged);
+	read_bit += unchanged;
+	src_bit += unchanged;
+	bool restoring = (std::find(regions.begin(), regions.end(),
+				    strip.GetRegion()) != regions.end());
+	// Where another region covers it too, it stays redacted.
+	const int start_mcu = (strip.GetY() / mcu_height) * mcus_wide +
+	  strip.GetX() / mcu_width;
+	for (int mcu = start_mcu; mcu < strip.GetEndMCU() && restoring; ++mcu)
+	  if (kept.GetLabel(mcu) >= 0)
+	    restoring = false;
+	for (int comp = 0; comp < num_components; ++comp) {
+	  src_dc[comp] = strip.GetSrcDC(comp);
+	  dest_dc[comp] = strip.GetDestDC(comp);
+	}
+	// The output's DC predictors are the original ones unless the
+	// strip follows on from one that stays redacted.
+	const bool follows_redacted = (i > 0 && unchanged == 0 &&
+				       !previous_restored);
+	const std::vector<int> &output_dc = follows_redacted ? dest_dc : src_dc;
+	const std::vector<int> &coded_dc = restoring ? src_dc : dest_dc;
+	const int replaced_by_bits = strip.GetReplacedByBits();
+	const unsigned char *data = restoring ?
+	  redaction->GetStripData(i) : redacted;
+	const int start = restoring ? 0 : read_bit;
+	const int length = restoring ? strip.GetBits() : replaced_by_bits;
+	const int dest_start = restored_bits - header_bits;
+	if (debug > 0)
+	  printf("%s strip %d of region %d at %d\n",
+		 restoring ? "Restoring" : "Keeping", i, strip.GetRegion(),
+		 restored_bits);
+	int recoded_bits = 0;
+	if (coded_dc != output_dc) {
+	  if (decoder == NULL)
+	    decoder = new JpegDecoder(width_, height_, NULL, 0,
+				      *GetDecoderSetup(&local_setup),
+				      &components_);
+	  recoded_bits = decoder->RecodeFirstMCU(data, start, length, coded_dc,
+						 output_dc, &restored,
+						 &restored_bits);
+	}
+	if (restoring && recoded_bits > 0) {
+	  // The redacted strip before keeps the recoded MCU, as the MCU
+	  // after a region usually is, so it can still be restored.
+	  JpegStrip &before = kept_strips.back();
+	  BitShifts::AppendBits(&kept_data, &kept_data_bits, data, start,
+				recoded_bits);
+	  before.AddEdge(recoded_bits, restored_bits - header_bits -
+			 (before.GetDestStart() + before.GetReplacedByBits()));
+	}
+	BitShifts::AppendBits(&restored, &restored_bits, data,
+			      start + recoded_bits, length - recoded_bits);
+	if (!restoring) {
+	  // Its data starts on a byte of the new strip data.
+	  kept_data_bits = kept_data.size() * 8;
+	  const int data_offset = kept_data.size();
+	  BitShifts::AppendBits(&kept_data, &kept_data_bits,
+				redaction->GetStripData(i), 0, strip.GetBits());
+	  strip.SetRedacted(dest_start, output_dc);
+	  strip.SetDestEnd(data_offset, restored_bits - header_bits);
+	  kept_strips.push_back(strip);
+	}
+	read_bit += replaced_by_bits;
+	src_bit += strip.GetBits();
+	previous_restored = restoring;
+      }
+    } catch (const char *error) {
+      delete decoder;
+      throw(error);
+    }
+    delete decoder;
+    if (read_bit > redacted_bits)
+      throw("Strips overrun the data in RestoreRegions");
+    BitShifts::AppendBits(&restored, &restored_bits, redacted, read_bit,
+			  redacted_bits - read_bit);
+    BitShifts::PadLastByte(&restored, restored_bits);
+    sos_block->data_.swap(restored);
+    sos_block->SetBitLength(restored_bits);
+    redaction->SetStrips(kept_strips, kept_data);
+    return 0;
+  }
+  int Jpeg::VerifyRedaction(const Redaction &redaction,
+			     std::vector<RedactionViolation> *violations) {
+    JpegMarker *sos_block = GetMarker(jpeg_sos);
+    if (sos_block == NULL || sos_block->data_.empty())
+      throw("No scan data to verify");
+    const int header_length = sos_block->ScanHeaderLength();
+    int mcu_width, mcu_height, mcus_wide, mcus_high;
+    GetMCUGeometry(&mcu_width, &mcu_height, &mcus_wide, &mcus_high);
+    Redaction::Plan plan;
+    plan.Compile(redaction, mcu_width, mcu_height, mcus_wide, mcus_high);
+    JpegDecoderSetup local_setup;
+    JpegDecoder decoder(width_, height_, &sos_block->data_[header_length],
+			8 * (sos_block->data_.size() - header_length),
+			*GetDecoderSetup(&local_setup), &components_);
+    decoder.SetRestarts(restartinterval_, sos_block->restart_offsets_);
+    return decoder.Verify(plan, redaction.GetOverlay(), violations);
+  }
+
+  // Append a copy of a strip of redaction to strips, moved by src and dest
+  // bits, with its bits appended to strip_data.
+  static void AppendMovedStrip(const Redaction &redaction, int index,
+			       int src, int dest,
+			       std::vector<JpegStrip> *strips,
+			       std::vector<unsigned char> *strip_data) {
+    JpegStrip strip = *redaction.GetStrip(index);
+    const int data_offset = strip_data->size();
+    int data_bits = data_offset * 8;
+    BitShifts::AppendBits(strip_data, &data_bits,
+			  redaction.GetStripData(index), 0, strip.GetBits());
+    strip.Move(src, dest, data_offset);
+    strips->push_back(strip);
+  }
+
+  int Jpeg::AddRedaction(Redaction *redaction, const Redaction &extra) {
+    JpegMarker *sos_block = GetMarker(jpeg_sos);
+    if (!sos_block->restart_offsets_.empty())
+      throw("Can't add to the redaction of a scan with restarts");
+    const unsigned char *redacted = &sos_block->data_[0];
+    const int header_bits = sos_block->ScanHeaderLength() * 8;
+    const int redacted_bits = sos_block->GetBitLength() - header_bits;
+    const int num_components = components_.size();
+    int mcu_width, mcu_height, mcus_wide, mcus_high;
+    GetMCUGeometry(&mcu_width, &mcu_height, &mcus_wide, &mcus_high);
+    const int num_mcus = mcus_wide * mcus_high;
+    // Find the MCUs whose fate changes.
+    Redaction::Plan old_plan;
+    old_plan.Compile(*redaction, mcu_width, mcu_height, mcus_wide, mcus_high);
+    const int old_regions = redaction->NumRegions();
+    const int num_old_strips = redaction->NumStrips();
+    // Everything is built on a copy, and swapped in once nothing more
+    // can fail, so a throw leaves the redaction and the scan as they were.
+    Redaction merged(*redaction);
+    merged.Add(extra);
+    Redaction::Plan plan;
+    plan.Compile(merged, mcu_width, mcu_height, mcus_wide, mcus_high);
+    int first = -1;
+    int last = -1;
+    for (int mcu = 0; mcu < num_mcus; ++mcu) {
+      int old_label = old_plan.GetLabel(mcu);
+      if (old_label >= old_regions)
+	old_label += extra.NumRegions();
+      if (plan.GetLabel(mcu) != old_label ||
+	  plan.GetAction(mcu) != old_plan.GetAction(mcu) ||
+	  plan.GetPixellationSource(mcu) !=
+	  old_plan.GetPixellationSource(mcu)) {
+	if (first < 0)
+	  first = mcu;
+	last = mcu;
+      }
+    }
+    // The MCU each old strip starts at.
+    std::vector<int> strip_mcus(num_old_strips);
+    for (int i = 0; i < num_old_strips; ++i) {
+      const JpegStrip *strip = merged.GetStrip(i);
+      strip_mcus[i] = (strip->GetY() / mcu_height) * mcus_wide +
+	strip->GetX() / mcu_width;
+    }
+    // The span to decode ends at the first MCU after the changes outside
+    // the regions, where the redacted data is the original again. It
+    // starts where the original and redacted positions and predictors
+    // are known: at the top, or the start of a strip before the first
+    // change, early enough to decode the pixellation cells it needs.
+    int span_end = last + 1;
+    while (span_end < num_mcus &&
+	   plan.GetAction(span_end) != Redaction::Plan::action_copy)
+      ++span_end;
+    int start_strip = -1;
+    int span_start = 0;
+    if (plan.AveragesPixellation() && plan.NumCells() > 0) {
+      span_end = num_mcus;
+    } else if (first >= 0) {
+      int needed = first;
+      while (true) {
+	start_strip = -1;
+	for (int i = 0; i < num_old_strips; ++i)
+	  if (strip_mcus[i] <= needed && strip_mcus[i] < first)
+	    start_strip = i;
+	span_start = (start_strip >= 0) ? strip_mcus[start_strip] : 0;
+	int source = span_start;
+	for (int mcu = span_start; mcu < span_end; ++mcu) {
+	  const int cell_source = plan.GetPixellationSource(mcu);
+	  if (cell_source >= 0 && cell_source < source)
+	    source = cell_source;
+	}
+	if (source >= span_start)
+	  break;
+	needed = source;
+      }
+    }
+    if (debug > 0)
+      printf("AddRedaction: %d regions change MCUs %d to %d, "
+	     "decoding %d to %d of %d\n", extra.NumRegions(), first, last,
+	     span_start, span_end, num_mcus);
+    // The strips of the span, and the first after it.
+    const int first_strip = (start_strip >= 0) ? start_strip : 0;
+    int end_strip = first_strip;
+    while (end_strip < num_old_strips && strip_mcus[end_strip] < span_end)
+      ++end_strip;
+    // Where the span starts in the original and the redacted data.
+    int src_start = 0;
+    int dest_start = 0;
+    std::vector<int> src_dc(num_components, 0);
+    std::vector<int> dest_dc(num_components, 0);
+    if (start_strip >= 0) {
+      const JpegStrip *strip = merged.GetStrip(start_strip);
+      src_start = strip->GetSrcStart();
+      dest_start = strip->GetDestStart();
+      for (int comp = 0; comp < num_components; ++comp) {
+	src_dc[comp] = strip->GetSrcDC(comp);
+	dest_dc[comp] = strip->GetDestDC(comp);
+      }
+    }
+    // Where the span ends in the redacted data: the last bit the original
+    // data of the span is rebuilt up to.
+    const int tail_end = (end_strip < num_old_strips) ?
+      merged.GetStrip(end_strip)->GetDestStart() : redacted_bits;
+
+    std::vector<JpegStrip> strips;
+    std::vector<unsigned char> strip_data;
+    int redacted_end = dest_start;
+    int span_bits = 0;
+    std::vector<unsigned char> span;
+    if (first >= 0) {
+      // Rebuild the original data of the span by pasting the original
+      // bits of its strips into the redacted data.
+      std::vector<unsigned char> original;
+      int original_bits = 0;
+      int read_bit = dest_start;
+      int src_bit = src_start;
+      for (int i = first_strip; i < end_strip; ++i) {
+	const JpegStrip *strip = merged.GetStrip(i);
+	const int unchanged = strip->GetSrcStart() - src_bit;
+	if (unchanged < 0 || read_bit + unchanged > redacted_bits)
+	  throw("Strips out of order in AddRedaction");
+	BitShifts::AppendBits(&original, &original_bits, redacted,
+			      header_bits + read_bit, unchanged);
+	BitShifts::AppendBits(&original, &original_bits,
+			      merged.GetStripData(i), 0, strip->GetBits());
+	read_bit += unchanged + strip->GetReplacedByBits();
+	src_bit += unchanged + strip->GetBits();
+      }
+      if (read_bit > tail_end)
+	throw("Strips overrun the data in AddRedaction");
+      BitShifts::AppendBits(&original, &original_bits, redacted,
+			    header_bits + read_bit, tail_end - read_bit);
+      BitShifts::PadLastByte(&original, original_bits);
+      if (original.empty())
+	throw("No data to redact in AddRedaction");
+      // Redact the span, with its new strips appended to the old ones.
+      JpegDecoderSetup local_setup;
+      JpegDecoder decoder(width_, height_, &original[0],
+			  original.size() * 8,
+			  *GetDecoderSetup(&local_setup), &components_);
+      const int decoded_bits = decoder.DecodeRange(&merged, span_start,
+						   span_end, src_dc, dest_dc);
+      span = decoder.GetRedactedData();
+      span_bits = decoder.GetBitLength();
+      // The strips it replaced all ended within it.
+      redacted_end = dest_start + decoded_bits;
+      for (int i = first_strip; i < end_strip; ++i)
+	redacted_end += merged.GetStrip(i)->GetReplacedByBits() -
+	  merged.GetStrip(i)->GetBits();
+      if (redacted_end > tail_end)
+	throw("Span overruns the data in AddRedaction");
+    }
+
+    // Merge the strips: the old ones before the span, the span's own,
+    // and the old ones after, moved by the change in its length. The
+    // labels of the old masks move up past the new regions.
+    const int dest_shift = span_bits - (redacted_end - dest_start);
+    const int span_first = (first >= 0) ? first_strip : num_old_strips;
+    const int span_last = (first >= 0) ? end_strip : num_old_strips;
+    for (int i = 0; i < span_first; ++i)
+      AppendMovedStrip(merged, i, 0, 0, &strips, &strip_data);
+    for (int i = num_old_strips; i < merged.NumStrips(); ++i)
+      AppendMovedStrip(merged, i, src_start, dest_start,
+		       &strips, &strip_data);
+    const int span_strips = merged.NumStrips() - num_old_strips;
+    for (int i = span_last; i < num_old_strips; ++i)
+      AppendMovedStrip(merged, i, 0, dest_shift, &strips, &strip_data);
+    for (int i = 0; i < strips.size(); ++i) {
+      const bool old = (i < span_first || i >= span_first + span_strips);
+      if (old && strips[i].GetRegion() >= old_regions)
+	strips[i].SetRegion(strips[i].GetRegion() + extra.NumRegions());
+    }
+    merged.SetStrips(strips, strip_data);
+
+    std::vector<unsigned char> scan;
+    int scan_bits = 0;
+    if (first >= 0) {
+      // Splice the span into the scan.
+      scan.reserve(sos_block->data_.size() + span.size());
+      BitShifts::AppendBits(&scan, &scan_bits, redacted, 0,
+			    header_bits + dest_start);
+      BitShifts::AppendBits(&scan, &scan_bits, &span[0], 0, span_bits);
+      BitShifts::AppendBits(&scan, &scan_bits, redacted,
+			    header_bits + redacted_end,
+			    redacted_bits - redacted_end);
+      BitShifts::PadLastByte(&scan, scan_bits);
     }
+    // Nothing more can fail, so the new scan and strips replace the old.
+    if (first >= 0) {
+      sos_block->data_.swap(scan);
+      sos_block->SetBitLength(scan_bits);
+    }
+    redaction->Swap(&merged);
+
+    // The embedded JPEGs keep no strips, so are just redacted again.
+    Redaction embedded_extra(extra);
+    std::vector<EmbeddedRedaction *> embedded;
+    StartEmbeddedRedactions(std::vector<Redaction *>(1, &embedded_extra),
+			    false, &embedded);
+    FinishEmbeddedRedactions(&embedded, true);
+    return 0;
   }
+
   int Jpeg::RemoveIPTC() {
     if (photoshop3_  != NULL) {
       delete photoshop3_;
@@ -616,12 +1636,12 @@ namespace jpeg_redaction {
     // payload length which assumes there were 2 bytes of length.
     JpegMarker *markerptr = AddMarker(jpeg_sos, location, length + 2 - 2,
 				      pFile, loadall);
+    markerptr->slice_ = slice;
     if (loadall)
       markerptr->RemoveStuffBytes();
     int rv = fseek(pFile, 2, SEEK_CUR);
     if (rv != 0)
       throw("Fail seeking in AddSOMarker");
-    markerptr->slice_ = slice;
     return markerptr;
   }
   // The length is the length from the file, including the storage for length.
@@ -30,13 +30,20 @@
 #include <stdio.h>
 #include "tiff_ifd.h"
 #include "obscura_metadata.h"
+#include "redaction_estimate.h"
+#include "status.h"
 
 namespace jpeg_redaction {
 
 class Iptc;
+class JpegDecoder;
+class JpegDecoderCache;
+class JpegDecoderSetup;
 class JpegDHT;
+class JpegDQT;
 class JpegMarker;
 class Redaction;
+class RedactionViolation;
 
 class Photoshop3Block;
 class Jpeg {
@@ -69,23 +76,105 @@ public:
     int table_;
   };
   // Trivial constructor.
-  Jpeg() : filename_(""), width_(0), height_(0), photoshop3_(NULL) {};
+  Jpeg() : filename_(""), width_(0), height_(0), bits_per_sample_(8),
+	   softype_(-1), restartinterval_(0), photoshop3_(NULL), decoder_cache_(NULL) {};
   virtual ~Jpeg();
   // Construct from a file. loadall indicates whether to load all
   // data blocks, or just parse the file and extract metadata.
   bool LoadFromFile(char const * const pczFilename, bool loadall);
   int LoadFromFile(FILE *pFile, bool loadall, int offset);
+  // Construct from a JPEG image in memory.
+  bool LoadFromMemory(const unsigned char *data, int length, bool loadall);
+  // Load from a file or memory without throwing: what was wrong with
+  // the data, and where, is returned instead.
+  Status Load(const char *filename, bool loadall);
+  Status Load(const unsigned char *data, int length, bool loadall);
+  // Share decoder tables and geometry with other images through cache,
+  // which isn't owned and must outlive the decoding. Set it before
+  // loading so the tables aren't built at all when the cache has them.
+  void SetDecoderCache(JpegDecoderCache *cache) { decoder_cache_ = cache; }
 
   // Parse the JPEG data and redact if Redaction regions are supplied.
   // If pgm_save_filename is provided, write the decoded image to that file.
 
   void DecodeImage(Redaction *redaction, const char *pgm_save_filename);
+  // DecodeImage without throwing, returning the first error. Bad scan
+  // data, which DecodeImage only logs, damages the MCUs from where it's
+  // found to the next restart marker (or the end of the image), where
+  // the decoding picks up again. Damaged MCUs are written grey, so
+  // nothing is left of them unredacted, and listed in damage if it's
+  // not NULL. If the redacted scan can't be written the scan is left
+  // as it was and kCantRedact returned, and if an embedded JPEG can't
+  // be redacted kEmbeddedNotRedacted is (where DecodeImage throws for
+  // both). See status.h for which codes leave the image changed.
+  Status Decode(Redaction *redaction,
+		std::vector<ScanDamage> *damage = NULL);
+  // Parse the JPEG data once, making a differently redacted variant of
+  // the image (and its thumbnail) for each of the redactions.
+  // Select one with SelectVariant before saving it.
+  void DecodeImage(const std::vector<Redaction *> &redactions,
+		   const char *pgm_save_filename);
+  int NumVariants() const { return variant_scans_.size(); }
+  // Make the image data that of one of the variants from DecodeImage.
+  // All the other markers and metadata are shared.
+  void SelectVariant(int variant);
+  // Save each variant in turn. Return 0 on success.
+  int SaveVariants(const std::vector<std::string> &filenames);
   // Invert the redaction by pasting in the strips from redaction.
+  // This, RestoreRegions and AddRedaction don't work on scans with
+  // restart markers.
   int ReverseRedaction(const Redaction &redaction);
+  // Invert the redaction of only some regions, given by their indices
+  // as in Redaction::GetLabelRegion. MCUs that other regions also cover
+  // stay redacted. The restored strips are pasted in and removed from
+  // redaction, and the others are updated so they can be restored later.
+  // Regions restored by an earlier call should be given again to reveal
+  // the MCUs they shared with those restored now.
+  // Beyond copying the scan, the only decoding is of the first MCU of
+  // each strip that follows on from one whose fate differs, to recode
+  // its DCs.
+  int RestoreRegions(Redaction *redaction, const std::vector<int> &regions);
+  // Redact the regions of extra as well, in an image already redacted
+  // by DecodeImage with redaction. The regions and masks of extra are
+  // added to redaction, so they take the labels after its own regions
+  // (those of its masks move up), and its strips are merged with the new
+  // ones, which hold the original data too: reversing the redaction, or
+  // restoring the regions of either, works as if they'd been redacted
+  // together.
+  // Only the MCUs from the start of a strip before the first that changes
+  // to the end of the last are decoded, and the rest of the scan is
+  // copied. The embedded JPEGs are redacted with extra too.
+  int AddRedaction(Redaction *redaction, const Redaction &extra);
+  // Check the scan is redacted by redaction, by parsing it once:
+  // every MCU in a region must have no AC coefficients and the DC its
+  // region's method writes (or the overlay tile's blocks). Append each
+  // MCU that isn't to violations, if it's not NULL, and return how many
+  // there were. The embedded JPEGs aren't checked.
+  int VerifyRedaction(const Redaction &redaction,
+		      std::vector<RedactionViolation> *violations = NULL);
   int GetHeight() const { return height_; }
   int GetWidth() const { return width_; }
+  // The MCU size in pixels and the image size in MCUs, for compiling a
+  // Redaction::Plan for images like this one.
+  void GetMCUGeometry(int *mcu_width, int *mcu_height,
+		      int *mcus_wide, int *mcus_high) const;
+  // Estimate what DecodeImage(&redaction, NULL) would cost, from the
+  // headers and the regions alone, so the image can be loaded without
+  // its data (loadall false) to decide where to redact it. The embedded
+  // JPEGs, redacted alongside, are included.
+  RedactionEstimate EstimateRedaction(
+      const Redaction &redaction,
+      const RedactionCostModel &model = RedactionCostModel()) const;
   Jpeg *GetThumbnail();
+  // The JPEGs embedded in the IFDs, such as the thumbnail.
+  std::vector<Jpeg *> GetEmbeddedJpegs() const;
+  // Redact the embedded JPEGs with copies of redaction scaled to each.
+  // Return how many there were. DecodeImage does this itself, alongside
+  // decoding the main image.
   int RedactThumbnail(Redaction *redaction);
+  // Thumbnails made by Redaction::SetRegenerateThumbnail fit in
+  // kThumbnailSize pixels square.
+  enum { kThumbnailSize = 160, kThumbnailQuality = 75 };
   // Save the current (possibly redacted) version of the JPEG out.
   // Return 0 on success.
   int Save(const char * const filename);
@@ -154,16 +243,61 @@ public:
   JpegMarker *AddMarker(int marker, int location, int length,
                         FILE *pFile, bool loadall);
 protected:
+  // Decode (and redact) the scan of this image alone, and if
+  // regenerate_thumbnail, replace the thumbnails from its DCs.
+  // Return the decoder's status, and its damage if damage isn't NULL.
+  Status DecodeScan(Redaction *redaction, const char *pgm_save_filename,
+		    bool regenerate_thumbnail, std::vector<ScanDamage> *damage);
+  Status DecodeScan(const std::vector<Redaction *> &redactions,
+		    const char *pgm_save_filename);
+  // DecodeImage, returning the status of decoding the scan.
+  Status DecodeAndRedact(Redaction *redaction, const char *pgm_save_filename,
+			 std::vector<ScanDamage> *damage);
+  // Load from an open file, catching the errors.
+  Status Load(FILE *pFile, bool loadall);
+  // Replace each thumbnail with one encoded from the DC planes of the
+  // decoder's redacted output.
+  void RegenerateThumbnails(const JpegDecoder &decoder);
+  // Are the thumbnails made afresh for redaction (which may be NULL):
+  // only an 8 bit grey or colour image's can be.
+  bool RegeneratesThumbnail(const Redaction *redaction) const;
+  class EmbeddedRedaction;
+  // Start redacting each embedded JPEG with copies of the redactions
+  // scaled to it, making one variant per redaction if variants is set.
+  // The copies are made here, so each embedded JPEG can be decoded on a
+  // thread of its own (unless debugging) while the caller decodes this.
+  void StartEmbeddedRedactions(const std::vector<Redaction *> &redactions,
+			       bool variants,
+			       std::vector<EmbeddedRedaction *> *tasks);
+  // Wait for the redactions to finish and delete them. If report_errors,
+  // throw the first error any of them caught.
+  static void FinishEmbeddedRedactions(
+      std::vector<EmbeddedRedaction *> *tasks, bool report_errors);
   // After loading an SO Marker, remove the stuff bytes so the bitstream
   // can be read more easily.
   void RemoveStuffBytes();
-  void BuildDHTs(const JpegMarker *dht_block);
+  void BuildDHTs(const JpegMarker *dht_block, std::vector<JpegDHT*> *dhts);
+  void BuildDQTs(const JpegMarker *dqt_block, std::vector<JpegDQT*> *dqts);
+  // Build dhts_ and dqts_ if loading left it to the decoder cache.
+  void BuildTables();
+  // The number of bits to shift luma DC values down by so they fit in
+  // a byte, derived from the DC quantizer and the sample precision.
+  int LumaDCGain(const std::vector<JpegDQT*> &dqts) const;
+  // The bytes of the SOF, DHT and DQT markers, which determine the
+  // decoder setup.
+  void DecoderSetupKey(std::vector<unsigned char> *key) const;
+  // Get the decoder setup from the cache if there is one, building and
+  // caching it if need be. Otherwise (or if the cache is full) fill in
+  // and return local.
+  const JpegDecoderSetup *GetDecoderSetup(JpegDecoderSetup *local);
   int ReadSOSMarker(FILE *pFile, unsigned int blockloc, bool loadall);
   int LoadExif(FILE *pFile, unsigned int blockloc, bool loadall);
 
   std::vector<JpegMarker*> markers_;
   int width_;
   int height_;
+  // Sample precision from the SOF.
+  int bits_per_sample_;
   int softype_;
   std::vector<TiffIfd *> ifds_;
   std::string filename_;
@@ -173,6 +307,13 @@ protected:
 
   Photoshop3Block *photoshop3_;
   std::vector<JpegDHT*> dhts_;
+  std::vector<JpegDQT*> dqts_;
+  JpegDecoderCache *decoder_cache_;
+  // Redacted scan data (without the scan header) and its length in bits
+  // for each variant made by DecodeImage.
+  std::vector<std::vector<unsigned char> > variant_scans_;
+  std::vector<int> variant_bits_;
+  std::vector<std::vector<int> > variant_restarts_;
   std::vector<JpegComponent*> components_;
   ObscuraMetadata obscura_metadata_;
 };  // Jpeg
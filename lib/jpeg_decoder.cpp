@@ -18,8 +18,11 @@
 
 
 // JpegDecoder class: parse the JPEG encoded data.
+#include <limits.h>
 #include <stdio.h>
+#include <algorithm>
 #include "jpeg_decoder.h"
+#include "jpeg_decoder_cache.h"
 #include "jpeg.h"
 #include "jpeg_dht.h"
 
@@ -31,71 +34,147 @@ const int JpegDecoder::kRedactingInactive = 1;
 const int JpegDecoder::kRedactingOff = 0;
 
 const int JpegDecoder::kBlockSize = 8;
+const int JpegDecoder::kNoCellDC = INT_MIN;
+const int JpegDecoder::kBlockSkip;
+const int JpegDecoder::kBlockRedact;
+const int JpegDecoder::kBlockEdge;
+const int JpegDecoder::kBlockRecord;
 JpegDecoder::JpegDecoder(int w, int h,
 			 unsigned char *data,
 			 int length,  // in bits
-			 const std::vector<JpegDHT *> &dhts,
+			 const JpegDecoderSetup &setup,
 			 const std::vector<Jpeg::JpegComponent*> *components) :
-  height_(h), width_(w), components_(components), current_strip_(NULL) {
+  height_(h), width_(w), initial_dct_gain_(setup.dct_gain_),
+  components_(components), current_strip_(-1), plan_(NULL), overlay_(NULL),
+  record_redacted_dc_(false) {
   data_ = data;
   length_ = length;
-  mcu_h_ = 1;
-  mcu_v_ = 1;
+  restart_interval_ = 0;
+  mcu_start_bit_ = 0;
+  mcu_output_bits_ = 0;
   ResetDecoding();
-  // Build a temp table of the DHTs to use for each component
-  // and find the size of the MCU.
-  for (int comp = 0; comp < components->size(); ++comp) {
-    if ((*components)[comp]->h_factor_ > mcu_h_)
-      mcu_h_ = (*components)[comp]->h_factor_;
-    if ((*components)[comp]->v_factor_ > mcu_v_)
-      mcu_v_ = (*components)[comp]->v_factor_;
-    JpegDHT *ac_dht = NULL;
-    JpegDHT *dc_dht = NULL;
-    int i;
-    for (i = 0; i < dhts.size() &&
-	   (ac_dht == NULL || dc_dht == NULL); ++i) {
-      if (dhts[i]->id_ == (*components)[comp]->table_) {
-	if (debug > 0)
-	  printf("Comp %d %d%s DHT: %d\n",
-		 comp, dhts[i]->class_, (dhts[i]->class_? "AC":"DC"), i);
-	if (dhts[i]->class_ == 0)
-	  dc_dht = dhts[i];
-	else
-	  ac_dht = dhts[i];
-      }
-    }
-    if (ac_dht == NULL || dc_dht == NULL) {
-      for (int i = 0; i < dhts.size(); ++i)
-      	fprintf(stderr, "DHT %d %p id %d\n", i, dhts[i], dhts[i]->id_);
-      fprintf(stderr, "comp %d of %zu table %d dhts %zu AC %p dc %p\n",
-      	     comp, components->size(),
-      	     (*components)[comp]->table_, dhts.size(), ac_dht, dc_dht);
-      throw("Can't find DHT table in JpegDecoder::JpegDecoder " __FILE__);
-    }
-    dhts_.push_back(dc_dht);
-    dhts_.push_back(ac_dht);
-  }
+  // The tables and geometry are shared, so copying them is all the
+  // per-image setup there is.
+  dhts_ = setup.component_dhts_;
+  quantizers_ = setup.component_quantizers_;
+  mcu_h_ = setup.mcu_h_;
+  mcu_v_ = setup.mcu_v_;
+  w_blocks_ = setup.w_blocks_;
+  h_blocks_ = setup.h_blocks_;
+  num_mcus_ = setup.num_mcus_;
   if (dhts_.size() != components->size() * 2)
     throw("dhts_ table size is wrong");
-  // The dimensions of the MCUs in pixels.
-  const int hq = kBlockSize * mcu_h_;
-  const int vq = kBlockSize * mcu_v_;
   dc_values_.resize(components->size(), 0);
-  redaction_dc_.resize(components->size(), 0);
-  // How many 8x8 blocks there will be in each direction.
-  w_blocks_ = mcu_h_ * ((width_ + hq -1)/hq);
-  h_blocks_ = mcu_v_ * ((height_ + vq -1)/vq);
-  // How many MCUs there are in the image.
-  num_mcus_ = (w_blocks_/mcu_h_) * (h_blocks_/ mcu_v_);
   if (debug > 0)
     printf("Expect %d MCUS. %dx%d blocks h:%d v:%d\n",
 	   num_mcus_, w_blocks_, h_blocks_, mcu_h_, mcu_v_);
-  image_data_.reserve(num_mcus_ * mcu_h_ * mcu_v_);
-  int_image_data_.reserve(num_mcus_ * (2 + mcu_h_ * mcu_v_));
+  image_data_.resize(w_blocks_ * h_blocks_, 0);
+  // One DC plane per component, at that component's block resolution.
+  dc_planes_.resize(components->size());
+  dc_plane_widths_.resize(components->size());
+  dc_plane_heights_.resize(components->size());
+  dc_plane_offsets_.resize(components->size(), 0);
+  for (int comp = 0; comp < components->size(); ++comp) {
+    dc_plane_widths_[comp] =
+      (w_blocks_ / mcu_h_) * (*components)[comp]->h_factor_;
+    dc_plane_heights_[comp] =
+      (h_blocks_ / mcu_v_) * (*components)[comp]->v_factor_;
+    dc_planes_[comp].resize(dc_plane_widths_[comp] * dc_plane_heights_[comp],
+			    0);
+  }
+  SelectMCUDecoder();
+  BuildSolidMCU();
+}
+
+void JpegDecoder::BuildSolidMCU() {
+  solid_mcu_data_.clear();
+  solid_mcu_bits_ = 0;
+  for (int comp = 0; comp < components_->size(); ++comp) {
+    const Jpeg::JpegComponent *component = (*components_)[comp];
+    JpegDHT *dc_dht = dhts_[2 * component->table_];
+    JpegDHT *ac_dht = dhts_[2 * component->table_ + 1];
+    const int dc_zero = dc_dht->Lookup(0);
+    const int eob = ac_dht->eob_symbol_;
+    if (dc_zero < 0 || eob < 0) {
+      solid_mcu_data_.clear();
+      solid_mcu_bits_ = 0;
+      return;
+    }
+    // Code the block once, then copy it for the others.
+    unsigned char word[4];
+    const unsigned int bits =
+      (dc_dht->codes_[dc_zero] << ac_dht->lengths_[eob]) |
+      ac_dht->codes_[eob];
+    const int length = dc_dht->lengths_[dc_zero] + ac_dht->lengths_[eob];
+    for (int i = 0; i < 4; ++i)
+      word[i] = (bits << (32 - length)) >> (24 - 8 * i);
+    for (int b = 0; b < component->h_factor_ * component->v_factor_; ++b)
+      BitShifts::AppendBits(&solid_mcu_data_, &solid_mcu_bits_, word, 0,
+			    length);
+  }
+}
+
+// Fill in the decoders for each block mode for a specialized layout.
+template <int kNumComponents, int kLumaH, int kLumaV>
+void JpegDecoder::SetLayoutDecoders() {
+  decode_mcu_[kBlockSkip] =
+    &JpegDecoder::DecodeOneMCULayout<kBlockSkip, kNumComponents,
+				     kLumaH, kLumaV>;
+  decode_mcu_[kBlockRedact] =
+    &JpegDecoder::DecodeOneMCULayout<kBlockRedact, kNumComponents,
+				     kLumaH, kLumaV>;
+  decode_mcu_[kBlockEdge] =
+    &JpegDecoder::DecodeOneMCULayout<kBlockEdge, kNumComponents,
+				     kLumaH, kLumaV>;
+  decode_mcu_[kBlockRecord] =
+    &JpegDecoder::DecodeOneMCULayout<kBlockRecord, kNumComponents,
+				     kLumaH, kLumaV>;
+}
+
+// Pick a specialized MCU decoder if the components match one of the
+// common layouts, otherwise fall back to the generic loop.
+void JpegDecoder::SelectMCUDecoder() {
+  decode_mcu_[kBlockSkip] = &JpegDecoder::DecodeOneMCU<kBlockSkip>;
+  decode_mcu_[kBlockRedact] = &JpegDecoder::DecodeOneMCU<kBlockRedact>;
+  decode_mcu_[kBlockEdge] = &JpegDecoder::DecodeOneMCU<kBlockEdge>;
+  decode_mcu_[kBlockRecord] = &JpegDecoder::DecodeOneMCU<kBlockRecord>;
+  const int num_components = components_->size();
+  if (num_components != 1 && num_components != 3)
+    return;
+  const Jpeg::JpegComponent *luma = (*components_)[0];
+  if (luma->table_ != 0)
+    return;
+  for (int comp = 1; comp < num_components; ++comp) {
+    const Jpeg::JpegComponent *chroma = (*components_)[comp];
+    if (chroma->h_factor_ != 1 || chroma->v_factor_ != 1 ||
+	chroma->table_ != 1)
+      return;
+  }
+  const int hf = luma->h_factor_;
+  const int vf = luma->v_factor_;
+  if (num_components == 1) {
+    if (hf == 1 && vf == 1)  // Greyscale
+      SetLayoutDecoders<1, 1, 1>();
+  } else if (hf == 1 && vf == 1) {  // 4:4:4
+    SetLayoutDecoders<3, 1, 1>();
+  } else if (hf == 2 && vf == 1) {  // 4:2:2
+    SetLayoutDecoders<3, 2, 1>();
+  } else if (hf == 2 && vf == 2) {  // 4:2:0
+    SetLayoutDecoders<3, 2, 2>();
+  }
+  if (debug > 1)
+    printf("MCU decoder %s for %d components %dx%d\n",
+	   (decode_mcu_[kBlockSkip] == &JpegDecoder::DecodeOneMCU<kBlockSkip>) ?
+	   "generic" : "specialized",
+	   num_components, hf, vf);
 }
 
 void JpegDecoder::WriteZeroLength(int which_dht) {
     const int eob = dhts_[which_dht]->eob_symbol_;
+    if (eob < 0) {
+      FailOutput("Huffman table has no code for zero");
+      return;
+    }
     const int eob_len = dhts_[which_dht]->lengths_[eob];
     const unsigned int code = dhts_[which_dht]->codes_[eob];
     if (debug > 2) printf("Redacting this block, %x\n", code);
@@ -129,59 +208,263 @@ int JpegDecoder::WriteValue(int which_dht, int value) {
   return 0;
 }
 
-void JpegDecoder::SetRedactingState(Redaction *redaction) {
-  // Determine if we're in or on the edge of.
-  region_index_ = InRedactionRegion(redaction);
-  if (region_index_ >= 0) {
+void JpegDecoder::SetRedactingState() {
+  // The plan says if we're in or on the edge of a region.
+  region_index_ = plan_->GetLabel(mcus_);
+  if (region_index_ >= 0)
     redaction_method_ =
-      redaction->GetRegion(region_index_).GetRedactionMethod();
-    if (redacting_ == kRedactingInactive) {
-      redacting_ = kRedactingStarting;  // Start.
-      if (current_strip_ != NULL) throw("Strip already exists");
-      current_strip_ = new JpegStrip(GetX(mcus_), GetY(mcus_),
-				     data_pointer_ - num_bits_, 
-				     redaction_bit_pointer_);
-    } else {
-      redacting_ = kRedactingActive;  // Steady state redacting.
-    }
-  } else { // Not in redaction region (any more?)
-    if (redacting_ == kRedactingStarting ||
-	redacting_ == kRedactingActive) {
-      redacting_ = kRedactingEnding;  // Transition out.
-      //      printf("Transition out at %d\n", mcus_);
-    } else {
-      redacting_ = kRedactingInactive;  // (Now) in steady state.
-    }
+      plan_->GetLabelRegion(region_index_).GetRedactionMethod();
+  switch (plan_->GetAction(mcus_)) {
+  case Redaction::Plan::action_start:
+    redacting_ = kRedactingStarting;  // Start.
+    // Moving straight on to another region ends its strip here.
+    if (current_strip_ >= 0)
+      StoreEndOfStrip(redaction_);
+    // The strip starts where the pass-through data stops.
+    FlushCopiedBits();
+    current_strip_ = redaction_->BeginStrip(GetX(mcus_), GetY(mcus_),
+					    data_pointer_ - num_bits_, 
+					    redaction_bit_pointer_,
+					    region_index_, dc_values_,
+					    redaction_dc_);
+    break;
+  case Redaction::Plan::action_redact:
+    redacting_ = kRedactingActive;  // Steady state redacting.
+    break;
+  case Redaction::Plan::action_edge:
+    redacting_ = kRedactingEnding;  // Transition out.
+    break;
+  default:
+    redacting_ = kRedactingInactive;  // (Now) in steady state.
   }
 }
 
-void JpegDecoder::Decode(Redaction *redaction) {
-  redaction_ = redaction;
-  ResetDecoding();
-  if (redaction != NULL && redaction->NumRegions() > 0) {
+// Set up the output state to write a redacted version with redaction_.
+void JpegDecoder::StartOutput() {
+  redacting_ = kRedactingOff;
+  redacted_data_.clear();
+  redaction_bit_pointer_ = 0;
+  copy_start_ = -1;
+  current_strip_ = -1;
+  plan_ = NULL;
+  cell_dc_.clear();
+  redacted_dcs_.clear();
+  redacted_restarts_.clear();
+  redaction_dc_.assign(components_->size(), 0);
+  if (redaction_ != NULL && redaction_->HasRegions()) {
     redacting_ = kRedactingInactive;
+    redaction_->CompileRegions(kBlockSize * mcu_h_, kBlockSize * mcu_v_,
+			       w_blocks_ / mcu_h_, h_blocks_ / mcu_v_);
+    plan_ = &redaction_->GetPlan();
+    cell_dc_.assign(plan_->NumCells() * components_->size(), kNoCellDC);
+    overlay_ = NULL;
+    if (plan_->UsesMethod(Redaction::redact_overlay))
+      SelectOverlay(redaction_->GetOverlay());
     // Reserve space for the redacted data- should be smaller than the original.
     redacted_data_.reserve(((length_ + 7) >> 3) + 2); // For end marker later.
   }
+}
+
+void JpegDecoder::SelectOverlay(const OverlayTile *tile) {
+  if (tile == NULL)
+    tile = OverlayTile::Default();
+  local_overlays_.push_back(OverlayEncoding());
+  overlay_ = tile->GetEncoding(quantizers_[0], dhts_[1],
+			       &local_overlays_.back());
+  if (overlay_ != &local_overlays_.back())
+    local_overlays_.pop_back();
+}
+
+// Update the redaction state for the MCU about to be decoded and
+// return the block kernel that the output needs for it.
+// Blocks that pass through unchanged are only parsed, and their bits
+// are copied in bulk later.
+int JpegDecoder::StartMCU() {
+  if (redacting_ == kRedactingOff)
+    return kBlockSkip;
+  mcu_start_bit_ = data_pointer_ - num_bits_;
+  mcu_output_bits_ = redaction_bit_pointer_;
+  mcu_output_dc_ = redaction_dc_;
+  SetRedactingState();
+  if (redacting_ == kRedactingStarting || redacting_ == kRedactingActive) {
+    // Inside a solid region the MCUs are all the same, so write the
+    // coded MCU and only parse the original.
+    if (SolidMCUReady()) {
+      BitShifts::AppendBits(&redacted_data_, &redaction_bit_pointer_,
+			    &solid_mcu_data_[0], 0, solid_mcu_bits_);
+      if (record_redacted_dc_)
+	RecordSolidMCU();
+      return kBlockSkip;
+    }
+    return kBlockRedact;
+  }
+  if (redacting_ == kRedactingEnding)
+    return kBlockEdge;
+  if (copy_start_ < 0)
+    copy_start_ = data_pointer_ - num_bits_;
+  return kBlockSkip;
+}
+
+// After an MCU is decoded (and mcus_ incremented).
+void JpegDecoder::EndMCU() {
+  if (redacting_ == kRedactingInactive)
+    redaction_dc_.assign(dc_values_.begin(), dc_values_.end());
+  // When stopping redacting, 
+  // for simplicity we actually store the whole MCU,
+  // even though most of it is unchanged. (Interleaved components
+  // mean the changed bits are spread among the unchanged portions).
+  if (redacting_ == kRedactingEnding)
+    StoreEndOfStrip(redaction_);
+}
+
+void JpegDecoder::EndOutput() {
+  FlushCopiedBits();
+  // Terminating when still active.
+  if (redacting_ == kRedactingStarting || redacting_ == kRedactingActive)
+      StoreEndOfStrip(redaction_);
+}
+
+bool JpegDecoder::DecodeMCU(int mode) {
+  (this->*decode_mcu_[mode])();
+  if (status_.Ok())
+    return true;
+  if (debug > 0)
+    fprintf(stderr, "DecodeOneMCU: %s at MCU %d of %d\n",
+	    status_.GetMessage().c_str(), mcus_, num_mcus_);
+  return false;
+}
 
+void JpegDecoder::Prescan() {
+  ResetDecoding();
+  bad_intervals_.clear();
+  // An interval with a bad code is damaged from there anyway.
+  bool failed = false;
   while (mcus_ < num_mcus_) {
-    if (redacting_ != kRedactingOff) {
-      SetRedactingState(redaction);
+    if (AtRestart()) {
+      const int interval = mcus_ / restart_interval_ - 1;
+      if (!RestartInput() && !failed) {
+	bad_intervals_.resize(interval + 1);
+	bad_intervals_[interval] =
+	  Status(Status::kBadRestart, "Data doesn't end at the restart marker",
+		 (interval > 0) ? restart_offsets_[interval - 1] : 0,
+		 interval * restart_interval_);
+      }
+      failed = false;
+    }
+    SetMCUOffsets();
+    if (!DecodeMCU(kBlockSkip)) {
+      mcus_ = Resync();
+      failed = true;
+      continue;
     }
-    // Find the matching symbol.
-    DecodeOneMCU();
     ++mcus_;
-    // When stopping redacting, 
-    // for simplicity we actually store the whole MCU,
-    // even though most of it is unchanged. (Interleaved components
-    // mean the changed bits are spread among the unchanged portions).
-    if (redacting_ == kRedactingEnding)
-      StoreEndOfStrip(redaction);
   }
+  ResetDecoding();
+  dc_values_.assign(components_->size(), 0);
+}
 
-  // Terminating when still active.
-  if (redacting_ == kRedactingActive)
-      StoreEndOfStrip(redaction);
+bool JpegDecoder::RestartInput() {
+  const int restart = mcus_ / restart_interval_ - 1;
+  int next_byte = (data_pointer_ - num_bits_ + 7) >> 3;
+  bool aligned = true;
+  // Without its marker, the restart is assumed to follow the padding.
+  if (restart < restart_offsets_.size()) {
+    aligned = (next_byte == restart_offsets_[restart]);
+    if (!aligned && debug > 0)
+      printf("Restart %d at byte %d, not %d\n", restart,
+	     restart_offsets_[restart], next_byte);
+    next_byte = restart_offsets_[restart];
+  }
+  data_pointer_ = 8 * next_byte;
+  if (data_pointer_ > length_)
+    data_pointer_ = length_;
+  current_bits_ = 0;
+  num_bits_ = 0;
+  dc_values_.assign(components_->size(), 0);
+  return aligned;
+}
+
+void JpegDecoder::RestartOutput() {
+  if (redacting_ == kRedactingOff)
+    return;
+  FlushCopiedBits();
+  const int padding = (8 - (redaction_bit_pointer_ & 7)) & 7;
+  const unsigned char ones = 0xff;
+  BitShifts::AppendBits(&redacted_data_, &redaction_bit_pointer_,
+			&ones, 0, padding);
+  redacted_restarts_.push_back(redaction_bit_pointer_ / 8);
+  redaction_dc_.assign(components_->size(), 0);
+}
+
+int JpegDecoder::Resync() {
+  int end_mcu = num_mcus_;
+  if (restart_interval_ > 0) {
+    const int next = (mcus_ / restart_interval_ + 1) * restart_interval_;
+    if (next < num_mcus_ && next / restart_interval_ <= restart_offsets_.size())
+      end_mcu = next;
+  }
+  if (debug > 0)
+    printf("Damaged MCUs %d to %d: %s\n", mcus_, end_mcu,
+	   status_.ToString().c_str());
+  damage_.push_back(ScanDamage(mcus_, end_mcu, status_));
+  status_ = Status();
+  return end_mcu;
+}
+
+void JpegDecoder::DamageOutput(int end_mcu) {
+  if (redacting_ == kRedactingOff)
+    return;
+  // Take back what was written of the MCU, and copy up to its start.
+  BitShifts::Truncate(&redacted_data_, mcu_output_bits_);
+  redaction_bit_pointer_ = mcu_output_bits_;
+  redaction_dc_ = mcu_output_dc_;
+  FlushCopiedBits(mcu_start_bit_);
+  const int failed_mcu = mcus_;
+  for (; mcus_ < end_mcu; ++mcus_) {
+    SetMCUOffsets();
+    for (int comp = 0; comp < components_->size(); ++comp) {
+      const Jpeg::JpegComponent *component = (*components_)[comp];
+      for (int v = 0; v < component->v_factor_; ++v) {
+	for (int h = 0; h < component->h_factor_; ++h) {
+	  WriteRedactedDC(component->table_, comp, 0);
+	  WriteZeroLength(2 * component->table_ + 1);
+	  if (record_redacted_dc_)
+	    redacted_dcs_.push_back(
+		RedactedDC(comp, dc_plane_offsets_[comp] +
+			   v * dc_plane_widths_[comp] + h,
+			   redaction_dc_[comp]));
+	}
+      }
+    }
+  }
+  mcus_ = failed_mcu;
+}
+
+void JpegDecoder::Decode(Redaction *redaction) {
+  redaction_ = redaction;
+  ResetDecoding();
+  StartOutput();
+  if (restart_interval_ > 0 ||
+      (plan_ != NULL && plan_->AveragesPixellation() && plan_->NumCells() > 0))
+    Prescan();
+
+  while (mcus_ < num_mcus_) {
+    if (AtRestart()) {
+      RestartOutput();
+      RestartInput();
+    }
+    SetMCUOffsets();
+    const int mode = StartMCU();
+    if (IntervalDamaged() || !DecodeMCU(mode)) {
+      const int end_mcu = Resync();
+      DamageOutput(end_mcu);
+      mcus_ = end_mcu;
+      continue;
+    }
+    ++mcus_;
+    EndMCU();
+  }
+  EndOutput();
 
   if (debug > 0)
     printf("Got to %d mcus. %d bits left.\n", num_mcus_,
@@ -190,17 +473,331 @@ void JpegDecoder::Decode(Redaction *redaction) {
   redaction_ = NULL;
 }
 
+int JpegDecoder::DecodeRange(Redaction *redaction, int first_mcu,
+			     int end_mcu, const std::vector<int> &src_dc,
+			     const std::vector<int> &dest_dc) {
+  if (first_mcu < 0 || end_mcu > num_mcus_ || first_mcu > end_mcu ||
+      src_dc.size() != components_->size() ||
+      dest_dc.size() != components_->size())
+    throw("Bad range in DecodeRange");
+  if (restart_interval_ > 0)
+    throw("Can't decode a range of a scan with restarts");
+  redaction_ = redaction;
+  ResetDecoding();
+  StartOutput();
+  if (plan_ != NULL && plan_->AveragesPixellation() && plan_->NumCells() > 0) {
+    // The cells' means need the whole image.
+    if (first_mcu != 0 || end_mcu != num_mcus_)
+      throw("Averaged pixellation can only be decoded whole");
+    Prescan();
+  }
+  mcus_ = first_mcu;
+  dc_values_ = src_dc;
+  redaction_dc_ = dest_dc;
+  while (mcus_ < end_mcu) {
+    SetMCUOffsets();
+    if (!DecodeMCU(StartMCU()))
+      throw("Can't parse the image in DecodeRange");
+    ++mcus_;
+    EndMCU();
+  }
+  EndOutput();
+  const int decoded_bits = data_pointer_ - num_bits_;
+  if (debug > 0)
+    printf("Decoded MCUs %d to %d: %d bits to %d.\n", first_mcu, end_mcu,
+	   decoded_bits, redaction_bit_pointer_);
+  length_ = redaction_bit_pointer_;
+  redaction_ = NULL;
+  return decoded_bits;
+}
+
+void JpegDecoder::Decode(const std::vector<Redaction *> &redactions) {
+  ResetDecoding();
+  outputs_.clear();
+  outputs_.resize(redactions.size());
+  for (int i = 0; i < outputs_.size(); ++i) {
+    redaction_ = redactions[i];
+    StartOutput();
+    SwapOutput(&outputs_[i]);
+  }
+  bool prescan = (restart_interval_ > 0);
+  for (int i = 0; i < outputs_.size(); ++i) {
+    const Redaction::Plan *plan = outputs_[i].plan_;
+    if (plan != NULL && plan->AveragesPixellation() && plan->NumCells() > 0)
+      prescan = true;
+  }
+  if (prescan)
+    Prescan();
+  std::vector<int> modes(outputs_.size(), kBlockSkip);
+  while (mcus_ < num_mcus_) {
+    if (AtRestart()) {
+      for (int i = 0; i < outputs_.size(); ++i) {
+	SwapOutput(&outputs_[i]);
+	RestartOutput();
+	SwapOutput(&outputs_[i]);
+      }
+      RestartInput();
+    }
+    SetMCUOffsets();
+    bool writing = false;
+    for (int i = 0; i < outputs_.size(); ++i) {
+      SwapOutput(&outputs_[i]);
+      modes[i] = StartMCU();
+      SwapOutput(&outputs_[i]);
+      if (modes[i] != kBlockSkip)
+	writing = true;
+    }
+    mcu_blocks_.clear();
+    if (IntervalDamaged() ||
+	!DecodeMCU(writing ? kBlockRecord : kBlockSkip)) {
+      const int end_mcu = Resync();
+      for (int i = 0; i < outputs_.size(); ++i) {
+	SwapOutput(&outputs_[i]);
+	DamageOutput(end_mcu);
+	SwapOutput(&outputs_[i]);
+      }
+      mcus_ = end_mcu;
+      continue;
+    }
+    if (writing) {
+      // Parse once, then write each output that changes this MCU.
+      for (int i = 0; i < outputs_.size(); ++i) {
+	if (modes[i] == kBlockSkip)
+	  continue;
+	SwapOutput(&outputs_[i]);
+	WriteMCU(modes[i]);
+	SwapOutput(&outputs_[i]);
+      }
+    }
+    ++mcus_;
+    for (int i = 0; i < outputs_.size(); ++i) {
+      SwapOutput(&outputs_[i]);
+      EndMCU();
+      SwapOutput(&outputs_[i]);
+    }
+  }
+  for (int i = 0; i < outputs_.size(); ++i) {
+    SwapOutput(&outputs_[i]);
+    EndOutput();
+    SwapOutput(&outputs_[i]);
+  }
+  if (debug > 0)
+    printf("Got to %d mcus. %zu outputs\n", num_mcus_, outputs_.size());
+}
+
+// Write the blocks of the MCU recorded by kBlockRecord to the output.
+void JpegDecoder::WriteMCU(int mode) {
+  for (int b = 0; b < mcu_blocks_.size(); ++b) {
+    const BlockRecord &block = mcu_blocks_[b];
+    if (mode == kBlockRedact) {
+      WriteRedactedBlock(block.dht_, block.comp_, block.block_, block.dc_);
+    } else {
+      WriteRedactedDC(block.dht_, block.comp_, block.dc_);
+      BitShifts::AppendBits(&redacted_data_, &redaction_bit_pointer_,
+			    data_, block.ac_start_,
+			    block.ac_end_ - block.ac_start_);
+    }
+  }
+}
+
+void JpegDecoder::SwapOutput(OutputState *output) {
+  std::swap(redaction_, output->redaction_);
+  std::swap(redacting_, output->redacting_);
+  std::swap(copy_start_, output->copy_start_);
+  std::swap(redaction_method_, output->redaction_method_);
+  std::swap(region_index_, output->region_index_);
+  redaction_dc_.swap(output->redaction_dc_);
+  std::swap(redaction_bit_pointer_, output->redaction_bit_pointer_);
+  redacted_data_.swap(output->redacted_data_);
+  std::swap(current_strip_, output->current_strip_);
+  std::swap(plan_, output->plan_);
+  std::swap(overlay_, output->overlay_);
+  cell_dc_.swap(output->cell_dc_);
+  redacted_dcs_.swap(output->redacted_dcs_);
+  redacted_restarts_.swap(output->redacted_restarts_);
+  std::swap(mcu_output_bits_, output->mcu_output_bits_);
+  mcu_output_dc_.swap(output->mcu_output_dc_);
+}
+
+int JpegDecoder::Verify(const Redaction::Plan &plan, const OverlayTile *tile,
+			std::vector<RedactionViolation> *violations) {
+  if (!plan.Matches(kBlockSize * mcu_h_, kBlockSize * mcu_v_,
+		    w_blocks_ / mcu_h_, h_blocks_ / mcu_v_))
+    throw("Plan doesn't match the image in Verify");
+  ResetDecoding();
+  dc_values_.assign(components_->size(), 0);
+  plan_ = &plan;
+  overlay_ = NULL;
+  if (plan.UsesMethod(Redaction::redact_overlay))
+    SelectOverlay(tile);
+  // The DC each pixellation cell has, once one of its MCUs is seen.
+  cell_dc_.assign(plan.NumCells() * components_->size(), kNoCellDC);
+  cell_predictors_.assign(cell_dc_.size(), 0);
+  const int mcus_wide = w_blocks_ / mcu_h_;
+  std::vector<int> previous_dc;
+  int failures = 0;
+  while (mcus_ < num_mcus_) {
+    if (AtRestart())
+      RestartInput();
+    SetMCUOffsets();
+    const int label = plan.GetLabel(mcus_);
+    if (label < 0) {
+      if (!DecodeMCU(kBlockSkip))
+	throw("Can't parse the image in Verify");
+    } else {
+      previous_dc = dc_values_;
+      mcu_blocks_.clear();
+      if (!DecodeMCU(kBlockRecord))
+	throw("Can't parse the image in Verify");
+      int comp = 0;
+      const char *problem = CheckRedactedMCU(
+	  plan.GetLabelRegion(label).GetRedactionMethod(), &previous_dc,
+	  &comp);
+      if (problem != NULL) {
+	if (debug > 0)
+	  printf("MCU %d,%d component %d: %s\n", mcus_ % mcus_wide,
+		 mcus_ / mcus_wide, comp, problem);
+	if (violations)
+	  violations->push_back(RedactionViolation(mcus_ % mcus_wide,
+						   mcus_ / mcus_wide,
+						   comp, problem));
+	++failures;
+      }
+    }
+    ++mcus_;
+  }
+  plan_ = NULL;
+  overlay_ = NULL;
+  cell_dc_.clear();
+  cell_predictors_.clear();
+  return failures;
+}
+
+const char *JpegDecoder::CheckRedactedMCU(Redaction::redaction_method method,
+					  std::vector<int> *previous_dc,
+					  int *comp) {
+  const int cell = plan_->GetCell(mcus_);
+  for (int b = 0; b < mcu_blocks_.size(); ++b) {
+    const BlockRecord &block = mcu_blocks_[b];
+    *comp = block.comp_;
+    const int before = (*previous_dc)[block.comp_];
+    (*previous_dc)[block.comp_] = block.dc_;
+    if (method == Redaction::redact_overlay && block.comp_ == 0 &&
+	overlay_ != NULL) {
+      const int tile_block = overlay_->GetBlock(
+	  block.block_ % dc_plane_widths_[0],
+	  block.block_ / dc_plane_widths_[0]);
+      if (block.dc_ != CodableDCValue(block.dht_, before,
+				      overlay_->GetDC(tile_block)))
+	return "DC isn't the overlay's";
+      if (block.ac_end_ - block.ac_start_ != overlay_->GetACBits(tile_block) ||
+	  !BitShifts::EqualBits(data_, block.ac_start_,
+				overlay_->GetACData(),
+				overlay_->GetACStart(tile_block),
+				overlay_->GetACBits(tile_block)))
+	return "AC isn't the overlay's";
+      continue;
+    }
+    if (block.coefficients_ != 2)
+      return "AC coefficients left";
+    switch (method) {
+    case Redaction::redact_solid:
+      if (block.dc_ != CodableDCValue(block.dht_, before,
+				      SolidDCValue(block.comp_)))
+	return "DC isn't solid";
+      break;
+    case Redaction::redact_copystrip:
+      if (block.dc_ != before)
+	return "DC isn't copied";
+      break;
+    case Redaction::redact_overlay:
+      if (block.dc_ != CodableDCValue(block.dht_, before, 0))
+	return "Overlay chroma isn't flat";
+      break;
+    default: {
+      // Pixellated: every block of the cell has the same DC, or the
+      // nearest the table can code. The first block seen sets it, unless
+      // it was such an approximation of a later one.
+      if (cell < 0)
+	return "Not in a pixellation cell";
+      const int index = cell * components_->size() + block.comp_;
+      int &cell_value = cell_dc_[index];
+      if (cell_value == kNoCellDC) {
+	cell_value = block.dc_;
+	cell_predictors_[index] = before;
+      } else if (block.dc_ != cell_value &&
+		 block.dc_ != CodableDCValue(block.dht_, before, cell_value)) {
+	if (CodableDCValue(block.dht_, cell_predictors_[index], block.dc_) !=
+	    cell_value)
+	  return "DC differs within a pixellation cell";
+	cell_value = block.dc_;
+      }
+    }
+    }
+  }
+  return NULL;
+}
+
+int JpegDecoder::RecodeFirstMCU(const unsigned char *data, int start,
+				int length,
+				const std::vector<int> &coded_dc,
+				const std::vector<int> &output_dc,
+				std::vector<unsigned char> *output,
+				int *output_bits) {
+  data_ = (unsigned char *)data;
+  // FillBits only keeps track of the position when the data ends on
+  // a byte.
+  length_ = (start + length + 7) & ~7;
+  ResetDecoding();
+  data_pointer_ = start;
+  dc_values_ = coded_dc;
+  redaction_dc_ = output_dc;
+  redacted_data_.swap(*output);
+  redaction_bit_pointer_ = *output_bits;
+  // Parse the MCU and write it back as an edge MCU, which codes its DCs
+  // from the output's predictors.
+  SetMCUOffsets();
+  mcu_blocks_.clear();
+  if (!DecodeMCU(kBlockRecord))
+    throw("Can't parse the MCU in RecodeFirstMCU");
+  WriteMCU(kBlockEdge);
+  redacted_data_.swap(*output);
+  *output_bits = redaction_bit_pointer_;
+  const int mcu_bits = data_pointer_ - num_bits_ - start;
+  if (mcu_bits > length)
+    throw("MCU overruns the data in RecodeFirstMCU");
+  return mcu_bits;
+}
+
 void JpegDecoder::StoreEndOfStrip(Redaction *redaction) {
   //      printf("Endstrip %d %d\n", subblock, mcus_);
-  if (current_strip_ == NULL)
+  if (current_strip_ < 0)
     throw("Ending redaction but no strip");
-  current_strip_->SetSrcEnd(data_pointer_ - num_bits_, mcus_);
-  current_strip_->SetDestEnd(data_, redaction_bit_pointer_);
-  //  printf("Adding a strip\n");
-  redaction->AddStrip(current_strip_);
-  current_strip_ = NULL;
+  redaction->EndStrip(current_strip_, data_pointer_ - num_bits_, mcus_,
+		      data_, redaction_bit_pointer_);
+  current_strip_ = -1;
+}
+
+void JpegDecoder::SetMCUOffsets() {
+  const int mcu_width = w_blocks_ / mcu_h_;
+  const int mcu_x = mcus_ % mcu_width;
+  const int mcu_y = mcus_ / mcu_width;
+  preview_offset_ = mcu_y * mcu_v_ * w_blocks_ + mcu_x * mcu_h_;
+  for (int comp = 0; comp < dc_plane_offsets_.size(); ++comp)
+    dc_plane_offsets_[comp] =
+      mcu_y * (*components_)[comp]->v_factor_ * dc_plane_widths_[comp] +
+      mcu_x * (*components_)[comp]->h_factor_;
 }
 
+void JpegDecoder::FlushCopiedBits(int copy_end) {
+  if (copy_start_ < 0)
+    return;
+  BitShifts::AppendBits(&redacted_data_, &redaction_bit_pointer_,
+			data_, copy_start_, copy_end - copy_start_);
+  copy_start_ = -1;
+}
+
+template <int kMode>
 void JpegDecoder::DecodeOneMCU() {
   const int num_components = (*components_).size();
   for (int comp = 0; comp < num_components; ++comp) {
@@ -211,175 +808,247 @@ void JpegDecoder::DecodeOneMCU() {
       printf("Decoding MCU %d,%d DHT: %d %dx%d\n", mcus_, dht, comp, hf, vf);
     for (int v = 0; v < vf; ++v) {
       for (int h = 0; h < hf; ++h) {
-	const int subblock = v + h * vf;
-	// redaction & subblock_redaction encode the state transitions,
-	// but these need to be different on the block level from the MCU.
-	int subblock_redaction = redacting_;
-	if (redacting_ == kRedactingStarting && subblock != 0)
-	  subblock_redaction = kRedactingActive;
-	// if (redacting_ == kRedactingEnding && subblock != 0)
-	//   subblock_redaction = kRedactingInactive;
-
-	int dc_value = 0;
-	try {
-	  dc_value = DecodeOneBlock(dht, comp, subblock_redaction);
-	} catch (const char *error) {
-	  fprintf(stderr,
-		  "DecodeOneMCU Caught %s at MCU %d of %d\n",
-		  error, mcus_, num_mcus_);
-	  throw(error);
-	}
-
-	if ((*components_)[comp]->table_ == 0) { // Y component
-	  if (debug > 2)
-	    printf("DCY: %d\n", dc_value);
-	  //	  y_value_ += dc_value;
-	  while (dc_values_[0] < (-128 << dct_gain_) ||
-		 dc_values_[0] >= (128 << dct_gain_)) {
-	    ++dct_gain_;
-	    if (debug > 0)
-	      printf("MCU %d dc_value %d y_value_ %d. Doubling gain to %d\n",
-		     mcus_, dc_value, dc_values_[0], dct_gain_);
-	    for (int op = 0; op < image_data_.size(); ++op)
-	      image_data_[op]= image_data_[op]/2 + 64;
-	  }
-	  image_data_.push_back((dc_values_[0] + (128 << dct_gain_))
-				>> dct_gain_);
-	}
+	DecodeMCUBlock<kMode>(dht, comp, dht == 0, h, v);
       }
     }
   }
 }
 
-  // Work out the int_image_data to be used for this pixel.
-  int JpegDecoder::LookupPixellationValue(int comp) {
-    // Each MCU contains this many components.
-    const int mcu_size = mcu_h_ * mcu_v_ + 2;
-    // The first block of the Y (0), or the only block of U (1), V (2).
-    int component = (comp == 0) ? 0 : comp += mcu_size - 3;
-    
-    // decode the blockindex from mcus_ ....
-    // How many MCUs wide the image is.
-    const int mcu_width = w_blocks_ / mcu_h_;
-    // The MCU coordinate of the current MCU.
-    const int x = mcus_ % mcu_width;
-    const int y = mcus_ / mcu_width;
-    
-    // Quantize to a particular number of MCUs per megapixel.
-    // Dimension of a mega pixel in MCUs. Default to 4 for background.
-    int megapixel_size = 3;
-    int megapixels_per_region = 12;
-    if (redaction_method_ != Redaction::redact_inverse_pixellate) {
-      int w_size = (redaction_->GetRegion(region_index_).GetWidth() /
-		    megapixels_per_region + (8 * mcu_h_) -1) / (8 * mcu_h_);
-      int h_size = (redaction_->GetRegion(region_index_).GetHeight() /
-		    megapixels_per_region + (8 * mcu_v_) -1) / (8 * mcu_v_);
-      megapixel_size = h_size;
-      if (w_size > h_size) megapixel_size = w_size;
+template <int kMode, int kNumComponents, int kLumaH, int kLumaV>
+void JpegDecoder::DecodeOneMCULayout() {
+  for (int v = 0; v < kLumaV; ++v) {
+    for (int h = 0; h < kLumaH; ++h) {
+      DecodeMCUBlock<kMode>(0, 0, true, h, v);
     }
-    const int blockindex = (x / megapixel_size) * megapixel_size +
-      mcu_width * (y / megapixel_size) * megapixel_size;
-    
-    int return_value = int_image_data_[blockindex * mcu_size + component];
-    return return_value;
   }
+  for (int comp = 1; comp < kNumComponents; ++comp)
+    DecodeMCUBlock<kMode>(1, comp, false, 0, 0);
+}
+
+template <int kMode>
+inline void JpegDecoder::DecodeMCUBlock(int dht, int comp, bool luma,
+					int h, int v) {
+  const int dc_value = DecodeOneBlock<kMode>(dht, comp, h, v);
+
+  if (luma) { // Y component
+    if (debug > 2)
+      printf("DCY: %d\n", dc_value);
+    int sample = (dc_values_[0] + (128 << dct_gain_)) >> dct_gain_;
+    if (sample < 0) sample = 0;
+    if (sample > 255) sample = 255;
+    image_data_[preview_offset_ + v * w_blocks_ + h] = sample;
+  }
+}
+
+int JpegDecoder::LookupPixellationValue(int comp) {
+  const int cell = plan_->GetCell(mcus_);
+  int &value = cell_dc_[cell * components_->size() + comp];
+  if (value == kNoCellDC)
+    value = CellDCValue(comp, cell);
+  return value;
+}
 
+// The DC of the first block of the cell's top left MCU, which has been
+// decoded by the time any of the cell is, or with AveragesPixellation,
+// the mean DC of the cell's blocks, from the DC planes of a first pass.
+int JpegDecoder::CellDCValue(int comp, int cell) const {
+  const int source = plan_->GetCellSource(cell);
+  const int mcus_wide = w_blocks_ / mcu_h_;
+  const int mcus_high = h_blocks_ / mcu_v_;
+  const int hf = (*components_)[comp]->h_factor_;
+  const int vf = (*components_)[comp]->v_factor_;
+  const int x0 = source % mcus_wide;
+  const int y0 = source / mcus_wide;
+  if (!plan_->AveragesPixellation())
+    return GetDCValue(comp, x0 * hf, y0 * vf);
+  const int size = plan_->GetCellSize(cell);
+  const int x1 = std::min(x0 + size, mcus_wide);
+  const int y1 = std::min(y0 + size, mcus_high);
+  long long sum = 0;
+  for (int by = y0 * vf; by < y1 * vf; ++by)
+    for (int bx = x0 * hf; bx < x1 * hf; ++bx)
+      sum += GetDCValue(comp, bx, by);
+  const int blocks = (x1 - x0) * hf * (y1 - y0) * vf;
+  // Round to nearest.
+  return (sum >= 0) ? (sum + blocks / 2) / blocks :
+    -((-sum + blocks / 2) / blocks);
+}
+
+// Work out the (absolute) DC value to write for a redacted block.
+int JpegDecoder::RedactedDCValue(int comp, int dc_value) {
+  if (redaction_method_ == Redaction::redact_solid)
+    return SolidDCValue(comp);  // Black.
+  if (redaction_method_ == Redaction::redact_copystrip)
+    return redaction_dc_[comp];
+  if (redaction_method_ == Redaction::redact_pixellate ||
+      redaction_method_ == Redaction::redact_inverse_pixellate)
+    return LookupPixellationValue(comp);
+  // The overlay is grey: its chroma is flat.
+  if (redaction_method_ == Redaction::redact_overlay)
+    return 0;
+  // Default is the cumulative sum so far.
+  return dc_value;
+}
+
+void JpegDecoder::WriteRedactedBlock(int dht, int comp, int block,
+				     int dc_value) {
+  if (redaction_method_ == Redaction::redact_overlay && comp == 0 &&
+      overlay_ != NULL) {
+    // The tile's blocks were coded with this image's tables, so they
+    // only need the DC to be written relative to the last.
+    const int tile_block = overlay_->GetBlock(block % dc_plane_widths_[0],
+					      block / dc_plane_widths_[0]);
+    WriteRedactedDC(dht, comp, overlay_->GetDC(tile_block));
+    BitShifts::AppendBits(&redacted_data_, &redaction_bit_pointer_,
+			  overlay_->GetACData(),
+			  overlay_->GetACStart(tile_block),
+			  overlay_->GetACBits(tile_block));
+  } else {
+    WriteRedactedDC(dht, comp, RedactedDCValue(comp, dc_value));
+    // If we're redacting, have no AC.
+    WriteZeroLength(2 * dht + 1);
+  }
+  if (record_redacted_dc_)
+    redacted_dcs_.push_back(RedactedDC(comp, block, redaction_dc_[comp]));
+}
+
+void JpegDecoder::RecordSolidMCU() {
+  for (int comp = 0; comp < components_->size(); ++comp)
+    for (int v = 0; v < (*components_)[comp]->v_factor_; ++v)
+      for (int h = 0; h < (*components_)[comp]->h_factor_; ++h)
+	redacted_dcs_.push_back(
+	    RedactedDC(comp, dc_plane_offsets_[comp] +
+		       v * dc_plane_widths_[comp] + h,
+		       SolidDCValue(comp)));
+}
+
+void JpegDecoder::GetRedactedDCSamples(
+    int comp, std::vector<unsigned char> *samples) const {
+  std::vector<int> plane(dc_planes_[comp]);
+  for (int i = 0; i < redacted_dcs_.size(); ++i)
+    if (redacted_dcs_[i].comp_ == comp)
+      plane[redacted_dcs_[i].block_] = redacted_dcs_[i].value_;
+  // The DC is 8x the mean level shifted sample, divided by the quantizer.
+  const int quantizer = quantizers_[comp][0];
+  samples->resize(plane.size());
+  for (int i = 0; i < plane.size(); ++i) {
+    const int scaled = plane[i] * quantizer;
+    int sample = 128 + ((scaled >= 0) ? (scaled + 4) / 8 :
+			-((-scaled + 4) / 8));
+    if (sample < 0) sample = 0;
+    if (sample > 255) sample = 255;
+    (*samples)[i] = sample;
+  }
+}
+
+// Write the DC of a block in the redacted stream as a delta from the
+// last value written for this component. If the table can't code
+// the delta, move towards the previous value until it can.
+void JpegDecoder::WriteRedactedDC(int dht, int comp, int value_to_write) {
+  value_to_write = CodableDCValue(dht, redaction_dc_[comp], value_to_write);
+  if (WriteValue(2 * dht, value_to_write - redaction_dc_[comp]) != 0) {
+    FailOutput("Can't write a codable DC");
+    return;
+  }
+  redaction_dc_[comp] = value_to_write;
+}
+
+int JpegDecoder::CodableDCValue(int dht, int previous, int value) const {
+  while (value != previous) {
+    const int delta = value - previous;
+    int absval = abs(delta);
+    int coded_len = 0;
+    while (absval >> coded_len) ++coded_len;
+    if (dhts_[2 * dht]->Lookup(coded_len) >= 0)
+      break;
+    value = delta *.9 + previous;
+  }
+  return value;
+}
+
+// Parse the AC coefficients of a block, dropping them.
+// Returns the number of coefficients (including DC) covered.
+inline int JpegDecoder::SkipAC(JpegDHT *ac_dht) {
+  int coeffs = 1; // DC is the first
+  while (coeffs <= 63) {
+    unsigned int ac_symbol;
+    if (num_bits_ <= 16)
+      FillBits();
+    const int ac_length = ac_dht->Decode(current_bits_, num_bits_, &ac_symbol);
+    if (ac_length == 0) {
+      FailDecode();
+      break;
+    }
+    DropBits(ac_length);
+    const int zero_run_length = ac_symbol >> 4;
+    ac_symbol &= 0xf;
+    // If symbol is (15,0) there's no  value, but we skip 16.
+    coeffs += zero_run_length + 1;
+    if (ac_symbol == 0 && zero_run_length == 0) break;  // EOB
+    if (num_bits_ < ac_symbol)
+      FillBits();
+    DropBits(ac_symbol); // Could actually decode the value here.
+  }
+  if (coeffs > 64)
+    Fail(Status::kBadHuffmanCode, "AC run past the end of the block");
+  return coeffs;
+}
 
 // Decode one 8x8 block using the specified Huffman Table.
-// redacting is a flag showing the current state
-// starting/ending/redacting/inactive
+// kMode is the block kernel:
+//   kBlockSkip: parse only. Pass-through blocks are copied in bulk
+//     by the caller.
+//   kBlockRedact: write a new DC and an EOB, dropping the AC.
+//   kBlockEdge: first block after a region. Rewrite the DC to get back
+//     to the original values and copy the AC.
+//   kBlockRecord: parse only, recording the DC and AC position for
+//     WriteMCU.
 // We write DC with table 2 * dht and AC with table 2 * dht + 1
-// When not redacting we just copybits.
-// When redacting we can write other content.
-int JpegDecoder::DecodeOneBlock(int dht, int comp, int redacting) {
+template <int kMode>
+int JpegDecoder::DecodeOneBlock(int dht, int comp, int h, int v) {
   if (num_bits_ <= 16)
     FillBits();
   unsigned int dc_symbol_size; // The number of bits to encode the symbol.
-  int dc_length_size = 0; // the number of bits to encode the symbol length.
-  try {
-    dc_length_size = dhts_[2*dht]->Decode(current_bits_, num_bits_,
-					  &dc_symbol_size);
-  } catch (const char *error) {
-    fprintf(stderr, "Caught %s at MCU %d of %d\n", error, mcus_, num_mcus_);
-    throw(error);
-  }
-  if (redacting == kRedactingInactive) CopyBits(dc_length_size);
+  // the number of bits to encode the symbol length.
+  const int dc_length_size = dhts_[2*dht]->Decode(current_bits_, num_bits_,
+						  &dc_symbol_size);
+  if (dc_length_size == 0) {
+    FailDecode();
+    return 0;
+  }
   DropBits(dc_length_size);
   if (num_bits_ < dc_symbol_size)
     FillBits();
-  if (redacting == kRedactingInactive) CopyBits(dc_symbol_size);
   const int dc_value = NextValue(dc_symbol_size);
   // Current cumulative value for this pixel.
   dc_values_[comp] += dc_value;
-  int_image_data_.push_back(dc_values_[comp]);
-  
-  if (redaction_ && redacting != kRedactingInactive) {
-  // Work out the (absolute) value we want to write.
-  // Default is the cumulative sum so far.
-    int value_to_write = dc_values_[comp];
-    // If solid, we write out 0.
-    if ( redacting != kRedactingEnding) {
-      if (redaction_method_ == Redaction::redact_solid) {
-	// Write black.
-	//	value_to_write = (comp == 0) ? (-127 * (1 << dct_gain_)) : 0;
-	value_to_write = (comp == 0) ? (-127 * (1 << dct_gain_)) : ((comp==1) ? 0 : 0);
-	//	value_to_write = (comp == 0) ? (0 * (1 << dct_gain_)) : ((comp==1) ? 0 : 0);
-      }
-      else if (redaction_method_ == Redaction::redact_copystrip)
-	value_to_write = redaction_dc_[comp];
-      else if (redaction_method_ == Redaction::redact_pixellate ||
-	       redaction_method_ == Redaction::redact_inverse_pixellate)
-	value_to_write = LookupPixellationValue(comp);
-    }
-    int rv;
-    while (rv = WriteValue(2 * dht, value_to_write - redaction_dc_[comp]) != 0) {
-      int delta = value_to_write - redaction_dc_[comp];
-      value_to_write = delta *.9 + redaction_dc_[comp];
-    }
-    // if (rv != 0) {
-    //   fprintf(stderr,
-    // 	  "Caught error in WriteValue for comp %d, table 2*%d, value %d=%d-%d.",
-    // 	      comp, dht, value_to_write-redaction_dc_[comp],
-    // 	      value_to_write, redaction_dc_[comp]);
-    //   throw("WriteValueErr");
-    // }
-    redaction_dc_[comp] = value_to_write;
-  }
-  if (redacting == kRedactingInactive)
-    redaction_dc_[comp] = dc_values_[comp];
+  const int plane_index =
+    dc_plane_offsets_[comp] + v * dc_plane_widths_[comp] + h;
+  dc_planes_[comp][plane_index] = dc_values_[comp];
 
-  // Now deal with AC.
-  int coeffs = 1; // DC is the first
-  // If we're redacting, have no AC (otherwise copy AC later).
-  if (redacting == kRedactingActive || redacting == kRedactingStarting)
-    WriteZeroLength(2 * dht + 1);
+  if (kMode == kBlockRedact) {
+    WriteRedactedBlock(dht, comp, plane_index, dc_values_[comp]);
+  } else if (kMode == kBlockEdge) {
+    WriteRedactedDC(dht, comp, dc_values_[comp]);
+  }
 
-  for (; coeffs <= 63;) {
-    int start_coeff = coeffs;
-    unsigned int ac_symbol;
-    if (num_bits_ <= 16)
-      FillBits();
-    int ac_length =
-      dhts_[2*dht + 1]->Decode(current_bits_, num_bits_, &ac_symbol);
-    const int zero_run_length = ac_symbol >>4;
-    ac_symbol  &= 0xf;
-    if (redacting == kRedactingInactive || redacting == kRedactingEnding)
-      CopyBits(ac_length);
-    DropBits(ac_length);
-    // If symbol is (15,0) there's no  value, but we skip 16.
-    coeffs += zero_run_length;
-    coeffs++;
-    if (debug >=2)
-      printf("AC %d-%d Zrun %d len %d sym %u\n",
-	     start_coeff, coeffs-1, zero_run_length, ac_length, ac_symbol);
-    if (ac_symbol == 0 && zero_run_length == 0) break;
-    if (num_bits_ < ac_symbol)
-      FillBits();
-    if (redacting == kRedactingInactive || redacting == kRedactingEnding)
-      CopyBits(ac_symbol);
-    DropBits(ac_symbol); // Could actually decode the value here.
+  // Now deal with AC.
+  const int ac_start = data_pointer_ - num_bits_;
+  const int coeffs = SkipAC(dhts_[2*dht + 1]);
+  if (kMode == kBlockEdge)
+    BitShifts::AppendBits(&redacted_data_, &redaction_bit_pointer_,
+			  data_, ac_start, data_pointer_ - num_bits_ - ac_start);
+  if (kMode == kBlockRecord) {
+    BlockRecord block;
+    block.dht_ = dht;
+    block.comp_ = comp;
+    block.block_ = plane_index;
+    block.dc_ = dc_values_[comp];
+    block.ac_start_ = ac_start;
+    block.ac_end_ = data_pointer_ - num_bits_;
+    block.coefficients_ = coeffs;
+    mcu_blocks_.push_back(block);
   }
-  if (debug >=2 && coeffs >= 63) printf("EOB64\n");
   if (debug > 2)
     printf("MCU %d data %d. %d coeffs\n",
 	   mcus_, data_pointer_, coeffs);
@@ -21,35 +21,64 @@
 #define INCLUDE_JPEGDECODER
 // JpegDecoder parse the JPEG encoded data.
 // 2011 Andrew Senior
+#include <list>
 #include <vector>
 #include <string>
 #include <stdio.h>
 #include "bit_shifts.h"
 #include "jpeg.h"
 #include "jpeg_dht.h"
+#include "overlay.h"
 #include "redaction.h"
+#include "status.h"
 
 extern int debug;
 namespace jpeg_redaction {
 class JpegDHT;
 class Jpeg;
+class JpegDecoderSetup;
 class JpegDecoder {
  public:
+  // Decode a w x h image whose tables and geometry are in setup.
   JpegDecoder(int w, int h,
 	      unsigned char *data,
 	      int length,  // in bits of the data.
-	      const std::vector<JpegDHT *> &dhts,
+	      const JpegDecoderSetup &setup,
 	      const std::vector<Jpeg::JpegComponent*> *components);
 
 
-  // Decode the whole image.
+  // Decode the whole image. An MCU that can't be parsed is damaged, as
+  // are the rest up to the next restart marker (or the end of the image
+  // without them), where decoding picks up again. The damaged MCUs are
+  // written grey, and listed in GetDamage().
   void Decode(Redaction *redaction);
+  // Decode the whole image once, writing a differently redacted
+  // version for each redaction. Fetch them with GetRedactedData(i).
+  void Decode(const std::vector<Redaction *> &redactions);
+  // Decode only MCUs first_mcu up to end_mcu, with redaction, from data
+  // that starts at first_mcu, whose DC predictors there are src_dc. The
+  // output starts from the predictors dest_dc, and strips are positioned
+  // relative to the starts of the data and output. The MCU at end_mcu
+  // must not be in a region, unless it's the end of the image.
+  // Return the number of bits of data decoded.
+  int DecodeRange(Redaction *redaction, int first_mcu, int end_mcu,
+		  const std::vector<int> &src_dc,
+		  const std::vector<int> &dest_dc);
+  int NumOutputs() const { return outputs_.size(); }
+  const std::vector<unsigned char> &GetRedactedData(int output) {
+    OutputState &state = outputs_[output];
+    CheckRedactedLength(&state.redacted_data_, state.redaction_bit_pointer_);
+    BitShifts::PadLastByte(&state.redacted_data_,
+			   state.redaction_bit_pointer_);
+    return state.redacted_data_;
+  }
+  // The length in bits of one of the outputs of the multiple Decode.
+  int GetBitLength(int output) const {
+    return outputs_[output].redaction_bit_pointer_;
+  }
 
   const std::vector<unsigned char> &GetRedactedData() {
-    if (redaction_bit_pointer_ > (redacted_data_.size() * 8) || 
-	redaction_bit_pointer_ < (redacted_data_.size() * 8) - 8) {
-      throw("RedactedData length mismatch");
-    }
+    CheckRedactedLength(&redacted_data_, redaction_bit_pointer_);
     BitShifts::PadLastByte(&redacted_data_, redaction_bit_pointer_);
     return redacted_data_;
   }
@@ -69,32 +98,67 @@ class JpegDecoder {
       return 1;
     return 0;
   }
-  // ImageData arrived as zig-zags of blocks within MCU.
-  // They were added linearly to image_data_
-  // Rearrange them into proper raster order.
-  void ReorderImageData() {
-    int hf = (*components_)[0]->h_factor_;
-    int vf = (*components_)[0]->v_factor_;
-    printf("Reordering Image %d, %d = %d pixels. %lu bytes. h,v %d,%d\n",
-	   w_blocks_, h_blocks_, w_blocks_ * h_blocks_,
-           image_data_.size(), hf, vf);
-    int block_size = vf * hf;
-    std::vector<unsigned char> c(w_blocks_ * h_blocks_, 0);
-    for (int i = 0 ; i < w_blocks_ * h_blocks_; ++i) {
-      int block = i / block_size;
-      int sub = i % block_size;
-      int x = hf * (block % (w_blocks_/hf)) + (sub % hf);
-      int y = vf * (block / (w_blocks_/hf)) + (sub / hf);
-      int newpos = x + y* w_blocks_;
-      if (x > w_blocks_ || y > h_blocks_)
-	printf("Reordered Data from %d: %d,%d out of bounds\n",
-	       i, x, y);
-      c[newpos] = image_data_[i];
-    }
-    image_data_.assign(c.begin(), c.end());
+  // The cumulative (unscaled) DC value of block bx, by of a component,
+  // in that component's block coordinates.
+  int GetDCValue(int comp, int bx, int by) const {
+    return dc_planes_[comp][by * dc_plane_widths_[comp] + bx];
+  }
+  // The size in blocks of a component's DC plane.
+  int GetDCPlaneWidth(int comp) const { return dc_plane_widths_[comp]; }
+  int GetDCPlaneHeight(int comp) const { return dc_plane_heights_[comp]; }
+  // Keep the DCs of the blocks that are redacted, so GetRedactedDCSamples
+  // can be called after Decode(Redaction *). Off by default.
+  void SetRecordRedactedDC(bool record) { record_redacted_dc_ = record; }
+  // The mean sample of each block of a component as written by the last
+  // Decode(Redaction *): the redacted image at 1/8 scale, laid out as
+  // the component's DC plane. Needs SetRecordRedactedDC(true) first.
+  void GetRedactedDCSamples(int comp,
+			    std::vector<unsigned char> *samples) const;
+  // Parse the (redacted) image without writing anything, checking each
+  // MCU the plan puts in a region is as its region's method writes it:
+  // no AC coefficients, and the DC of the method. An overlay's luma
+  // must be tile's (or the default tile's if it's NULL).
+  // Append a violation for each MCU that isn't to violations, if it's
+  // not NULL, and return how many there were.
+  int Verify(const Redaction::Plan &plan, const OverlayTile *tile,
+	     std::vector<RedactionViolation> *violations);
+  // The scan's restart interval in MCUs, and the offsets of the bytes
+  // where the intervals after the first start (JpegMarker's
+  // restart_offsets_). Without offsets there are no restarts.
+  void SetRestarts(int interval, const std::vector<int> &offsets) {
+    restart_offsets_ = offsets;
+    restart_interval_ = offsets.empty() ? 0 : interval;
+  }
+  // The first error in the data, if there was one, unless the redacted
+  // data couldn't be written, which comes first.
+  const Status &GetStatus() const {
+    if (!output_status_.Ok())
+      return output_status_;
+    return damage_.empty() ? status_ : damage_[0].error_;
+  }
+  // Could the redacted data be written. If not it mustn't be used.
+  bool OutputOk() const { return output_status_.Ok(); }
+  // The runs of MCUs that couldn't be decoded, in order.
+  const std::vector<ScanDamage> &GetDamage() const { return damage_; }
+  // Where the restart intervals of the redacted data start, as
+  // restart_offsets_ of the original.
+  const std::vector<int> &GetRestartOffsets() const {
+    return redacted_restarts_;
+  }
+  const std::vector<int> &GetRestartOffsets(int output) const {
+    return outputs_[output].redacted_restarts_;
   }
   // Return the current length of the data block (in bits).
   int GetBitLength() const { return length_; }
+  // Append the first MCU of length bits of scan data, from bit start of
+  // data, to output, which holds *output_bits bits. The data's DCs were
+  // coded from the predictors coded_dc, but follow output_dc in output,
+  // so they're recoded to keep their values.
+  // Return the number of bits of data the MCU took.
+  int RecodeFirstMCU(const unsigned char *data, int start, int length,
+		     const std::vector<int> &coded_dc,
+		     const std::vector<int> &output_dc,
+		     std::vector<unsigned char> *output, int *output_bits);
 
 
 protected:
@@ -131,17 +195,15 @@ protected:
   // Drop the most recent bits from the buffer.
   void DropBits(int len) {
     if (num_bits_ < len) {
-      printf("Dropping %d left %d\n", len, num_bits_);
-      throw("Dropping more bits than we have\n");
+      if (debug > 0)
+	printf("Dropping %d left %d\n", len, num_bits_);
+      Fail(Status::kTruncated, "Scan data ends before the image");
+      len = num_bits_;
     }
     current_bits_ <<= len;
     num_bits_ -= len;
   }
 
-  // Take bits from the original stream and put them in the redacted stream.
-  void CopyBits(int len) {
-    InsertBits(current_bits_, len);
-  }
   // Take the top len bits from the uint & add them to redacted data.
   void InsertBits(unsigned int bits, int len) {
     redacted_data_.resize((len + redaction_bit_pointer_ + 7) / 8, 0);
@@ -162,8 +224,10 @@ protected:
       // Clear the trailing bits we're not using.
       if (space > len)
 	newbits &= ~ ((1<< (space - len))-1);
-      if (byte >= redacted_data_.size())
-	throw(0);
+      if (byte >= redacted_data_.size()) {
+	FailOutput("Redacted data overrun");
+	return;
+      }
       redacted_data_[byte] |= newbits;
       // if (space <= len && redacted_data_[byte] == 0xff) { // A stuff byte
       // 	redaction_bit_pointer_ += 8;
@@ -183,32 +247,224 @@ protected:
     }
   }
   int NextValue(int len);
-  int DecodeOneBlock(int dht, int comp, int subblock_redaction);
+  // Decode one block, writing it out according to kMode (kBlock*).
+  // h, v is the position of the block within the MCU.
+  template <int kMode>
+  int DecodeOneBlock(int dht, int comp, int h, int v);
+  // Parse the AC coefficients of a block without keeping them.
+  int SkipAC(JpegDHT *ac_dht);
+  // The DC of a pixellated block of this component in the current MCU:
+  // that of its cell, worked out the first time the cell is needed.
   int LookupPixellationValue(int comp);
+  // Work out the DC of a cell for a component from the DC planes.
+  int CellDCValue(int comp, int cell) const;
+  // Parse the whole image without writing anything, then rewind: to
+  // fill the DC planes before averaging cells, and to find the restart
+  // intervals whose data doesn't end at their marker, so they can be
+  // written grey before any of them is. Damaged MCUs are skipped.
+  void Prescan();
+  // If the current MCU starts an interval Prescan found bad, fail it.
+  bool IntervalDamaged() {
+    if (restart_interval_ == 0 || mcus_ % restart_interval_ != 0)
+      return false;
+    const int interval = mcus_ / restart_interval_;
+    if (interval >= bad_intervals_.size() || bad_intervals_[interval].Ok())
+      return false;
+    status_ = bad_intervals_[interval];
+    return true;
+  }
+  // Note the first error in the data, at the current MCU and bit. The
+  // MCU loops stop at the end of the MCU.
+  void Fail(Status::Code code, const char *message) {
+    if (status_.Ok())
+      status_ = Status(code, message, (data_pointer_ - num_bits_) / 8,
+		       mcus_);
+  }
+  // Note an error writing the redacted data, which makes it unusable.
+  void FailOutput(const char *message) {
+    if (output_status_.Ok())
+      output_status_ = Status(Status::kCantRedact, message,
+			      (data_pointer_ - num_bits_) / 8, mcus_);
+  }
+  // Fail the output if its length doesn't match its bit count, and
+  // make it match so it can be padded.
+  void CheckRedactedLength(std::vector<unsigned char> *data, int bits) {
+    if (bits > data->size() * 8 || bits < (int)data->size() * 8 - 8) {
+      FailOutput("Redacted data length mismatch");
+      data->resize((bits + 7) / 8, 0);
+    }
+  }
+  // Is the current MCU the first of a restart interval after the first.
+  bool AtRestart() const {
+    return restart_interval_ > 0 && mcus_ > 0 &&
+      mcus_ % restart_interval_ == 0;
+  }
+  // Skip the padding to the restart marker before the current MCU and
+  // reset the DC predictors. Return false if the data before it didn't
+  // end there.
+  bool RestartInput();
+  // End the output's restart interval: pad it to a byte and reset its
+  // predictors.
+  void RestartOutput();
+  // After the current MCU failed to decode, note the damage up to the
+  // next restart (or the end of the image) and return the MCU there.
+  int Resync();
+  // Replace the output of the current MCU, which failed to decode, and
+  // the rest up to end_mcu with grey MCUs.
+  void DamageOutput(int end_mcu);
+  // Fail for a Huffman code that JpegDHT::Decode couldn't decode.
+  void FailDecode() {
+    if (data_pointer_ >= length_)
+      Fail(Status::kTruncated, "Scan data ends before the image");
+    else
+      Fail(Status::kBadHuffmanCode, "Code not in the Huffman table");
+  }
+  // The DC value a redacted block of this component should have, given
+  // its own cumulative DC.
+  int RedactedDCValue(int comp, int dc_value);
+  // The DC value of a block of this component filled by redact_solid.
+  int SolidDCValue(int comp) const {
+    return (comp == 0) ? (-127 * (1 << dct_gain_)) : 0;
+  }
+  // Code the MCU that redact_solid writes once the predictors have
+  // reached the solid values: every block a zero DC delta and an EOB.
+  void BuildSolidMCU();
+  // Can the current MCU be written as solid_mcu_data_.
+  bool SolidMCUReady() const {
+    if (redaction_method_ != Redaction::redact_solid || solid_mcu_bits_ <= 0)
+      return false;
+    for (int comp = 0; comp < redaction_dc_.size(); ++comp)
+      if (redaction_dc_[comp] != SolidDCValue(comp))
+	return false;
+    return true;
+  }
+  // The DC WriteRedactedDC writes for value after previous: value,
+  // unless the DC table can't code the difference, when it's moved
+  // towards previous until it can.
+  int CodableDCValue(int dht, int previous, int value) const;
+  // Write the DC of a block, relative to the last DC written.
+  void WriteRedactedDC(int dht, int comp, int value_to_write);
+  // Write a redacted block in place of block (its index in its
+  // component's DC plane) whose cumulative DC is dc_value: a DC-only
+  // block, or for an overlay, the tile's block for luma.
+  void WriteRedactedBlock(int dht, int comp, int block, int dc_value);
+  // Note the DCs of the blocks of the current MCU when it's written as
+  // solid_mcu_data_.
+  void RecordSolidMCU();
 
   int WriteValue(int which_dht, int value);
   void WriteZeroLength(int which_dht);
+  // Copy all the source bits since copy_start_ to the redacted stream,
+  // up to the current position, or copy_end.
+  void FlushCopiedBits() { FlushCopiedBits(data_pointer_ - num_bits_); }
+  void FlushCopiedBits(int copy_end);
+  // Work out where the current MCU's blocks go in the DC planes and preview.
+  void SetMCUOffsets();
 
-  // Update the redacting_ state flag. According to whether we're in
-  // a redaction region or on its edge.
-  void SetRedactingState(Redaction *redaction);
+  // Update the redacting_ state flag from the plan's action for the
+  // current MCU.
+  void SetRedactingState();
 
   // Decode all of the blocks from all of the components in a single MCU.
+  // This is the generic version, which works for any sampling layout.
+  template <int kMode>
   void DecodeOneMCU();
+  // Decode a single MCU for a known layout: component 0 is luma with
+  // kLumaH x kLumaV blocks using table 0, and any other components are
+  // 1x1 chroma using table 1. Block counts and tables are compile-time
+  // constants so the loops unroll.
+  template <int kMode, int kNumComponents, int kLumaH, int kLumaV>
+  void DecodeOneMCULayout();
+  // Decode one block of an MCU and update the DC image if it's luma.
+  // h and v are the position of the block within the MCU.
+  template <int kMode>
+  void DecodeMCUBlock(int dht, int comp, bool luma, int h, int v);
+  // Use the specialized MCU decoders for this layout for all modes.
+  template <int kNumComponents, int kLumaH, int kLumaV>
+  void SetLayoutDecoders();
+  // Choose the MCU decoder for the components' sampling layout.
+  void SelectMCUDecoder();
   // At the end of a redaction strip, store the redacted bits in Redaction
   // object.
   void StoreEndOfStrip(Redaction *redaction);
 
-  void ResetDecoding() {
-    redacting_ = kRedactingOff;
-    redacted_data_.clear();
-    redaction_bit_pointer_ = 0;
+  // The DC written for a redacted block, when recording them.
+  class RedactedDC {
+  public:
+    RedactedDC(int comp, int block, int value) :
+      comp_(comp), block_(block), value_(value) {}
+    int comp_;
+    int block_;  // Index in the component's DC plane.
+    int value_;  // Cumulative DC.
+  };
+  // The state of one redacted output. While writing an output, its
+  // state is swapped into the decoder's members by SwapOutput.
+  class OutputState {
+  public:
+    OutputState() : redaction_(NULL), redacting_(kRedactingOff),
+		    copy_start_(-1),
+		    redaction_method_(Redaction::redact_solid),
+		    region_index_(-1), redaction_bit_pointer_(0),
+		    current_strip_(-1), plan_(NULL), overlay_(NULL),
+		    mcu_output_bits_(0) {}
+    Redaction *redaction_;
+    int redacting_;
+    int copy_start_;
+    Redaction::redaction_method redaction_method_;
+    int region_index_;
+    std::vector<int> redaction_dc_;
+    int redaction_bit_pointer_;
+    std::vector<unsigned char> redacted_data_;
+    int current_strip_;
+    const Redaction::Plan *plan_;
+    const OverlayEncoding *overlay_;
+    std::vector<int> cell_dc_;
+    std::vector<RedactedDC> redacted_dcs_;
+    std::vector<int> redacted_restarts_;
+    int mcu_output_bits_;
+    std::vector<int> mcu_output_dc_;
+  };
+  // The parts of a block that an output needs, recorded by kBlockRecord.
+  class BlockRecord {
+  public:
+    int dht_;
+    int comp_;
+    int block_;  // Index in the component's DC plane.
+    int dc_;  // Cumulative DC.
+    int ac_start_;  // Source bits of the AC coefficients.
+    int ac_end_;
+    int coefficients_;  // Counted as SkipAC does: 2 for just an EOB.
+  };
+  // Set overlay_ to tile (or the default tile) encoded for this image.
+  void SelectOverlay(const OverlayTile *tile);
+  // Check the blocks of an MCU in a region with method, recorded in
+  // mcu_blocks_, where the predictors before it were previous_dc (which
+  // are updated). Return the first problem, or NULL, and its component.
+  const char *CheckRedactedMCU(Redaction::redaction_method method,
+			       std::vector<int> *previous_dc, int *comp);
+  void SwapOutput(OutputState *output);
+  // Reset the output members for writing with redaction_.
+  void StartOutput();
+  // Per-MCU steps of writing an output, see Decode().
+  int StartMCU();
+  void EndMCU();
+  void EndOutput();
+  // Decode one MCU with a kBlock* kernel.
+  // Return false if the data was bad, leaving the error in status_.
+  bool DecodeMCU(int mode);
+  // Write the MCU in mcu_blocks_ to the output with kBlockRedact or
+  // kBlockEdge.
+  void WriteMCU(int mode);
 
-    dct_gain_ = 0; // Number of bits to shift.
+  void ResetDecoding() {
+    dct_gain_ = initial_dct_gain_; // Number of bits to shift.
     current_bits_ = 0;  // Buffer of 32 bits.
     num_bits_ = 0;  // Number of bits remaining in current_bits_
     data_pointer_ = 0;  // Next bit to get into current_bits;
     mcus_ = 0;
+    preview_offset_ = 0;
+    status_ = Status();
+    damage_.clear();
   }
 
   // Return x & y coord of the top left corner of this MCU.
@@ -224,17 +480,7 @@ protected:
     const int mcu_y = mcus_ / mcu_width;
     return mcu_y * vq;
   }
-    
-  // Does the current MCU overlap a redaction region.
-  // return the index of the region, -1 if not
-  int InRedactionRegion(const Redaction *const redaction) const {
-    const int mcu_width = w_blocks_ / mcu_h_;
-    const int hq = kBlockSize * mcu_h_;
-    const int vq = kBlockSize * mcu_v_;
-    const int mcu_x = mcus_ % mcu_width;
-    const int mcu_y = mcus_ / mcu_width;
-    return redaction->InRegion(mcu_x * hq, mcu_y * vq, hq, vq);
-  }
+
 
   // First MCU of redaction region.
   static const int kRedactingStarting;
@@ -249,6 +495,19 @@ protected:
 
   // Width/height of a block. (ie 8 pixels)
   static const int kBlockSize;
+  // A cell whose DC hasn't been worked out yet.
+  static const int kNoCellDC;
+
+  // Block kernels, indexing decode_mcu_.
+  // Parse only: the bits are copied to the output in bulk.
+  static const int kBlockSkip = 0;
+  // Replace with a DC-only block.
+  static const int kBlockRedact = 1;
+  // First MCU after a region: restore the DC and copy the AC.
+  static const int kBlockEdge = 2;
+  // Parse only, recording the blocks in mcu_blocks_ for WriteMCU.
+  static const int kBlockRecord = 3;
+  static const int kNumBlockModes = 4;
 
   // Decoding information:
   unsigned char *data_;
@@ -270,7 +529,14 @@ protected:
   int w_blocks_;  // Width of the image in MCUs
   int h_blocks_;  // Height of the image in MCUs
   int dct_gain_;
+  int initial_dct_gain_;
   int redacting_; // Are we redacting this image: see kRedacting* flags above.
+  // The MCU decoders for this image's layout, one for each kBlock* mode,
+  // set in the constructor.
+  void (JpegDecoder::*decode_mcu_[kNumBlockModes])();
+  // First source bit not yet copied to the output while passing data
+  // through unchanged, or -1.
+  int copy_start_;
 
   // What is the redaction method for the current region.
   Redaction::redaction_method  redaction_method_;
@@ -282,12 +548,18 @@ protected:
   // Differs from dc_values_ when we're redacting.
   std::vector<int> redaction_dc_;
 
-  // This stores the cumulative DC values for all components, interleaved.
-  // before down-scaling.
-  std::vector<int> int_image_data_;
+  // The cumulative DC values, before down-scaling. One plane per
+  // component, at block resolution, in raster order.
+  std::vector<std::vector<int> > dc_planes_;
+  std::vector<int> dc_plane_widths_;
+  std::vector<int> dc_plane_heights_;
+  // Index in each plane of the current MCU's top left block.
+  std::vector<int> dc_plane_offsets_;
   // The DC values scaled to bytes. Currently intensity only.
-  // Initially in MCU order, but then reordered to raster for writing as a pgm.
+  // One byte per block, in raster order, ready for writing as a pgm.
   std::vector<unsigned char> image_data_;
+  // Index in image_data_ of the top left block of the current MCU.
+  int preview_offset_;
   // These are pointers into the Jpeg's table of DHTs
   // The decoder does not own the memory.
   std::vector<JpegDHT *> dhts_;
@@ -295,9 +567,56 @@ protected:
 
   int redaction_bit_pointer_;
   std::vector<unsigned char> redacted_data_;
-  JpegStrip *current_strip_;
+  // Index of the redaction's strip being recorded, or -1.
+  int current_strip_;
   // Pointer to the current redaction, while decoding.
   Redaction *redaction_;
+  // The redaction's compiled plan for this image.
+  const Redaction::Plan *plan_;
+  // The redaction's overlay tile encoded for this image's luma tables,
+  // if it has overlay regions.
+  const OverlayEncoding *overlay_;
+  // The DC of each pixellation cell of the plan, by cell then
+  // component, or kNoCellDC.
+  std::vector<int> cell_dc_;
+  // In Verify, the predictor before the block that gave each cell its DC.
+  std::vector<int> cell_predictors_;
+  // Whether to fill redacted_dcs_, and the DCs written for redacted
+  // blocks, in the order they were written.
+  bool record_redacted_dc_;
+  std::vector<RedactedDC> redacted_dcs_;
+  // Encodings made here because the tile's own cache was full.
+  std::list<OverlayEncoding> local_overlays_;
+  // The quantizers of each component, from the setup.
+  std::vector<std::vector<int> > quantizers_;
+  // The coded solid MCU from BuildSolidMCU, and its length in bits,
+  // 0 if the tables can't code it.
+  std::vector<unsigned char> solid_mcu_data_;
+  int solid_mcu_bits_;
+  // The outputs of a multiple Decode.
+  std::vector<OutputState> outputs_;
+  // The blocks of the current MCU, for kBlockRecord.
+  std::vector<BlockRecord> mcu_blocks_;
+  // The error in the MCU being decoded.
+  Status status_;
+  // The first error writing the redacted data.
+  Status output_status_;
+  // The MCUs that couldn't be decoded.
+  std::vector<ScanDamage> damage_;
+  // Restart interval in MCUs, 0 for none, and where they start in the
+  // data (bytes).
+  int restart_interval_;
+  std::vector<int> restart_offsets_;
+  // The error of each restart interval that Prescan found doesn't end
+  // at its marker, Ok for the others.
+  std::vector<Status> bad_intervals_;
+  // Where the restart intervals start in the output.
+  std::vector<int> redacted_restarts_;
+  // The source bit the current MCU starts at, and the output's length
+  // and DC predictors before it, to take it back if it's damaged.
+  int mcu_start_bit_;
+  int mcu_output_bits_;
+  std::vector<int> mcu_output_dc_;
 };
 }  // namespace jpeg_redaction
 
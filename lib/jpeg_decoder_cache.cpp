@@ -0,0 +1,147 @@
+// Copyright (C) 2011 Andrew W. Senior andrew.senior[AT]gmail.com
+// Part of the Jpeg-Redaction-Library to read, parse, edit redact and
+// write JPEG/EXIF/JFIF images.
+// See https://github.com/asenior/Jpeg-Redaction-Library
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+// JpegDecoderSetup and JpegDecoderCache: decoder configuration shared
+// between images with the same tables.
+#include <stdio.h>
+#include "jpeg_decoder_cache.h"
+#include "jpeg_dht.h"
+#include "jpeg_dqt.h"
+
+namespace jpeg_redaction {
+JpegDecoderSetup::~JpegDecoderSetup() {
+  for (int i = 0; i < owned_dhts_.size(); ++i)
+    delete owned_dhts_[i];
+}
+
+void JpegDecoderSetup::Init(
+    int w, int h,
+    const std::vector<JpegDHT *> &dhts,
+    const std::vector<JpegDQT *> &dqts,
+    const std::vector<Jpeg::JpegComponent*> &components,
+    int dct_gain) {
+  const int kBlockSize = 8;
+  dct_gain_ = dct_gain;
+  mcu_h_ = 1;
+  mcu_v_ = 1;
+  component_dhts_.clear();
+  component_quantizers_.clear();
+  // Build a temp table of the DHTs to use for each component
+  // and find the size of the MCU.
+  for (int comp = 0; comp < components.size(); ++comp) {
+    if (components[comp]->h_factor_ > mcu_h_)
+      mcu_h_ = components[comp]->h_factor_;
+    if (components[comp]->v_factor_ > mcu_v_)
+      mcu_v_ = components[comp]->v_factor_;
+    JpegDHT *ac_dht = NULL;
+    JpegDHT *dc_dht = NULL;
+    int i;
+    for (i = 0; i < dhts.size() &&
+	   (ac_dht == NULL || dc_dht == NULL); ++i) {
+      if (dhts[i]->id_ == components[comp]->table_) {
+	if (debug > 0)
+	  printf("Comp %d %d%s DHT: %d\n",
+		 comp, dhts[i]->class_, (dhts[i]->class_? "AC":"DC"), i);
+	if (dhts[i]->class_ == 0)
+	  dc_dht = dhts[i];
+	else
+	  ac_dht = dhts[i];
+      }
+    }
+    if (ac_dht == NULL || dc_dht == NULL) {
+      for (int i = 0; i < dhts.size(); ++i)
+      	fprintf(stderr, "DHT %d %p id %d\n", i, dhts[i], dhts[i]->id_);
+      fprintf(stderr, "comp %d of %zu table %d dhts %zu AC %p dc %p\n",
+      	     comp, components.size(),
+      	     components[comp]->table_, dhts.size(), ac_dht, dc_dht);
+      throw("Can't find DHT table in JpegDecoder::JpegDecoder " __FILE__);
+    }
+    component_dhts_.push_back(dc_dht);
+    component_dhts_.push_back(ac_dht);
+    component_quantizers_.push_back(std::vector<int>(64, 1));
+    for (i = 0; i < dqts.size(); ++i)
+      if (dqts[i]->id_ == components[comp]->table_)
+	component_quantizers_.back() = dqts[i]->values_;
+  }
+  if (component_dhts_.size() != components.size() * 2)
+    throw("dhts_ table size is wrong");
+  // The dimensions of the MCUs in pixels.
+  const int hq = kBlockSize * mcu_h_;
+  const int vq = kBlockSize * mcu_v_;
+  // How many 8x8 blocks there will be in each direction.
+  w_blocks_ = mcu_h_ * ((w + hq -1)/hq);
+  h_blocks_ = mcu_v_ * ((h + vq -1)/vq);
+  // How many MCUs there are in the image.
+  num_mcus_ = (w_blocks_/mcu_h_) * (h_blocks_/ mcu_v_);
+}
+
+JpegDecoderCache::~JpegDecoderCache() {
+  std::map<unsigned int, std::vector<Entry> >::iterator it;
+  for (it = entries_by_hash_.begin(); it != entries_by_hash_.end(); ++it)
+    for (int i = 0; i < it->second.size(); ++i)
+      delete it->second[i].setup_;
+  pthread_mutex_destroy(&mutex_);
+}
+
+const JpegDecoderSetup *JpegDecoderCache::FindLocked(
+    unsigned int hash, const std::vector<unsigned char> &key) {
+  std::map<unsigned int, std::vector<Entry> >::const_iterator it =
+    entries_by_hash_.find(hash);
+  if (it == entries_by_hash_.end())
+    return NULL;
+  for (int i = 0; i < it->second.size(); ++i)
+    if (it->second[i].key_ == key)
+      return it->second[i].setup_;
+  return NULL;
+}
+
+const JpegDecoderSetup *JpegDecoderCache::Find(
+    const std::vector<unsigned char> &key) {
+  const unsigned int hash = Hash(key);
+  pthread_mutex_lock(&mutex_);
+  const JpegDecoderSetup *setup = FindLocked(hash, key);
+  if (setup)
+    ++hits_;
+  else
+    ++misses_;
+  pthread_mutex_unlock(&mutex_);
+  if (debug > 0)
+    printf("Decoder setup %08x %s\n", hash, setup ? "cached" : "not cached");
+  return setup;
+}
+
+const JpegDecoderSetup *JpegDecoderCache::Insert(
+    const std::vector<unsigned char> &key, JpegDecoderSetup *setup) {
+  const unsigned int hash = Hash(key);
+  pthread_mutex_lock(&mutex_);
+  const JpegDecoderSetup *existing = FindLocked(hash, key);
+  if (existing == NULL && entries_ < max_entries_) {
+    Entry entry;
+    entry.key_ = key;
+    entry.setup_ = setup;
+    entries_by_hash_[hash].push_back(entry);
+    ++entries_;
+    existing = setup;
+  } else if (existing != NULL) {
+    delete setup;
+  }
+  pthread_mutex_unlock(&mutex_);
+  return existing;
+}
+}  // namespace jpeg_redaction
@@ -0,0 +1,124 @@
+// Copyright (C) 2011 Andrew W. Senior andrew.senior[AT]gmail.com
+// Part of the Jpeg-Redaction-Library to read, parse, edit redact and
+// write JPEG/EXIF/JFIF images.
+// See https://github.com/asenior/Jpeg-Redaction-Library
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+// JpegDecoderSetup: the decoder configuration that depends only on an
+// image's SOF, DHT and DQT markers.
+// JpegDecoderCache: setups shared between images with identical markers,
+// such as consecutive frames from one camera.
+#ifndef INCLUDE_JPEGDECODERCACHE
+#define INCLUDE_JPEGDECODERCACHE
+
+#include <pthread.h>
+#include <map>
+#include <vector>
+#include "bit_shifts.h"
+#include "jpeg.h"
+
+namespace jpeg_redaction {
+class JpegDHT;
+class JpegDQT;
+
+class JpegDecoderSetup {
+ public:
+  JpegDecoderSetup() : mcu_h_(1), mcu_v_(1), w_blocks_(0), h_blocks_(0),
+		       num_mcus_(0), dct_gain_(0) {}
+  virtual ~JpegDecoderSetup();
+
+  // Match each component to its DC and AC tables and its quantizers,
+  // and work out the MCU geometry of a w x h image.
+  void Init(int w, int h,
+	    const std::vector<JpegDHT *> &dhts,
+	    const std::vector<JpegDQT *> &dqts,
+	    const std::vector<Jpeg::JpegComponent*> &components,
+	    int dct_gain);
+
+  // The DC and AC tables for each component in turn.
+  std::vector<JpegDHT *> component_dhts_;
+  // The quantizers of each component, in zig-zag order. All 1 if the
+  // image has no table for the component.
+  std::vector<std::vector<int> > component_quantizers_;
+  int mcu_h_;  // MCU size in blocks.
+  int mcu_v_;
+  int w_blocks_;  // Image size in blocks.
+  int h_blocks_;
+  int num_mcus_;
+  int dct_gain_;  // Shift to bring luma DC values to a byte.
+  // Tables this setup built for itself, and deletes. Empty if the
+  // tables belong to a Jpeg.
+  std::vector<JpegDHT *> owned_dhts_;
+
+ private:
+  // Not copyable: owned_dhts_ would be deleted twice.
+  JpegDecoderSetup(const JpegDecoderSetup &);
+  void operator=(const JpegDecoderSetup &);
+};
+
+// A thread-safe store of setups keyed by the bytes of the markers they
+// were built from. Setups are kept until the cache is deleted, so the
+// pointers it returns stay valid while it exists.
+class JpegDecoderCache {
+ public:
+  explicit JpegDecoderCache(int max_entries = 64) :
+    max_entries_(max_entries), entries_(0), hits_(0), misses_(0) {
+    pthread_mutex_init(&mutex_, NULL);
+  }
+  virtual ~JpegDecoderCache();
+
+  // Return the setup built from exactly these marker bytes, or NULL.
+  const JpegDecoderSetup *Find(const std::vector<unsigned char> &key);
+  // Add a setup for key, taking ownership of it. If another thread added
+  // one first, setup is deleted and the existing one returned. If the
+  // cache is full return NULL and leave setup with the caller.
+  const JpegDecoderSetup *Insert(const std::vector<unsigned char> &key,
+				 JpegDecoderSetup *setup);
+  int NumEntries() const { return entries_; }
+  int NumHits() const { return hits_; }
+  int NumMisses() const { return misses_; }
+
+  // 32 bit FNV-1a hash.
+  static unsigned int Hash(const std::vector<unsigned char> &key) {
+    return BitShifts::Fnv1a(key.empty() ? NULL : &key[0], key.size());
+  }
+
+ protected:
+  class Entry {
+  public:
+    std::vector<unsigned char> key_;
+    JpegDecoderSetup *setup_;
+  };
+  // Find an entry with the mutex held.
+  const JpegDecoderSetup *FindLocked(unsigned int hash,
+				     const std::vector<unsigned char> &key);
+
+  int max_entries_;
+  int entries_;
+  int hits_;
+  int misses_;
+  // Entries by the hash of their key. The keys are compared in full
+  // so a collision can't give the wrong setup.
+  std::map<unsigned int, std::vector<Entry> > entries_by_hash_;
+  pthread_mutex_t mutex_;
+
+ private:
+  JpegDecoderCache(const JpegDecoderCache &);
+  void operator=(const JpegDecoderCache &);
+};
+}  // namespace jpeg_redaction
+
+#endif // INCLUDE_JPEGDECODERCACHE
@@ -46,7 +46,7 @@ class JpegDHT {
  public:
   JpegDHT() {
     lut_len_ = 0;
-    eob_symbol_ = 0;
+    eob_symbol_ = -1;
   }
   virtual ~JpegDHT() {}
   void PrintTable() {
@@ -130,8 +130,6 @@ class JpegDHT {
 	      fprintf(stderr, "No more bytes left in DHT\n");
 	      return bytes_used;
 	    }
-	    if (data[bytes_used] == 0)
-	      eob_symbol_ = symbols_.size();
 	    symbols_.push_back(data[bytes_used++]);
 	    if (symbols_.size() > 256) {
 	      fprintf(stderr, "Too many symbols defined\n");
@@ -147,9 +145,16 @@ class JpegDHT {
     }
     // PrintTable();
     BuildLUT(lut_len);
+    symbol_index_.assign(256, -1);
+    for (int i = symbols_.size() - 1; i >= 0; --i)
+      symbol_index_[symbols_[i]] = i;
+    eob_symbol_ = symbol_index_[0];
     return bytes_used;
   }
 
+  // Decode the symbol whose code is at the top of current_bits.
+  // Return the length of the code, or 0 if there's no such code in the
+  // bits available.
   int Decode(unsigned int current_bits,
 	     const int bits_available,
 	     unsigned int *symbol) {
@@ -158,8 +163,9 @@ class JpegDHT {
       printf("Decoding from %s\n", allbits.c_str());
     }
     if (bits_available <= 0 || bits_available > 32) {
-      printf("Only %d bits left\n", bits_available);
-      throw("Bad number of bits left");
+      if (debug > 0)
+	printf("Only %d bits left\n", bits_available);
+      return 0;
     }
     unsigned int lut_code = current_bits >> (32 - lut_len_);
     int code_index = lut_[lut_code];
@@ -179,8 +185,9 @@ class JpegDHT {
     }
     for (int i = 0; i < lengths_.size(); ++i) {
       if (lengths_[i] > bits_available) {
-	printf("Can't decode with only %d bits left\n", bits_available);
-	throw("not enough bits left");
+	if (debug > 0)
+	  printf("Can't decode with only %d bits left\n", bits_available);
+	return 0;
       }
       unsigned int part = current_bits >> (32 -lengths_[i]);
       if (part == codes_[i]) {
@@ -192,18 +199,19 @@ class JpegDHT {
 	return lengths_[i];
       }
     }
-    std::string bin = Binary(current_bits, 32);
-    printf("Can't decode %s in table %d%d. %d bits left.\n",
-	   bin.c_str(), class_, id_, bits_available);
-    throw("can't decode");
+    if (debug > 0) {
+      std::string bin = Binary(current_bits, 32);
+      printf("Can't decode %s in table %d%d. %d bits left.\n",
+	     bin.c_str(), class_, id_, bits_available);
+    }
+    return 0;
   }
   // Find the table entry that codes a particular value.
   // Return -1 if not in the table.
   int Lookup(int value) {
-    for (int i = 0; i < symbols_.size(); ++i) {
-      if (symbols_[i] == value)
-	return i;
-    }
+    if (value >= 0 && value < symbol_index_.size() &&
+	symbol_index_[value] >= 0)
+      return symbol_index_[value];
     if (debug > 0)
       fprintf(stderr, "Can't find value %d\n", value);
     return -1;
@@ -212,11 +220,15 @@ class JpegDHT {
   int class_;
   // Table number, as referenced by SOF.
   int id_;
+  // The table entry of symbol 0 (EOB in an AC table, a zero difference
+  // in a DC table), -1 if it has none.
   int eob_symbol_;
   std::vector<int> num_symbols_;
   std::vector<int> lengths_;
   std::vector<unsigned int> codes_;
   std::vector<unsigned int> symbols_;
+  // The table entry for each symbol, -1 if it has none.
+  std::vector<int> symbol_index_;
   // Look up table - for a given bit pattern, which code is this.
   // -1 if more than N (typ 8) bits.
   int lut_len_;
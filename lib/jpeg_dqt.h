@@ -0,0 +1,82 @@
+// Copyright (C) 2011 Andrew W. Senior andrew.senior[AT]gmail.com
+// Part of the Jpeg-Redaction-Library to read, parse, edit redact and
+// write JPEG/EXIF/JFIF images.
+// See https://github.com/asenior/Jpeg-Redaction-Library
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+// A quantization table, as defined in a DQT marker.
+#ifndef INCLUDE_JPEGDQT
+#define INCLUDE_JPEGDQT
+
+#include <stdio.h>
+#include <vector>
+
+namespace jpeg_redaction {
+extern int debug;
+
+class JpegDQT {
+ public:
+  JpegDQT() : precision_(0), id_(0) {}
+  virtual ~JpegDQT() {}
+
+  // Build one DQT from a block of data. Return the number of bytes used.
+  int Build(const unsigned char *data, int bytes_left) {
+    if (bytes_left < 1)
+      throw("No data for DQT");
+    precision_ = data[0] >> 4;
+    id_ = data[0] & 0xf;
+    const int entry_size = precision_ ? 2 : 1;
+    int bytes_used = 1;
+    if (bytes_used + 64 * entry_size > bytes_left)
+      throw("DQT too short");
+    // Values are in zig-zag order, so the DC is first.
+    values_.resize(64);
+    for (int i = 0; i < 64; ++i, bytes_used += entry_size) {
+      if (entry_size == 2)
+	values_[i] = data[bytes_used] * 256 + data[bytes_used + 1];
+      else
+	values_[i] = data[bytes_used];
+    }
+    if (debug > 1)
+      printf("DQT %d precision %d DC %d\n", id_, precision_, values_[0]);
+    return bytes_used;
+  }
+
+  int GetDCQuantizer() const { return values_[0]; }
+
+  // The number of bits the DC coefficients quantized with dc_quantizer
+  // must be shifted down by to fit in a byte, for samples of
+  // sample_bits bits.
+  // The DC is 8x the mean level-shifted sample, so lies in
+  // +/- 2^(sample_bits+2) / dc_quantizer.
+  static int DCGain(int dc_quantizer, int sample_bits) {
+    if (dc_quantizer < 1) dc_quantizer = 1;
+    int gain = 0;
+    while ((dc_quantizer << (gain + 7)) < (1 << (sample_bits + 2)))
+      ++gain;
+    return gain;
+  }
+
+  // 0 for 8 bit values, 1 for 16 bit.
+  int precision_;
+  // Table number, as referenced by SOF.
+  int id_;
+  // Quantizer values in zig-zag order.
+  std::vector<int> values_;
+};
+}  // namespace jpeg_redaction
+
+#endif // INCLUDE_JPEGDQT
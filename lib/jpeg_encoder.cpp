@@ -0,0 +1,368 @@
+// Copyright (C) 2011 Andrew W. Senior andrew.senior[AT]gmail.com
+// Part of the Jpeg-Redaction-Library to read, parse, edit redact and
+// write JPEG/EXIF/JFIF images.
+// See https://github.com/asenior/Jpeg-Redaction-Library
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+// JpegEncoder: encode small baseline JPEGs.
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <vector>
+#include "debug_flag.h"
+#include "jpeg.h"
+#include "jpeg_dht.h"
+#include "jpeg_encoder.h"
+
+namespace jpeg_redaction {
+const int JpegEncoder::kZigZag[64] = {
+  0,  1,  8, 16,  9,  2,  3, 10,
+  17, 24, 32, 25, 18, 11,  4,  5,
+  12, 19, 26, 33, 40, 48, 41, 34,
+  27, 20, 13,  6,  7, 14, 21, 28,
+  35, 42, 49, 56, 57, 50, 43, 36,
+  29, 22, 15, 23, 30, 37, 44, 51,
+  58, 59, 52, 45, 38, 31, 39, 46,
+  53, 60, 61, 54, 47, 55, 62, 63};
+
+// The example tables of Annex K of the JPEG standard. The quantizers
+// are in raster order, and the Huffman tables are as in a DHT marker:
+// the number of codes of each length from 1 to 16 bits, then the
+// symbols.
+static const int kLumaQuantizers[64] = {
+  16, 11, 10, 16, 24, 40, 51, 61,
+  12, 12, 14, 19, 26, 58, 60, 55,
+  14, 13, 16, 24, 40, 57, 69, 56,
+  14, 17, 22, 29, 51, 87, 80, 62,
+  18, 22, 37, 56, 68, 109, 103, 77,
+  24, 35, 55, 64, 81, 104, 113, 92,
+  49, 64, 78, 87, 103, 121, 120, 101,
+  72, 92, 95, 98, 112, 100, 103, 99};
+static const int kChromaQuantizers[64] = {
+  17, 18, 24, 47, 99, 99, 99, 99,
+  18, 21, 26, 66, 99, 99, 99, 99,
+  24, 26, 56, 99, 99, 99, 99, 99,
+  47, 66, 99, 99, 99, 99, 99, 99,
+  99, 99, 99, 99, 99, 99, 99, 99,
+  99, 99, 99, 99, 99, 99, 99, 99,
+  99, 99, 99, 99, 99, 99, 99, 99,
+  99, 99, 99, 99, 99, 99, 99, 99};
+static const unsigned char kLumaDCCounts[16] = {
+  0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0};
+static const unsigned char kChromaDCCounts[16] = {
+  0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0};
+static const unsigned char kDCSymbols[12] = {
+  0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11};
+static const unsigned char kLumaACCounts[16] = {
+  0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d};
+static const unsigned char kLumaACSymbols[162] = {
+  0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12,
+  0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+  0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08,
+  0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+  0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16,
+  0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+  0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39,
+  0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+  0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59,
+  0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+  0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79,
+  0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+  0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98,
+  0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+  0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6,
+  0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+  0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4,
+  0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+  0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea,
+  0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+  0xf9, 0xfa};
+static const unsigned char kChromaACCounts[16] = {
+  0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77};
+static const unsigned char kChromaACSymbols[162] = {
+  0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21,
+  0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+  0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91,
+  0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+  0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34,
+  0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+  0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38,
+  0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+  0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58,
+  0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+  0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78,
+  0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+  0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96,
+  0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+  0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4,
+  0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+  0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2,
+  0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+  0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9,
+  0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+  0xf9, 0xfa};
+
+// Append a marker with its length and payload.
+static void PutMarker(int marker, const std::vector<unsigned char> &payload,
+		      std::vector<unsigned char> *jpeg) {
+  const int length = payload.size() + 2;
+  jpeg->push_back(marker >> 8);
+  jpeg->push_back(marker & 0xff);
+  jpeg->push_back(length >> 8);
+  jpeg->push_back(length & 0xff);
+  jpeg->insert(jpeg->end(), payload.begin(), payload.end());
+}
+
+// Append a Huffman table, as in a DHT marker, to payload, and build it.
+static void AddTable(int table_class, int id, const unsigned char *counts,
+		     const unsigned char *symbols,
+		     std::vector<unsigned char> *payload, JpegDHT *dht) {
+  std::vector<unsigned char> table(1, (table_class << 4) | id);
+  table.insert(table.end(), counts, counts + 16);
+  int num_symbols = 0;
+  for (int i = 0; i < 16; ++i)
+    num_symbols += counts[i];
+  table.insert(table.end(), symbols, symbols + num_symbols);
+  dht->Build(&table[0], table.size());
+  payload->insert(payload->end(), table.begin(), table.end());
+}
+
+void JpegEncoder::EncodeImage(
+    int width, int height,
+    const std::vector<std::vector<unsigned char> > &planes,
+    int quality, std::vector<unsigned char> *jpeg) {
+  const int num_components = planes.size();
+  if (num_components != 1 && num_components != 3)
+    throw("Can only encode grey or YCbCr images");
+  if (width <= 0 || height <= 0 || width > 0xffff || height > 0xffff)
+    throw("Bad image size to encode");
+  for (int comp = 0; comp < num_components; ++comp)
+    if (planes[comp].size() != width * height)
+      throw("Plane size doesn't match the image to encode");
+  if (quality < 1) quality = 1;
+  if (quality > 100) quality = 100;
+  const int scale = (quality < 50) ? 5000 / quality : 200 - 2 * quality;
+  jpeg->clear();
+  jpeg->push_back(0xff);
+  jpeg->push_back(0xd8);
+
+  // Luma uses tables 0, chroma tables 1.
+  const int num_tables = (num_components == 1) ? 1 : 2;
+  std::vector<std::vector<int> > quantizers(num_tables);
+  std::vector<unsigned char> payload;
+  for (int table = 0; table < num_tables; ++table) {
+    const int *base = (table == 0) ? kLumaQuantizers : kChromaQuantizers;
+    payload.push_back(table);
+    for (int k = 0; k < 64; ++k) {
+      int quantizer = (base[kZigZag[k]] * scale + 50) / 100;
+      if (quantizer < 1) quantizer = 1;
+      if (quantizer > 255) quantizer = 255;
+      quantizers[table].push_back(quantizer);
+      payload.push_back(quantizer);
+    }
+  }
+  PutMarker(Jpeg::jpeg_dqt, payload, jpeg);
+
+  payload.clear();
+  payload.push_back(8);  // Sample precision.
+  payload.push_back(height >> 8);
+  payload.push_back(height & 0xff);
+  payload.push_back(width >> 8);
+  payload.push_back(width & 0xff);
+  payload.push_back(num_components);
+  for (int comp = 0; comp < num_components; ++comp) {
+    payload.push_back(comp + 1);
+    payload.push_back(0x11);  // No subsampling.
+    payload.push_back(comp == 0 ? 0 : 1);
+  }
+  PutMarker(Jpeg::jpeg_sof0, payload, jpeg);
+
+  JpegDHT dc_dhts[2];
+  JpegDHT ac_dhts[2];
+  payload.clear();
+  AddTable(0, 0, kLumaDCCounts, kDCSymbols, &payload, &dc_dhts[0]);
+  AddTable(1, 0, kLumaACCounts, kLumaACSymbols, &payload, &ac_dhts[0]);
+  if (num_tables > 1) {
+    AddTable(0, 1, kChromaDCCounts, kDCSymbols, &payload, &dc_dhts[1]);
+    AddTable(1, 1, kChromaACCounts, kChromaACSymbols, &payload, &ac_dhts[1]);
+  }
+  PutMarker(Jpeg::jpeg_dht, payload, jpeg);
+
+  payload.clear();
+  payload.push_back(num_components);
+  for (int comp = 0; comp < num_components; ++comp) {
+    payload.push_back(comp + 1);
+    payload.push_back(comp == 0 ? 0x00 : 0x11);
+  }
+  payload.push_back(0);  // Spectral selection: all of it.
+  payload.push_back(63);
+  payload.push_back(0);
+  PutMarker(Jpeg::jpeg_sos, payload, jpeg);
+
+  // One block of each component in each MCU. The edges are repeated
+  // to fill the blocks that overhang the image.
+  std::vector<unsigned char> data;
+  int bits = 0;
+  std::vector<int> last_dc(num_components, 0);
+  for (int by = 0; by < height; by += 8)
+    for (int bx = 0; bx < width; bx += 8)
+      for (int comp = 0; comp < num_components; ++comp) {
+	const int table = (comp == 0) ? 0 : 1;
+	double samples[64];
+	for (int y = 0; y < 8; ++y)
+	  for (int x = 0; x < 8; ++x) {
+	    const int sy = std::min(by + y, height - 1);
+	    const int sx = std::min(bx + x, width - 1);
+	    samples[y * 8 + x] = planes[comp][sy * width + sx] - 128.0;
+	  }
+	int coefficients[64];
+	ForwardDCT(samples, quantizers[table], coefficients);
+	EncodeDC(coefficients[0] - last_dc[comp], &dc_dhts[table],
+		 &data, &bits);
+	last_dc[comp] = coefficients[0];
+	EncodeAC(coefficients, &ac_dhts[table], &data, &bits);
+      }
+  // Pad with ones, then stuff a zero after each 0xff.
+  if (bits % 8 != 0)
+    PutBits(0x7f, 8 - bits % 8, &data, &bits);
+  for (int i = 0; i < data.size(); ++i) {
+    jpeg->push_back(data[i]);
+    if (data[i] == 0xff)
+      jpeg->push_back(0);
+  }
+  jpeg->push_back(0xff);
+  jpeg->push_back(0xd9);
+  if (debug > 0)
+    printf("Encoded %dx%d image with %d components in %zu bytes\n",
+	   width, height, num_components, jpeg->size());
+}
+
+// cosines[x * 8 + u] is C(u)/2 cos((2x + 1) u pi / 16), so the forward
+// DCT is the sum over x, y of those of x, u and y, v times the sample.
+static double cosines[64];
+static pthread_once_t cosines_once = PTHREAD_ONCE_INIT;
+
+static void MakeCosines() {
+  for (int x = 0; x < 8; ++x)
+    for (int u = 0; u < 8; ++u)
+      cosines[x * 8 + u] = ((u == 0) ? sqrt(0.5) : 1.0) / 2 *
+	cos((2 * x + 1) * u * M_PI / 16);
+}
+
+void JpegEncoder::ForwardDCT(const double *samples,
+			     const std::vector<int> &quantizers,
+			     int *coefficients) {
+  pthread_once(&cosines_once, MakeCosines);
+  // Separably: first along the rows, then down the columns.
+  double rows[64];
+  for (int y = 0; y < 8; ++y)
+    for (int u = 0; u < 8; ++u) {
+      double sum = 0;
+      for (int x = 0; x < 8; ++x)
+	sum += samples[y * 8 + x] * cosines[x * 8 + u];
+      rows[y * 8 + u] = sum;
+    }
+  for (int k = 0; k < 64; ++k) {
+    const int u = kZigZag[k] % 8;
+    const int v = kZigZag[k] / 8;
+    double sum = 0;
+    for (int y = 0; y < 8; ++y)
+      sum += rows[y * 8 + u] * cosines[y * 8 + v];
+    const int quantizer = (quantizers[k] > 0) ? quantizers[k] : 1;
+    coefficients[k] = (int)floor(sum / quantizer + 0.5);
+  }
+}
+
+void JpegEncoder::PutBits(unsigned int code, int length,
+			  std::vector<unsigned char> *data, int *bits) {
+  data->resize((*bits + length + 7) / 8, 0);
+  for (int i = length - 1; i >= 0; --i, ++*bits)
+    if ((code >> i) & 1)
+      (*data)[*bits / 8] |= 0x80 >> (*bits % 8);
+}
+
+void JpegEncoder::EncodeDC(int difference, const JpegDHT *dc_dht,
+			   std::vector<unsigned char> *data, int *bits) {
+  int size = 0;
+  while ((abs(difference) >> size) != 0) ++size;
+  const int symbol = (size < dc_dht->symbol_index_.size()) ?
+    dc_dht->symbol_index_[size] : -1;
+  if (symbol < 0)
+    throw("DC difference can't be coded");
+  PutBits(dc_dht->codes_[symbol], dc_dht->lengths_[symbol], data, bits);
+  const unsigned int coded =
+    (difference >= 0) ? difference : difference + (1 << size) - 1;
+  PutBits(coded, size, data, bits);
+}
+
+int JpegEncoder::MakeCodableAC(int *coefficients, const JpegDHT *ac_dht) {
+  const std::vector<int> &entries = ac_dht->symbol_index_;
+  int zeroed = 0;
+  int run = 0;
+  for (int k = 1; k < 64; ++k) {
+    if (coefficients[k] == 0) {
+      ++run;
+      continue;
+    }
+    int size = 0;
+    while ((abs(coefficients[k]) >> size) != 0) ++size;
+    // A zeroed coefficient lengthens the run of the next one.
+    if (size > 10 || entries[((run % 16) << 4) | size] < 0 ||
+	(run >= 16 && entries[0xf0] < 0)) {
+      coefficients[k] = 0;
+      ++zeroed;
+      ++run;
+      continue;
+    }
+    run = 0;
+  }
+  return zeroed;
+}
+
+void JpegEncoder::EncodeAC(const int *coefficients, const JpegDHT *ac_dht,
+			   std::vector<unsigned char> *data, int *bits) {
+  const std::vector<int> &entries = ac_dht->symbol_index_;
+  if (ac_dht->eob_symbol_ < 0)
+    throw("AC table has no EOB code");
+  int run = 0;
+  for (int k = 1; k < 64; ++k) {
+    const int value = coefficients[k];
+    if (value == 0) {
+      ++run;
+      continue;
+    }
+    int size = 0;
+    while ((abs(value) >> size) != 0) ++size;
+    // Runs of 16 zeros first, then the run and size.
+    const int zrl = entries[0xf0];
+    const int symbol = (size <= 10) ? entries[((run % 16) << 4) | size] : -1;
+    if (symbol < 0 || (run >= 16 && zrl < 0))
+      throw("AC coefficient can't be coded");
+    for (; run >= 16; run -= 16)
+      PutBits(ac_dht->codes_[zrl], ac_dht->lengths_[zrl], data, bits);
+    PutBits(ac_dht->codes_[symbol], ac_dht->lengths_[symbol], data, bits);
+    const unsigned int coded = (value > 0) ? value : value + (1 << size) - 1;
+    PutBits(coded, size, data, bits);
+    run = 0;
+  }
+  // There's no EOB after the last coefficient.
+  if (run > 0)
+    PutBits(ac_dht->codes_[ac_dht->eob_symbol_],
+	    ac_dht->lengths_[ac_dht->eob_symbol_], data, bits);
+}
+}  // namespace jpeg_redaction
@@ -0,0 +1,67 @@
+// Copyright (C) 2011 Andrew W. Senior andrew.senior[AT]gmail.com
+// Part of the Jpeg-Redaction-Library to read, parse, edit redact and
+// write JPEG/EXIF/JFIF images.
+// See https://github.com/asenior/Jpeg-Redaction-Library
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+// jpeg_encoder.h: a small baseline JPEG encoder, for thumbnails made
+// from redacted images, and the block coding it shares with the
+// overlay tiles.
+#ifndef INCLUDE_JPEG_ENCODER
+#define INCLUDE_JPEG_ENCODER
+
+#include <vector>
+
+namespace jpeg_redaction {
+class JpegDHT;
+
+class JpegEncoder {
+ public:
+  // Encode width x height pixels as a baseline JPEG with the example
+  // tables of the JPEG standard, the quantizers scaled for quality
+  // (1 to 100, as in the IJG library). planes holds one plane (grey)
+  // or three (Y, Cb, Cr), each of 8 bit samples in raster order, none
+  // of them subsampled.
+  static void EncodeImage(int width, int height,
+			  const std::vector<std::vector<unsigned char> > &planes,
+			  int quality, std::vector<unsigned char> *jpeg);
+
+  // Transform a block of 64 level shifted samples in raster order, and
+  // quantize the coefficients with quantizers. Both quantizers and
+  // coefficients are in zig-zag order, as in JpegDQT.
+  static void ForwardDCT(const double *samples,
+			 const std::vector<int> &quantizers,
+			 int *coefficients);
+  // Zero the AC coefficients of a block that ac_dht has no code for, so
+  // EncodeAC can write the rest. Return how many were zeroed.
+  static int MakeCodableAC(int *coefficients, const JpegDHT *ac_dht);
+  // Write the AC coefficients of a block, in zig-zag order, and its EOB.
+  // Throw if the table has no code for a coefficient, or no EOB.
+  static void EncodeAC(const int *coefficients, const JpegDHT *ac_dht,
+		       std::vector<unsigned char> *data, int *bits);
+  // Write the difference of a DC from the last one with dc_dht.
+  static void EncodeDC(int difference, const JpegDHT *dc_dht,
+		       std::vector<unsigned char> *data, int *bits);
+  // Append the low length bits of code to data.
+  static void PutBits(unsigned int code, int length,
+		      std::vector<unsigned char> *data, int *bits);
+
+  // The raster position in a block of each coefficient in zig-zag order.
+  static const int kZigZag[64];
+};
+}  // namespace jpeg_redaction
+
+#endif // INCLUDE_JPEG_ENCODER
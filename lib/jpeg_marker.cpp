@@ -58,11 +58,13 @@ namespace jpeg_redaction {
   }
   // Write out the marker inserting stuff (0) bytes when there's an ff.
   void JpegMarker::WriteWithStuffBytes(FILE *pFile) {
+    const int header_length = ScanHeaderLength();
     int written = 0; // Next byte to write out.
-    int check = 10;  // Next byte to check.
+    int check = header_length;  // Next byte to check.
     int rv = 0;
     unsigned char zero = 0x00;
     int stuff_bytes = 0;
+    int restart = 0;  // Next restart marker to write.
     // Repeatedly look for the next ff.
     // Then write all the data up to & including it and write out the
     // stuff byte (00).
@@ -70,7 +72,22 @@ namespace jpeg_redaction {
       fprintf(stderr, "data size is %zu\n", data_.size());
       throw("data too short in stuffing.");
     }
-    while (check < data_.size()) {
+    while (check <= data_.size()) {
+      while (restart < restart_offsets_.size() &&
+	     check == header_length + restart_offsets_[restart]) {
+	rv = fwrite(&data_[0] + written, sizeof(char), check - written, pFile);
+	if (rv != check - written)
+	  throw("Failed to write enough bytes in WriteWithStuffBytes");
+	const unsigned char rst[2] = {0xff,
+				      (unsigned char)(0xd0 + (restart & 7))};
+	rv = fwrite(rst, sizeof(char), 2, pFile);
+	if (rv != 2)
+	  throw("Failed to write restart marker in WriteWithStuffBytes");
+	written = check;
+	++restart;
+      }
+      if (check == data_.size())
+	break;
       if (data_[check] == 0xff) {
 	rv = fwrite(&data_[written], sizeof(char), check + 1 - written, pFile);
 	if (rv != check + 1 - written) 
@@ -96,7 +113,7 @@ namespace jpeg_redaction {
       fprintf(stderr, "Data %zu len %d\n", data_.size(), length_);
       throw("Data length mismatch in RemoveStuffBytes");
     }
-    const int start_of_huffman = 10;
+    const int start_of_huffman = ScanHeaderLength();
     if (data_.size() < start_of_huffman) {
       fprintf(stderr, "Data %zu len %d\n", data_.size(), length_);
       throw("Data too short in RemoveStuffBytes");
@@ -105,7 +122,16 @@ namespace jpeg_redaction {
     int dest = start_of_huffman;
     int src  = start_of_huffman;
     int stuff_bytes = 0;
+    restart_offsets_.clear();
     for (int src = start_of_huffman; src < length_ - 2; ++dest, ++src) {
+      // RSTn markers are dropped, and only their positions kept.
+      while (src + 1 < length_ - 2 && data_[src] == 0xff &&
+	     (data_[src + 1] & 0xf8) == 0xd0) {
+	restart_offsets_.push_back(dest - start_of_huffman);
+	src += 2;
+      }
+      if (src >= length_ - 2)
+	break;
       data_[dest] = data_[src];
       if (data_[src] == 0xff && data_[src+1] == 0x00) {
 	++src;
@@ -115,6 +141,9 @@ namespace jpeg_redaction {
     if (debug > 0)
       printf("Removed %d stuff_bytes in %zu now %zu\n",
 	     stuff_bytes, data_.size(), data_.size() - stuff_bytes);
+    if (debug > 0 && !restart_offsets_.empty())
+      printf("Removed %zu restart markers\n", restart_offsets_.size());
+    stuff_bytes += 2 * restart_offsets_.size();
     length_ -= stuff_bytes;
     data_.resize(data_.size() - stuff_bytes);
   }
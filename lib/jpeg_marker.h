@@ -67,7 +67,15 @@ class JpegMarker {
       throw("Setting bit length longer than buffer");
     bit_length_ = bit_length;
   }
+  // For an SOS marker, the number of bytes of scan header (component
+  // table selectors and spectral selection) before the Huffman data.
+  // slice_ is the header length including its own 2 bytes.
+  int ScanHeaderLength() const { return slice_ - 2; }
+  // Write the scan, stuffing a 00 after each ff of the data and putting
+  // back the restart markers.
   void WriteWithStuffBytes(FILE *pFile);
+  // Remove the stuff bytes and restart markers from the scan, noting
+  // where the markers were in restart_offsets_.
   void RemoveStuffBytes();
   int Save(FILE *pFile);
   unsigned short slice_;
@@ -77,6 +85,10 @@ class JpegMarker {
   unsigned short marker_;
   int bit_length_;
   std::vector<unsigned char> data_;
+  // For an SOS marker, the byte offsets in the data after the scan
+  // header where each restart interval after the first starts, ie
+  // where the RSTn markers were.
+  std::vector<int> restart_offsets_;
 };  // JpegMarker
 }  // namespace redaction
 
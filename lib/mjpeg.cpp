@@ -0,0 +1,358 @@
+// Copyright (C) 2011 Andrew W. Senior andrew.senior[AT]gmail.com
+// Part of the Jpeg-Redaction-Library to read, parse, edit redact and
+// write JPEG/EXIF/JFIF images.
+// See https://github.com/asenior/Jpeg-Redaction-Library
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+// mjpeg.cpp: find, redact and write the frames of Motion JPEG streams.
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "debug_flag.h"
+#include "jpeg.h"
+#include "jpeg_decoder_cache.h"
+#include "mjpeg.h"
+#include "redaction.h"
+
+namespace jpeg_redaction {
+
+bool Mjpeg::LoadFromFile(const char * const filename) {
+  FILE *pFile = fopen(filename, "rb");
+  if (pFile == NULL) {
+    fprintf(stderr, "Couldn't open file %s\n", filename);
+    return false;
+  }
+  std::vector<unsigned char> data;
+  unsigned char buffer[65536];
+  int bytes;
+  while ((bytes = fread(buffer, 1, sizeof(buffer), pFile)) > 0)
+    data.insert(data.end(), buffer, buffer + bytes);
+  fclose(pFile);
+  if (data.empty())
+    return false;
+  return LoadFromMemory(&data[0], data.size());
+}
+
+bool Mjpeg::LoadFromMemory(const unsigned char *data, int length) {
+  data_.assign(data, data + length);
+  frame_offsets_.clear();
+  frame_lengths_.clear();
+  avi_ = (length >= 12 && memcmp(data, "RIFF", 4) == 0 &&
+	  memcmp(data + 8, "AVI ", 4) == 0);
+  if (avi_)
+    FindAviFrames(12, length);
+  else
+    FindJpegFrames();
+  if (debug > 0)
+    printf("Found %zu %s frames in %d bytes\n", frame_offsets_.size(),
+	   avi_ ? "AVI" : "JPEG", length);
+  return !frame_offsets_.empty();
+}
+
+int Mjpeg::FindJpegEnd(const unsigned char *data, int length) {
+  if (length < 4 || data[0] != 0xff || data[1] != 0xd8)
+    return -1;
+  int pos = 2;
+  while (pos + 2 <= length) {
+    if (data[pos] != 0xff)
+      return -1;
+    const unsigned char marker = data[pos + 1];
+    if (marker == 0xff) {  // Fill byte.
+      ++pos;
+      continue;
+    }
+    if (marker == 0xd9)  // EOI
+      return pos + 2;
+    // Markers without a length.
+    if (marker == 0x01 || (marker >= 0xd0 && marker <= 0xd7)) {
+      pos += 2;
+      continue;
+    }
+    if (pos + 4 > length)
+      return -1;
+    pos += 2 + (data[pos + 2] << 8) + data[pos + 3];
+    if (marker == 0xda) {
+      // Skip the entropy coded data: it ends at the first marker
+      // that isn't a stuff byte or a restart marker.
+      while (pos + 1 < length) {
+	if (data[pos] == 0xff) {
+	  const unsigned char next = data[pos + 1];
+	  if (next != 0 && next != 0xff && (next < 0xd0 || next > 0xd7))
+	    break;
+	}
+	++pos;
+      }
+    }
+  }
+  return -1;
+}
+
+void Mjpeg::FindJpegFrames() {
+  const int length = data_.size();
+  int offset = 0;
+  while (offset + 4 <= length) {
+    // Skip anything between frames.
+    if (data_[offset] != 0xff || data_[offset + 1] != 0xd8 ||
+	data_[offset + 2] != 0xff) {
+      ++offset;
+      continue;
+    }
+    const int frame_length = FindJpegEnd(&data_[offset], length - offset);
+    if (frame_length < 0) {
+      fprintf(stderr, "Truncated JPEG frame at %d\n", offset);
+      return;
+    }
+    frame_offsets_.push_back(offset);
+    frame_lengths_.push_back(frame_length);
+    offset += frame_length;
+  }
+}
+
+void Mjpeg::FindAviFrames(int start, int end) {
+  int pos = start;
+  while (pos + 8 <= end) {
+    const char *id = (const char *)&data_[pos];
+    unsigned int size = ReadLE32(pos + 4);
+    if (size > end - pos - 8)
+      size = end - pos - 8;
+    if (memcmp(id, "LIST", 4) == 0 || memcmp(id, "RIFF", 4) == 0) {
+      // A list of chunks after a 4 byte type.
+      FindAviFrames(pos + 12, pos + 8 + size);
+    } else if (id[2] == 'd' && (id[3] == 'c' || id[3] == 'b') &&
+	       size >= 4 && data_[pos + 8] == 0xff &&
+	       data_[pos + 9] == 0xd8) {
+      // A compressed (or uncompressed) video frame.
+      frame_offsets_.push_back(pos + 8);
+      frame_lengths_.push_back(size);
+    }
+    // Chunks are padded to even lengths.
+    pos += 8 + size + (size & 1);
+  }
+}
+
+int Mjpeg::LoadRegions(const char * const filename) {
+  FILE *pFile = fopen(filename, "r");
+  if (pFile == NULL) {
+    fprintf(stderr, "Couldn't open regions file %s\n", filename);
+    return -1;
+  }
+  int frames = 0;
+  std::string line;
+  int c;
+  do {
+    c = getc(pFile);
+    if (c != '\n' && c != EOF) {
+      line += (char)c;
+      continue;
+    }
+    int frame;
+    int used = 0;
+    if (!line.empty() && line[0] != '#' &&
+	sscanf(line.c_str(), "%d %n", &frame, &used) == 1) {
+      SetRegions(frame, line.substr(used));
+      ++frames;
+    }
+    line.clear();
+  } while (c != EOF);
+  fclose(pFile);
+  return frames;
+}
+
+int Mjpeg::RedactFrame(const unsigned char *data, int length,
+		       const std::string &regions,
+		       std::vector<unsigned char> *redacted,
+		       JpegDecoderCache *cache) {
+  try {
+    Jpeg jpeg;
+    jpeg.SetDecoderCache(cache);
+    if (!jpeg.LoadFromMemory(data, length, true))
+      return 1;
+    Redaction redaction;
+    redaction.AddRegions(regions);
+    jpeg.DecodeImage(&redaction, NULL);
+    FILE *pFile = tmpfile();
+    if (pFile == NULL)
+      return 1;
+    if (jpeg.Save(pFile) != 0) {
+      fclose(pFile);
+      return 1;
+    }
+    redacted->resize(ftell(pFile));
+    rewind(pFile);
+    const int bytes = fread(&(*redacted)[0], 1, redacted->size(), pFile);
+    fclose(pFile);
+    if (bytes != redacted->size())
+      return 1;
+  } catch (const char *error) {
+    fprintf(stderr, "Error redacting frame: %s\n", error);
+    return 1;
+  } catch (int error) {
+    fprintf(stderr, "Error %d redacting frame\n", error);
+    return 1;
+  } catch (...) {
+    // Such as running out of memory, which mustn't end the other workers.
+    fprintf(stderr, "Error redacting frame\n");
+    return 1;
+  }
+  return 0;
+}
+
+// The state shared between the workers and the writer in Mjpeg::Redact.
+class MjpegJobs {
+public:
+  static const int kPending = 0;
+  static const int kRedacted = 1;
+  static const int kUnchanged = 2;
+  static const int kFailed = 3;
+
+  MjpegJobs(const Mjpeg *mjpeg, int window) :
+    mjpeg_(mjpeg), next_frame_(0), written_(0), window_(window),
+    redacted_(mjpeg->NumFrames()), status_(mjpeg->NumFrames(), kPending) {
+    pthread_mutex_init(&mutex_, NULL);
+    pthread_cond_init(&done_, NULL);
+    pthread_cond_init(&space_, NULL);
+  }
+  ~MjpegJobs() {
+    pthread_cond_destroy(&space_);
+    pthread_cond_destroy(&done_);
+    pthread_mutex_destroy(&mutex_);
+  }
+  // Take frames in order and redact them, staying no more than window_
+  // frames ahead of the writer.
+  void Work() {
+    pthread_mutex_lock(&mutex_);
+    while (true) {
+      while (next_frame_ < mjpeg_->NumFrames() &&
+	     next_frame_ >= written_ + window_)
+	pthread_cond_wait(&space_, &mutex_);
+      if (next_frame_ >= mjpeg_->NumFrames())
+	break;
+      const int frame = next_frame_++;
+      pthread_mutex_unlock(&mutex_);
+
+      int status = kUnchanged;
+      std::vector<unsigned char> redacted;
+      const std::string regions = mjpeg_->GetRegions(frame);
+      if (!regions.empty()) {
+	status = kRedacted;
+	if (Mjpeg::RedactFrame(mjpeg_->GetFrameData(frame),
+			       mjpeg_->GetFrameLength(frame),
+			       regions, &redacted, &cache_) != 0)
+	  status = kFailed;
+      }
+
+      pthread_mutex_lock(&mutex_);
+      redacted_[frame].swap(redacted);
+      status_[frame] = status;
+      pthread_cond_broadcast(&done_);
+    }
+    pthread_mutex_unlock(&mutex_);
+  }
+  // Let the workers take no more frames, so they finish once their
+  // current ones are done.
+  void Stop() {
+    pthread_mutex_lock(&mutex_);
+    next_frame_ = mjpeg_->NumFrames();
+    pthread_cond_broadcast(&space_);
+    pthread_mutex_unlock(&mutex_);
+  }
+  // Wait for a frame to be finished, and take its data.
+  int Collect(int frame, std::vector<unsigned char> *redacted) {
+    pthread_mutex_lock(&mutex_);
+    while (status_[frame] == kPending)
+      pthread_cond_wait(&done_, &mutex_);
+    redacted->swap(redacted_[frame]);
+    written_ = frame + 1;
+    pthread_cond_broadcast(&space_);
+    const int status = status_[frame];
+    pthread_mutex_unlock(&mutex_);
+    return status;
+  }
+  static void *WorkThread(void *jobs) {
+    ((MjpegJobs *)jobs)->Work();
+    return NULL;
+  }
+
+protected:
+  const Mjpeg *mjpeg_;
+  // Decoder setups shared by all the workers.
+  JpegDecoderCache cache_;
+  int next_frame_;  // Next frame to be taken by a worker.
+  int written_;  // Number of frames written out.
+  int window_;  // How far ahead of the writer workers may get.
+  std::vector<std::vector<unsigned char> > redacted_;
+  std::vector<int> status_;
+  pthread_mutex_t mutex_;
+  pthread_cond_t done_;  // A frame has been finished.
+  pthread_cond_t space_;  // A frame has been written.
+};
+
+const int MjpegJobs::kPending;
+const int MjpegJobs::kRedacted;
+const int MjpegJobs::kUnchanged;
+const int MjpegJobs::kFailed;
+
+// Stop the workers and wait for them, so jobs can be destroyed.
+static void StopWorkers(MjpegJobs *jobs,
+			const std::vector<pthread_t> &threads) {
+  jobs->Stop();
+  for (int i = 0; i < threads.size(); ++i)
+    pthread_join(threads[i], NULL);
+}
+
+int Mjpeg::Redact(FILE *output, int num_threads) {
+  if (num_threads < 1)
+    num_threads = 1;
+  MjpegJobs jobs(this, 4 * num_threads);
+  std::vector<pthread_t> threads;
+  for (int i = 0; i < num_threads; ++i) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, MjpegJobs::WorkThread, &jobs) != 0) {
+      StopWorkers(&jobs, threads);
+      throw("Couldn't create MJPEG worker thread");
+    }
+    threads.push_back(thread);
+  }
+  int dropped = 0;
+  for (int frame = 0; frame < NumFrames(); ++frame) {
+    std::vector<unsigned char> redacted;
+    const int status = jobs.Collect(frame, &redacted);
+    const unsigned char *data;
+    int length;
+    if (status == MjpegJobs::kUnchanged) {
+      data = GetFrameData(frame);
+      length = GetFrameLength(frame);
+    } else if (status == MjpegJobs::kRedacted) {
+      data = &redacted[0];
+      length = redacted.size();
+    } else {
+      fprintf(stderr, "Dropping frame %d which couldn't be redacted\n",
+	      frame);
+      ++dropped;
+      continue;
+    }
+    if (fwrite(data, 1, length, output) != length) {
+      StopWorkers(&jobs, threads);
+      throw("Couldn't write MJPEG frame");
+    }
+  }
+  StopWorkers(&jobs, threads);
+  if (fflush(output) != 0)
+    throw("Couldn't write MJPEG frames");
+  return dropped;
+}
+}  // namespace jpeg_redaction
@@ -0,0 +1,110 @@
+// Copyright (C) 2011 Andrew W. Senior andrew.senior[AT]gmail.com
+// Part of the Jpeg-Redaction-Library to read, parse, edit redact and
+// write JPEG/EXIF/JFIF images.
+// See https://github.com/asenior/Jpeg-Redaction-Library
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+// mjpeg.h: Motion JPEG streams, either concatenated JPEG images or
+// an AVI file with the frames in ##dc chunks.
+// Frames are redacted in parallel and written out in order.
+
+#ifndef INCLUDE_MJPEG
+#define INCLUDE_MJPEG
+
+#include <stdio.h>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace jpeg_redaction {
+class JpegDecoderCache;
+class Mjpeg {
+public:
+  Mjpeg() : avi_(false) {}
+  virtual ~Mjpeg() {}
+
+  // Read a whole stream into memory and find its frames.
+  // Return true on success.
+  bool LoadFromFile(const char * const filename);
+  // Find the frames in a stream already in memory. The data is copied.
+  bool LoadFromMemory(const unsigned char *data, int length);
+
+  // Frame iteration.
+  int NumFrames() const { return frame_offsets_.size(); }
+  const unsigned char *GetFrameData(int frame) const {
+    return &data_[frame_offsets_[frame]];
+  }
+  int GetFrameLength(int frame) const { return frame_lengths_[frame]; }
+  // Was the stream AVI-wrapped.
+  bool IsAvi() const { return avi_; }
+
+  // Set the regions (in the format of Redaction::AddRegions) for a frame.
+  void SetRegions(int frame, const std::string &regions) {
+    regions_[frame] = regions;
+  }
+  // Load per-frame regions from a file with lines of
+  // "<frame index> l,r,t,b[:method];l,r,t,b..."
+  // Return the number of frames given regions, or -1 on failure.
+  int LoadRegions(const char * const filename);
+  // The regions for a frame, empty if none.
+  std::string GetRegions(int frame) const {
+    std::map<int, std::string>::const_iterator it = regions_.find(frame);
+    if (it == regions_.end())
+      return "";
+    return it->second;
+  }
+
+  // Redact every frame with num_threads workers and write the frames,
+  // in order, to output as concatenated JPEG images.
+  // Frames without regions are copied unchanged. A frame that has
+  // regions but can't be redacted is dropped rather than written
+  // unredacted. The frames share one decoder cache, so frames with
+  // the same tables set up the decoder once.
+  // Return the number of frames dropped. Throw if the workers can't be
+  // started or the output can't be written.
+  int Redact(FILE *output, int num_threads);
+
+  // Redact one JPEG image in memory, using cache for the decoder setup
+  // if it's not NULL. Return 0 on success.
+  static int RedactFrame(const unsigned char *data, int length,
+			 const std::string &regions,
+			 std::vector<unsigned char> *redacted,
+			 JpegDecoderCache *cache = NULL);
+  // Walk the markers of the JPEG image at the start of data and
+  // return its length up to and including EOI, or -1 if it's not
+  // a complete JPEG image.
+  static int FindJpegEnd(const unsigned char *data, int length);
+
+protected:
+  // Find the frames of concatenated JPEG images.
+  void FindJpegFrames();
+  // Find the frames in the RIFF chunks between start and end.
+  void FindAviFrames(int start, int end);
+  // Read a little-endian 32 bit int.
+  unsigned int ReadLE32(int offset) const {
+    return data_[offset] | (data_[offset + 1] << 8) |
+      (data_[offset + 2] << 16) | ((unsigned int)data_[offset + 3] << 24);
+  }
+
+  std::vector<unsigned char> data_;
+  std::vector<int> frame_offsets_;
+  std::vector<int> frame_lengths_;
+  std::map<int, std::string> regions_;
+  bool avi_;
+};
+}  // namespace jpeg_redaction
+
+#endif // INCLUDE_MJPEG
@@ -0,0 +1,133 @@
+// Copyright (C) 2011 Andrew W. Senior andrew.senior[AT]gmail.com
+// Part of the Jpeg-Redaction-Library to read, parse, edit redact and
+// write JPEG/EXIF/JFIF images.
+// See https://github.com/asenior/Jpeg-Redaction-Library
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+// OverlayTile: encode overlay tiles for the tables of the images they
+// are written into.
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include "debug_flag.h"
+#include "jpeg_dht.h"
+#include "jpeg_encoder.h"
+#include "overlay.h"
+
+namespace jpeg_redaction {
+OverlayTile::OverlayTile(int width, int height, const unsigned char *pixels) :
+  width_(width), height_(height), pixels_(pixels, pixels + width * height) {
+  if (width <= 0 || height <= 0 || width % 8 != 0 || height % 8 != 0)
+    throw("Overlay tile must be a multiple of 8 pixels in each direction");
+  pthread_mutex_init(&mutex_, NULL);
+}
+
+OverlayTile::~OverlayTile() {
+  std::map<std::vector<int>, OverlayEncoding *>::iterator it;
+  for (it = encodings_.begin(); it != encodings_.end(); ++it)
+    delete it->second;
+  pthread_mutex_destroy(&mutex_);
+}
+
+static const OverlayTile *default_tile = NULL;
+static pthread_once_t default_tile_once = PTHREAD_ONCE_INIT;
+
+static void MakeDefaultTile() {
+  // Dark and light stripes, 8 pixels wide, running down to the left.
+  const int size = 32;
+  unsigned char pixels[size * size];
+  for (int y = 0; y < size; ++y)
+    for (int x = 0; x < size; ++x)
+      pixels[y * size + x] = (((x + y) / 8) % 2) ? 208 : 48;
+  default_tile = new OverlayTile(size, size, pixels);
+}
+
+const OverlayTile *OverlayTile::Default() {
+  pthread_once(&default_tile_once, MakeDefaultTile);
+  return default_tile;
+}
+
+const OverlayEncoding *OverlayTile::GetEncoding(
+    const std::vector<int> &quantizers, const JpegDHT *ac_dht,
+    OverlayEncoding *local) const {
+  if (quantizers.size() != 64)
+    throw("Overlay needs 64 quantizers");
+  // Only the codes matter, not how the table was written.
+  std::vector<int> key(quantizers);
+  key.resize(64 + 2 * 256, 0);
+  for (int i = 0; i < ac_dht->symbols_.size(); ++i) {
+    key[64 + 2 * ac_dht->symbols_[i]] = ac_dht->lengths_[i];
+    key[65 + 2 * ac_dht->symbols_[i]] = ac_dht->codes_[i];
+  }
+  pthread_mutex_lock(&mutex_);
+  std::map<std::vector<int>, OverlayEncoding *>::const_iterator it =
+    encodings_.find(key);
+  if (it != encodings_.end()) {
+    const OverlayEncoding *encoding = it->second;
+    pthread_mutex_unlock(&mutex_);
+    return encoding;
+  }
+  // Encoding holds the lock: it's quick, and it's done once per tables.
+  OverlayEncoding *encoding = local;
+  if (encodings_.size() < kMaxEncodings)
+    encoding = new OverlayEncoding;
+  try {
+    Encode(quantizers, ac_dht, encoding);
+  } catch (const char *error) {
+    if (encoding != local)
+      delete encoding;
+    pthread_mutex_unlock(&mutex_);
+    throw(error);
+  }
+  if (encoding != local)
+    encodings_[key] = encoding;
+  pthread_mutex_unlock(&mutex_);
+  if (debug > 0)
+    printf("Encoded %dx%d overlay tile%s\n", width_, height_,
+	   (encoding == local) ? ", not cached" : "");
+  return encoding;
+}
+
+void OverlayTile::Encode(const std::vector<int> &quantizers,
+			 const JpegDHT *ac_dht,
+			 OverlayEncoding *encoding) const {
+  encoding->blocks_wide_ = width_ / 8;
+  encoding->blocks_high_ = height_ / 8;
+  encoding->dc_.clear();
+  encoding->ac_data_.clear();
+  encoding->ac_starts_.clear();
+  int bits = 0;
+  int zeroed = 0;
+  for (int by = 0; by < encoding->blocks_high_; ++by)
+    for (int bx = 0; bx < encoding->blocks_wide_; ++bx) {
+      double shifted[64];
+      for (int y = 0; y < 8; ++y)
+	for (int x = 0; x < 8; ++x)
+	  shifted[y * 8 + x] =
+	    pixels_[(by * 8 + y) * width_ + bx * 8 + x] - 128.0;
+      int coefficients[64];
+      JpegEncoder::ForwardDCT(shifted, quantizers, coefficients);
+      encoding->dc_.push_back(coefficients[0]);
+      encoding->ac_starts_.push_back(bits);
+      // The image's own table may be optimized and lack some codes.
+      zeroed += JpegEncoder::MakeCodableAC(coefficients, ac_dht);
+      JpegEncoder::EncodeAC(coefficients, ac_dht, &encoding->ac_data_, &bits);
+    }
+  encoding->ac_starts_.push_back(bits);
+  if (debug > 0 && zeroed > 0)
+    printf("Zeroed %d overlay coefficients with no code\n", zeroed);
+}
+}  // namespace jpeg_redaction
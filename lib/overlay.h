@@ -0,0 +1,109 @@
+// Copyright (C) 2011 Andrew W. Senior andrew.senior[AT]gmail.com
+// Part of the Jpeg-Redaction-Library to read, parse, edit redact and
+// write JPEG/EXIF/JFIF images.
+// See https://github.com/asenior/Jpeg-Redaction-Library
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+// overlay.h: the tiles written over redact_overlay regions.
+// OverlayTile: a greyscale picture (a logo, a watermark, "REDACTED")
+// repeated across overlaid regions.
+// OverlayEncoding: a tile's blocks transformed, quantized and Huffman
+// coded once for a particular DQT and DHT, so the decoder only splices
+// their bits into the redacted data.
+#ifndef INCLUDE_OVERLAY
+#define INCLUDE_OVERLAY
+
+#include <pthread.h>
+#include <map>
+#include <vector>
+
+namespace jpeg_redaction {
+class JpegDHT;
+
+class OverlayEncoding {
+ public:
+  OverlayEncoding() : blocks_wide_(0), blocks_high_(0) {}
+
+  // The tile block that covers block bx, by of the image's luma,
+  // the tile being repeated from the top left of the image.
+  int GetBlock(int bx, int by) const {
+    return (by % blocks_high_) * blocks_wide_ + bx % blocks_wide_;
+  }
+  // The quantized DC of a tile block.
+  int GetDC(int block) const { return dc_[block]; }
+  // The Huffman coded AC coefficients of all the blocks, including
+  // each one's EOB, and where each block's start in bits.
+  const unsigned char *GetACData() const { return &ac_data_[0]; }
+  int GetACStart(int block) const { return ac_starts_[block]; }
+  int GetACBits(int block) const {
+    return ac_starts_[block + 1] - ac_starts_[block];
+  }
+
+ protected:
+  friend class OverlayTile;
+  int blocks_wide_;
+  int blocks_high_;
+  std::vector<int> dc_;
+  std::vector<unsigned char> ac_data_;
+  // One more than the number of blocks: the last is the end.
+  std::vector<int> ac_starts_;
+};
+
+class OverlayTile {
+ public:
+  // A width x height tile, both multiples of 8, of 8 bit grey pixels
+  // in raster order.
+  OverlayTile(int width, int height, const unsigned char *pixels);
+  virtual ~OverlayTile();
+
+  // The tile used when a redaction doesn't set one: diagonal stripes.
+  static const OverlayTile *Default();
+
+  int GetWidth() const { return width_; }
+  int GetHeight() const { return height_; }
+
+  // Get the tile encoded with the 64 quantizers (in zig-zag order, as in
+  // JpegDQT) and the AC table, encoding it the first time these tables
+  // are seen. The encoding is kept until the tile is deleted, unless
+  // there are already kMaxEncodings, when local is filled in and
+  // returned instead. Safe to call from several threads.
+  const OverlayEncoding *GetEncoding(const std::vector<int> &quantizers,
+				     const JpegDHT *ac_dht,
+				     OverlayEncoding *local) const;
+  int NumEncodings() const { return encodings_.size(); }
+
+  enum { kMaxEncodings = 64 };
+
+ protected:
+  // Transform, quantize and code the tile for the tables.
+  void Encode(const std::vector<int> &quantizers, const JpegDHT *ac_dht,
+	      OverlayEncoding *encoding) const;
+
+  int width_;
+  int height_;
+  std::vector<unsigned char> pixels_;
+  // The encodings, by the quantizers followed by the code length and
+  // code of each AC symbol.
+  mutable std::map<std::vector<int>, OverlayEncoding *> encodings_;
+  mutable pthread_mutex_t mutex_;
+
+ private:
+  OverlayTile(const OverlayTile &);
+  void operator=(const OverlayTile &);
+};
+}  // namespace jpeg_redaction
+
+#endif // INCLUDE_OVERLAY
@@ -20,69 +20,63 @@
 #ifndef INCLUDE_REDACTION
 #define INCLUDE_REDACTION
 
+#include <algorithm>
+#include <map>
 #include <string>
 #include "debug_flag.h"
 #include "bit_shifts.h"
 
 namespace jpeg_redaction {
+class OverlayTile;
 // Class to store information redacted from a horizontal strip of image.
+// The redacted bits themselves are kept by the Redaction, with all the
+// other strips' bits, at GetDataOffset() in its strip data.
 class JpegStrip {
 public:
-  // Create a strip.
-  JpegStrip(int x, int y, int src, int dest) : x_(x), y_(y), src_start_(src),
-					       dest_start_(dest) {
+  // The most components a scan can have.
+  enum { kMaxComponents = 4 };
+  // Create a strip for the region (label) with index region.
+  JpegStrip(int x, int y, int src, int dest, int region) :
+    x_(x), y_(y), src_start_(src), dest_start_(dest), region_(region) {
     blocks_ = 0;
     bits_ = 0;
+    replaced_by_bits_ = 0;
+    data_offset_ = 0;
+    ClearPredictors();
   }
-  JpegStrip(const std::vector<unsigned char> &pack) {
-    Unpack(pack);
+  JpegStrip() : x_(0), y_(0), src_start_(0), dest_start_(0), region_(-1) {
+    blocks_ = 0;
+    bits_ = 0;
+    replaced_by_bits_ = 0;
+    data_offset_ = 0;
+    ClearPredictors();
+  }
+  // Record the DC predictors, per component, of the original and the
+  // redacted data where the strip starts. They differ when the strip
+  // follows straight on from another region's strip.
+  void SetPredictors(const std::vector<int> &src_dc,
+		     const std::vector<int> &dest_dc) {
+    if (src_dc.size() > kMaxComponents || dest_dc.size() != src_dc.size())
+      throw("Too many components for a strip");
+    ClearPredictors();
+    for (int comp = 0; comp < src_dc.size(); ++comp) {
+      src_dc_[comp] = src_dc[comp];
+      dest_dc_[comp] = dest_dc[comp];
+    }
   }
-  // After finishing a strip, make a copy of the block of data that was removed.
+  // After finishing a strip, record where the original data ended.
   void SetSrcEnd(int data_end, int blocks) {
     bits_ = data_end - src_start_;
     blocks_ = blocks;
   }
-  // After finishing a strip, make a copy of the block of data that was removed.
-  void SetDestEnd(const unsigned char* data,
-		  int dest_end) {
-    const int bytes = (bits_ + 7)/8;
+  // After finishing a strip, record where the redacted version ended
+  // and where the original bits have been stored.
+  void SetDestEnd(int data_offset, int dest_end) {
     replaced_by_bits_ = dest_end - dest_start_;
-    data_.resize(bytes);
-    //    printf("Copying %d bytes from %d\n", bytes, src_start_);
-    // copy over bits.
-    const int byteoffs = src_start_ / 8;
-    const int bitoffs = src_start_ % 8;
-    if (bitoffs == 0) {
-      memcpy(&data_[0], data + byteoffs, bytes);
-    } else {
-      // Shift the data down by bitoffs bits while copying it.
-      for (int i = 0; i < bytes; ++i) {
-	data_[i] = ((data[byteoffs + i] << bitoffs)  & 0xff) +
-	  (data[byteoffs + i + 1] >> (8 - bitoffs));
-      }
-    }
-  }
-  // Patch this strip into a redacted image with a given bit offset.
-  // 0 offset assumes that this is the first strip, or that all previous
-  // strips have been inserted.
-  // Returns the offset.
-  int PatchIn(int offset, std::vector<unsigned char> *data,
-	       int *data_bits) const {
-    // How much we have to shift the trailing region up.
-    const int tail_shift =  bits_ - replaced_by_bits_;
-    if (debug > 0)
-      printf("Patch at %d (%d) %d->%d\n",
-	     src_start_ + offset, offset, replaced_by_bits_, bits_);
-    BitShifts::ShiftTail(data, data_bits, src_start_ + offset, tail_shift);
-    BitShifts::Overwrite(data, *data_bits,
-    			 src_start_ + offset, 
-    			 data_, bits_);
-    BitShifts::PadLastByte(data, *data_bits);
-    return tail_shift;
+    data_offset_ = data_offset;
   }
   bool Valid(int *offset) const {
     if (bits_ < 0) return false;
-    if (data_.size() * 8 < bits_) return false;
     if (debug > 0)
       printf("Strip (%d,%d: %d MCUs) has %d bits (rep %d), src %d dest %d "
 	     "diff %d offset %d.\n", x_, y_, blocks_,
@@ -92,70 +86,142 @@ public:
     *offset += bits_ - replaced_by_bits_;
     return true;
   }
-  int AppendBlock(const unsigned char* data, int bits) {
-    data_.resize((bits_ + bits + 7)/8);
-    // copy over bits.
-    throw(0);
+  int GetSrcStart() const { return src_start_; }
+  int GetDestStart() const { return dest_start_; }
+  int GetBits() const { return bits_; }
+  int GetReplacedByBits() const { return replaced_by_bits_; }
+  int GetDataOffset() const { return data_offset_; }
+  // The number of bytes of strip data.
+  int GetDataSize() const { return (bits_ + 7) / 8; }
+  // Do the strip's bits fit at its offset in size bytes of strip data.
+  // Check before using GetDataSize, which a forged bit count overflows.
+  bool FitsIn(int size) const {
+    return bits_ >= 0 && data_offset_ >= 0 && data_offset_ <= size &&
+      bits_ <= 8LL * (size - data_offset_);
+  }
+  int GetX() const { return x_; }
+  int GetY() const { return y_; }
+  // The raster index of the first MCU after the strip.
+  int GetEndMCU() const { return blocks_; }
+  // The index of the region (as in Redaction::GetLabelRegion) that
+  // the strip redacts, or -1 if it isn't known.
+  int GetRegion() const { return region_; }
+  int GetSrcDC(int comp) const { return src_dc_[comp]; }
+  int GetDestDC(int comp) const { return dest_dc_[comp]; }
+  // After restoring other strips around this one, record where its
+  // redacted version now starts and the predictors it now starts with.
+  void SetRedacted(int dest_start, const std::vector<int> &dest_dc) {
+    dest_start_ = dest_start;
+    for (int comp = 0; comp < dest_dc.size(); ++comp)
+      dest_dc_[comp] = dest_dc[comp];
+  }
+  // Move the strip by src bits in the original data and dest bits in the
+  // redacted, as Jpeg::AddRedaction does when it redacts more before it,
+  // with its bits now at data_offset in the strip data.
+  void Move(int src, int dest, int data_offset) {
+    src_start_ += src;
+    dest_start_ += dest;
+    data_offset_ = data_offset;
+  }
+  // Renumber the region the strip redacts.
+  void SetRegion(int region) { region_ = region; }
+  // Take in the MCU after the strip, which had to be recoded to follow
+  // on from it, as the MCU after a region is: its bits of original data,
+  // which must have been appended to the strip's data, and of redacted.
+  void AddEdge(int bits, int replaced_by_bits) {
     bits_ += bits;
-    return ++blocks_;
+    replaced_by_bits_ += replaced_by_bits;
+    ++blocks_;
   }
-  // Copy an int from one location to another.
-  // Changing the byte order if not <TODO>.
+  // Copy a native-endian int, as stored by version 1 packs.
   // Also used by Region.
   static void MemcpyByteSwapping(int *dest, const int *src) {
-    // TODO(byteswapping) to standard ordering.
     memcpy(dest, src, sizeof(int));
   }
-  // Return a blob that contains all the data and can be unpacked into the
-  // same structure with Unpack().
-  void Pack(std::vector<unsigned char> *pack) const {
-    int version = 1;
-    if ((bits_ + 7) / 8 != data_.size()) {
-      fprintf(stderr, "bits_ %d bytes %d data_.size() %zu\n",
-	      bits_, (bits_ + 7) / 8, data_.size());
-      throw("size mismatch in pack");
-    }
-    const int size = GetPackSize();
-    //    printf("Packing strip size %d 32+%zu\n", size, data_.size());
-    pack->resize(size);
-    // TODO(byteswapping) to standard ordering.
-    int * store = (int *)&(*pack)[0];
-    MemcpyByteSwapping(store++, &version);
-    MemcpyByteSwapping(store++, &bits_);
-    MemcpyByteSwapping(store++, &src_start_);
-    MemcpyByteSwapping(store++, &dest_start_);
-    MemcpyByteSwapping(store++, &replaced_by_bits_);
-    MemcpyByteSwapping(store++, &x_);
-    MemcpyByteSwapping(store++, &y_);
-    MemcpyByteSwapping(store++, &blocks_);
-    //    printf("Store diff %d\n", ((unsigned char *)store) - &pack[0]);
-    memcpy(store, &data_[0], data_.size() * sizeof(unsigned char));
-  }
-  // Take a blob of data created by Pack and insert it into the Strip object.
-  void Unpack(std::vector<unsigned char> const &pack) {
+  // Version 2 packs store every int as 4 little-endian bytes, whatever
+  // the byte order of the machine. Also used by Region.
+  static void PutLE32(unsigned char *dest, int value) {
+    const unsigned int v = value;
+    dest[0] = v & 0xff;
+    dest[1] = (v >> 8) & 0xff;
+    dest[2] = (v >> 16) & 0xff;
+    dest[3] = (v >> 24) & 0xff;
+  }
+  static int GetLE32(const unsigned char *src) {
+    return (int)(src[0] | (src[1] << 8) | (src[2] << 16) |
+		 ((unsigned int)src[3] << 24));
+  }
+  // Bytes in a strip's entry in the strip table of a pack.
+  enum { kPackedEntrySize = (9 + 2 * kMaxComponents) * 4 };
+  // Write this strip's entry of the strip table. The bits
+  // themselves are stored separately, at GetDataOffset() in the pack's
+  // data.
+  void PackEntry(unsigned char *entry) const {
+    PutLE32(entry, data_offset_);
+    PutLE32(entry + 4, bits_);
+    PutLE32(entry + 8, src_start_);
+    PutLE32(entry + 12, dest_start_);
+    PutLE32(entry + 16, replaced_by_bits_);
+    PutLE32(entry + 20, x_);
+    PutLE32(entry + 24, y_);
+    PutLE32(entry + 28, blocks_);
+    PutLE32(entry + 32, region_);
+    for (int comp = 0; comp < kMaxComponents; ++comp) {
+      PutLE32(entry + 36 + 8 * comp, src_dc_[comp]);
+      PutLE32(entry + 40 + 8 * comp, dest_dc_[comp]);
+    }
+  }
+  // Fill in the strip from an entry of a pack.
+  void UnpackEntry(const unsigned char *entry) {
+    data_offset_ = GetLE32(entry);
+    bits_ = GetLE32(entry + 4);
+    src_start_ = GetLE32(entry + 8);
+    dest_start_ = GetLE32(entry + 12);
+    replaced_by_bits_ = GetLE32(entry + 16);
+    x_ = GetLE32(entry + 20);
+    y_ = GetLE32(entry + 24);
+    blocks_ = GetLE32(entry + 28);
+    region_ = GetLE32(entry + 32);
+    for (int comp = 0; comp < kMaxComponents; ++comp) {
+      src_dc_[comp] = GetLE32(entry + 36 + 8 * comp);
+      dest_dc_[comp] = GetLE32(entry + 40 + 8 * comp);
+    }
+  }
+  // Take size bytes of a strip from a version 1 pack and fill in the
+  // Strip object, appending its data to strip_data.
+  void Unpack(const unsigned char *pack, int size,
+	      std::vector<unsigned char> *strip_data) {
     int version = 0;
-    const int * store = (const int *)&pack[0];
+    const int * store = (const int *)pack;
+    if (size < sizeof(int) * 8)
+      throw("Strip pack too short in redaction.h: Unpack");
     MemcpyByteSwapping(&version, store++);
     if (version != 1) throw("Wrong version in redaction.h: Unpack");
     MemcpyByteSwapping(&bits_, store++);
-    const int data_size = pack.size() - sizeof(int) * 8;
-    if ((bits_ + 7) / 8 != data_size)
+    const int data_size = size - sizeof(int) * 8;
+    if (GetDataSize() != data_size)
       throw("Data size mismatch in unpack");
-    data_.resize(data_size);
     MemcpyByteSwapping(&src_start_, store++);
     MemcpyByteSwapping(&dest_start_, store++);
     MemcpyByteSwapping(&replaced_by_bits_, store++);
     MemcpyByteSwapping(&x_, store++);
     MemcpyByteSwapping(&y_, store++);
     MemcpyByteSwapping(&blocks_, store++);
-    memcpy(&data_[0], store, data_size * sizeof(unsigned char));
-  }    
-  // How many bytes are needed to store this object's Pack().
-  int GetPackSize() const {
-    return sizeof(int) * 8 + data_.size();
+    region_ = -1;
+    ClearPredictors();
+    data_offset_ = strip_data->size();
+    strip_data->insert(strip_data->end(), (const unsigned char *)store,
+		       (const unsigned char *)store + data_size);
   }
 protected:
-  std::vector<unsigned char> data_; // Raw binary encoded data.
+  void ClearPredictors() {
+    for (int comp = 0; comp < kMaxComponents; ++comp) {
+      src_dc_[comp] = 0;
+      dest_dc_[comp] = 0;
+    }
+  }
+
+  int data_offset_;  // Byte offset of the raw binary encoded data.
   int bits_;
   // In the original strip at what bit did the strip start.
   int src_start_;
@@ -166,6 +232,24 @@ protected:
   int x_; // Coordinate of start (from left)
   int y_; // Coordinate of start (from top)
   int blocks_; // Number of blocks stored.
+  int region_;  // Label of the region redacted.
+  // DC predictors at the start in the original and redacted data.
+  int src_dc_[kMaxComponents];
+  int dest_dc_[kMaxComponents];
+};
+
+// An MCU inside a region that Jpeg::VerifyRedaction found not to be
+// redacted as its region's method requires.
+class RedactionViolation {
+public:
+  RedactionViolation(int mcu_x, int mcu_y, int comp, const char *problem) :
+    mcu_x_(mcu_x), mcu_y_(mcu_y), comp_(comp), problem_(problem) {}
+  // The MCU's position, in MCUs.
+  int mcu_x_;
+  int mcu_y_;
+  // The component of the first block found wanting.
+  int comp_;
+  const char *problem_;
 };
 
 // Class to define the areas to be redacted, and return the strips of 
@@ -222,16 +306,31 @@ public:
     int GetHeight() const {
       return b_ - t_;
     }
-    void Pack(std::vector<unsigned char> *pack) const {
-      pack->resize(5 * sizeof(int));
-      int * pack_ptr = (int*)&(*pack)[0];
-      JpegStrip::MemcpyByteSwapping(pack_ptr++, &l_);
-      JpegStrip::MemcpyByteSwapping(pack_ptr++, &r_);
-      JpegStrip::MemcpyByteSwapping(pack_ptr++, &t_);
-      JpegStrip::MemcpyByteSwapping(pack_ptr++, &b_);
-      JpegStrip::MemcpyByteSwapping(pack_ptr++,
-				    (const int *)&redaction_method_);
+    // Is method one of the redaction_methods.
+    static bool ValidMethod(int method) {
+      return method >= redact_copystrip && method <= redact_inverse_pixellate;
     }
+    // Bytes in a region of a pack.
+    enum { kPackedSize = 5 * 4 };
+    // Write the kPackedSize bytes of a pack.
+    void Pack(unsigned char *pack) const {
+      JpegStrip::PutLE32(pack, l_);
+      JpegStrip::PutLE32(pack + 4, r_);
+      JpegStrip::PutLE32(pack + 8, t_);
+      JpegStrip::PutLE32(pack + 12, b_);
+      JpegStrip::PutLE32(pack + 16, redaction_method_);
+    }
+    void Unpack(const unsigned char *pack) {
+      l_ = JpegStrip::GetLE32(pack);
+      r_ = JpegStrip::GetLE32(pack + 4);
+      t_ = JpegStrip::GetLE32(pack + 8);
+      b_ = JpegStrip::GetLE32(pack + 12);
+      const int method = JpegStrip::GetLE32(pack + 16);
+      if (!ValidMethod(method))
+	throw("Unknown redaction method in pack");
+      redaction_method_ = (redaction_method)method;
+    }
+    // Read a region from a version 1 pack.
     void Unpack(std::vector<unsigned char> const &pack) {
       if (pack.size() != 5 * sizeof(int))
 	throw("Region pack is not 5 * sizeof(int)");
@@ -240,27 +339,432 @@ public:
       JpegStrip::MemcpyByteSwapping(&r_, pack_ptr++);
       JpegStrip::MemcpyByteSwapping(&t_, pack_ptr++);
       JpegStrip::MemcpyByteSwapping(&b_, pack_ptr++);
-      JpegStrip::MemcpyByteSwapping((int*)&redaction_method_, pack_ptr++);
+      int method;
+      JpegStrip::MemcpyByteSwapping(&method, pack_ptr++);
+      if (!ValidMethod(method))
+	throw("Unknown redaction method in pack");
+      redaction_method_ = (redaction_method)method;
     }
     int l_, r_, t_, b_;
 
   protected:
     redaction_method redaction_method_;
   };
-  Redaction() {}
-  virtual ~Redaction() {
-    for (int i = 0; i < strips_.size(); ++i)
-      delete strips_[i];
-  }
-  Redaction *Copy() {
+
+  // A label image for redacting arbitrary shapes. The mask is a grid of
+  // width x height cells, each cell_size pixels square (typically the
+  // MCU or block size), with its top left corner at x, y in the image.
+  // Label 0 is not redacted. Each other label has its own method.
+  class Mask {
+  public:
+    Mask(int x, int y, int width, int height, int cell_size) :
+      x_(x), y_(y), width_(width), height_(height), cell_size_(cell_size),
+      scale_num_x_(1), scale_den_x_(1), scale_num_y_(1), scale_den_y_(1),
+      labels_(width * height, 0), label_methods_(256, redact_solid) {
+      if (width <= 0 || height <= 0 || cell_size <= 0)
+	throw("Bad mask created");
+    }
+    // Set cells from a bitmap packed 1 bit per cell, row by row, with the
+    // first cell in the highest bit. Set cells get the given label.
+    void SetFromBitmap(const unsigned char *bits, int label) {
+      CheckLabel(label);
+      for (int i = 0; i < labels_.size(); ++i)
+	labels_[i] = ((bits[i / 8] >> (7 - i % 8)) & 1) ? label : 0;
+    }
+    // Set cells from run lengths, row by row. Runs alternate between
+    // unlabelled cells and cells with the given label, starting unlabelled.
+    void SetFromRLE(const std::vector<int> &runs, int label) {
+      CheckLabel(label);
+      int cell = 0;
+      for (int i = 0; i < runs.size(); ++i) {
+	if (runs[i] < 0 || cell + runs[i] > labels_.size())
+	  throw("Mask RLE overruns the mask");
+	const unsigned char value = (i % 2) ? label : 0;
+	for (int j = 0; j < runs[i]; ++j)
+	  labels_[cell++] = value;
+      }
+    }
+    void SetLabel(int cx, int cy, int label) {
+      CheckLabel(label);
+      if (cx < 0 || cx >= width_ || cy < 0 || cy >= height_)
+	throw("Mask cell out of range");
+      labels_[cy * width_ + cx] = label;
+    }
+    int GetLabel(int cx, int cy) const {
+      return labels_[cy * width_ + cx];
+    }
+    void SetLabelMethod(int label, redaction_method method) {
+      CheckLabel(label);
+      label_methods_[label] = method;
+    }
+    redaction_method GetLabelMethod(int label) const {
+      CheckLabel(label);
+      return label_methods_[label];
+    }
+    int GetWidth() const { return width_; }
+    int GetHeight() const { return height_; }
+    // The rectangle in (scaled) image pixels covered by a cell.
+    // Cells never collapse to nothing when scaled down.
+    Region CellRect(int cx, int cy) const {
+      const int l = ((x_ + cx * cell_size_) * scale_num_x_) / scale_den_x_;
+      int r = ((x_ + (cx + 1) * cell_size_) * scale_num_x_) / scale_den_x_;
+      const int t = ((y_ + cy * cell_size_) * scale_num_y_) / scale_den_y_;
+      int b = ((y_ + (cy + 1) * cell_size_) * scale_num_y_) / scale_den_y_;
+      if (r <= l) r = l + 1;
+      if (b <= t) b = t + 1;
+      return Region(l, r, t, b);
+    }
+    void Scale(int new_width, int new_height,
+	       int old_width, int old_height) {
+      scale_num_x_ *= new_width;
+      scale_den_x_ *= old_width;
+      scale_num_y_ *= new_height;
+      scale_den_y_ *= old_height;
+    }
+  protected:
+    // Labels are stored in a byte, and 0 is not redacted.
+    static void CheckLabel(int label) {
+      if (label < 1 || label > 255)
+	throw("Mask label out of range");
+    }
+    int x_, y_;
+    int width_, height_;
+    int cell_size_;
+    // Scale factors from Scale(), applied to pixel coordinates.
+    int scale_num_x_, scale_den_x_, scale_num_y_, scale_den_y_;
+    std::vector<unsigned char> labels_;
+    std::vector<redaction_method> label_methods_;
+  };
+
+  // The regions and masks of a redaction compiled for one image
+  // geometry: the label and action of every MCU, and the MCU whose DC
+  // a pixellated MCU takes. Compile a plan once and share it between
+  // images of the same size and sampling (see UsePlan) so decoding
+  // only indexes into it.
+  class Plan {
+  public:
+    // What happens to each MCU, following the decoder's states.
+    enum mcu_action {action_copy = 0,  // Outside the regions.
+		     action_start = 1,  // First MCU of a strip or region.
+		     action_redact = 2,  // Later MCUs of a strip.
+		     action_edge = 3};  // First MCU after a strip.
+    Plan() : mcu_width_(0), mcu_height_(0), mcus_wide_(0), mcus_high_(0),
+	     average_pixellation_(false), excluded_(NULL) {}
+
+    // Compile the regions and masks of redaction for an image mcus_wide
+    // by mcus_high MCUs, each mcu_width x mcu_height pixels, leaving out
+    // the labels in excluded if it's not NULL.
+    void Compile(const Redaction &redaction, int mcu_width, int mcu_height,
+		 int mcus_wide, int mcus_high,
+		 const std::vector<int> *excluded = NULL) {
+      mcu_width_ = mcu_width;
+      mcu_height_ = mcu_height;
+      mcus_wide_ = mcus_wide;
+      mcus_high_ = mcus_high;
+      regions_ = redaction.regions_;
+      masks_ = redaction.masks_;
+      average_pixellation_ = redaction.average_pixellation_;
+      label_regions_ = regions_;
+      labels_.assign(mcus_wide * mcus_high, -1);
+      covers_.assign(mcus_wide * mcus_high, 0);
+      cover_sets_.assign(1, std::vector<int>());
+      cover_ids_.clear();
+      cover_ids_[cover_sets_[0]] = 0;
+      excluded_ = excluded;
+      bool inverting = false;
+      // Paint the regions in order so later regions take precedence,
+      // as in InRegion.
+      for (int i = 0; i < regions_.size(); ++i) {
+	if (Excluded(i))
+	  continue;
+	const bool inverse =
+	  (regions_[i].GetRedactionMethod() == redact_inverse_pixellate);
+	// The first inverse region claims everything not yet in a region.
+	if (inverse && !inverting) {
+	  for (int m = 0; m < labels_.size(); ++m)
+	    if (labels_[m] < 0) {
+	      labels_[m] = i;
+	      Cover(m, i);
+	    }
+	  inverting = true;
+	}
+	PaintGrid(regions_[i], inverse ? -1 : i);
+      }
+      // Then the masks. Each label of each mask becomes a region, whose
+      // rectangle is the bounding box of the label.
+      for (int m = 0; m < masks_.size(); ++m) {
+	const Mask &mask = masks_[m];
+	// Index into label_regions_ for each label of this mask.
+	std::vector<int> label_index(256, -1);
+	for (int cy = 0; cy < mask.GetHeight(); ++cy)
+	  for (int cx = 0; cx < mask.GetWidth(); ++cx) {
+	    const int label = mask.GetLabel(cx, cy);
+	    if (label == 0)
+	      continue;
+	    const Region cell = mask.CellRect(cx, cy);
+	    if (label_index[label] < 0) {
+	      label_index[label] = label_regions_.size();
+	      label_regions_.push_back(cell);
+	      label_regions_.back().SetRedactionMethod(
+		mask.GetLabelMethod(label));
+	    } else {
+	      Region &box = label_regions_[label_index[label]];
+	      if (cell.l_ < box.l_) box.l_ = cell.l_;
+	      if (cell.r_ > box.r_) box.r_ = cell.r_;
+	      if (cell.t_ < box.t_) box.t_ = cell.t_;
+	      if (cell.b_ > box.b_) box.b_ = cell.b_;
+	    }
+	    if (Excluded(label_index[label]))
+	      continue;
+	    const bool inverse =
+	      (mask.GetLabelMethod(label) == redact_inverse_pixellate);
+	    PaintGrid(cell, inverse ? -1 : label_index[label]);
+	  }
+      }
+      excluded_ = NULL;
+      cover_ids_.clear();
+      CompileActions();
+    }
+    // Exchange the contents with other's, without copying them.
+    void Swap(Plan *other) {
+      std::swap(mcu_width_, other->mcu_width_);
+      std::swap(mcu_height_, other->mcu_height_);
+      std::swap(mcus_wide_, other->mcus_wide_);
+      std::swap(mcus_high_, other->mcus_high_);
+      std::swap(average_pixellation_, other->average_pixellation_);
+      std::swap(excluded_, other->excluded_);
+      regions_.swap(other->regions_);
+      masks_.swap(other->masks_);
+      label_regions_.swap(other->label_regions_);
+      labels_.swap(other->labels_);
+      covers_.swap(other->covers_);
+      cover_sets_.swap(other->cover_sets_);
+      cover_ids_.swap(other->cover_ids_);
+      actions_.swap(other->actions_);
+      cells_.swap(other->cells_);
+      cell_sources_.swap(other->cell_sources_);
+      cell_sizes_.swap(other->cell_sizes_);
+    }
+    // Was the plan compiled for this geometry.
+    bool Matches(int mcu_width, int mcu_height,
+		 int mcus_wide, int mcus_high) const {
+      return mcu_width == mcu_width_ && mcu_height == mcu_height_ &&
+	mcus_wide == mcus_wide_ && mcus_high == mcus_high_;
+    }
+    // The label (region index) of an MCU, -1 if it's not redacted.
+    int GetLabel(int mcu) const { return labels_[mcu]; }
+    // An id for the set of labels whose regions cover an MCU, even
+    // where a later one takes precedence. MCUs with the same set have
+    // the same id, and those with different sets different ids.
+    int GetCover(int mcu) const { return covers_[mcu]; }
+    // The labels covering an MCU, in increasing order.
+    const std::vector<int> &GetCoverLabels(int mcu) const {
+      return cover_sets_[covers_[mcu]];
+    }
+    mcu_action GetAction(int mcu) const {
+      return (mcu_action)actions_[mcu];
+    }
+    // The pixellation cell of an MCU, -1 if it isn't pixellated.
+    // A cell is a square of MCUs that all take the same DCs.
+    int GetCell(int mcu) const { return cells_[mcu]; }
+    int NumCells() const { return cell_sources_.size(); }
+    // The top left MCU of a cell, which may be outside the region, and
+    // the cell's size in MCUs. Cells are clipped by the image edges.
+    int GetCellSource(int cell) const { return cell_sources_[cell]; }
+    int GetCellSize(int cell) const { return cell_sizes_[cell]; }
+    // The MCU whose first block's DC a pixellated MCU takes, -1 if it
+    // isn't pixellated.
+    int GetPixellationSource(int mcu) const {
+      return (cells_[mcu] < 0) ? -1 : cell_sources_[cells_[mcu]];
+    }
+    // Do cells take the mean DCs of all their blocks, rather than those
+    // of the first block of their top left MCU.
+    bool AveragesPixellation() const { return average_pixellation_; }
+    // The region for a label. Labels past the rectangular regions are
+    // those of the masks.
+    const Region &GetLabelRegion(int label) const {
+      return label_regions_[label];
+    }
+    int GetMCUsWide() const { return mcus_wide_; }
+    // Does any region or mask label use this method.
+    bool UsesMethod(redaction_method method) const {
+      for (int i = 0; i < label_regions_.size(); ++i)
+	if (label_regions_[i].GetRedactionMethod() == method)
+	  return true;
+      return false;
+    }
+
+  protected:
+    friend class Redaction;
+    // Set the label of all the MCUs that the rectangle overlaps.
+    void PaintGrid(const Region &rect, int label) {
+      int x0 = FloorDiv(rect.l_, mcu_width_);
+      int x1 = FloorDiv(rect.r_ - 1, mcu_width_);
+      int y0 = FloorDiv(rect.t_, mcu_height_);
+      int y1 = FloorDiv(rect.b_ - 1, mcu_height_);
+      if (x0 < 0) x0 = 0;
+      if (y0 < 0) y0 = 0;
+      if (x1 >= mcus_wide_) x1 = mcus_wide_ - 1;
+      if (y1 >= mcus_high_) y1 = mcus_high_ - 1;
+      for (int y = y0; y <= y1; ++y)
+	for (int x = x0; x <= x1; ++x) {
+	  labels_[y * mcus_wide_ + x] = label;
+	  if (label >= 0)
+	    Cover(y * mcus_wide_ + x, label);
+	}
+    }
+    // Add a label to those covering an MCU.
+    void Cover(int mcu, int label) {
+      std::vector<int> labels(cover_sets_[covers_[mcu]]);
+      std::vector<int>::iterator it =
+	std::lower_bound(labels.begin(), labels.end(), label);
+      if (it != labels.end() && *it == label)
+	return;
+      labels.insert(it, label);
+      std::map<std::vector<int>, int>::const_iterator found =
+	cover_ids_.find(labels);
+      if (found == cover_ids_.end()) {
+	found = cover_ids_.insert(std::make_pair(labels,
+						 (int)cover_sets_.size())).first;
+	cover_sets_.push_back(labels);
+      }
+      covers_[mcu] = found->second;
+    }
+    bool Excluded(int label) const {
+      return excluded_ != NULL &&
+	std::find(excluded_->begin(), excluded_->end(), label) !=
+	excluded_->end();
+    }
+    // Division rounding towards minus infinity.
+    static int FloorDiv(int a, int b) {
+      return (a >= 0) ? a / b : -((-a + b - 1) / b);
+    }
+    // Work out the action and pixellation cell of every MCU from
+    // the labels.
+    void CompileActions() {
+      actions_.resize(labels_.size());
+      cells_.assign(labels_.size(), -1);
+      cell_sources_.clear();
+      cell_sizes_.clear();
+      // The cells so far, by their source and size.
+      std::map<std::pair<int, int>, int> cell_index;
+      int previous = action_copy;
+      for (int mcu = 0; mcu < labels_.size(); ++mcu) {
+	const int label = labels_[mcu];
+	int action;
+	// A new strip starts where the label, or the set of regions
+	// covering the MCU, changes. So each strip belongs to one region,
+	// and where it overlaps others can be told apart when restoring.
+	if (label >= 0)
+	  action = ((previous == action_start || previous == action_redact) &&
+		    labels_[mcu - 1] == label &&
+		    covers_[mcu - 1] == covers_[mcu]) ?
+	    action_redact : action_start;
+	else
+	  action = (previous == action_start || previous == action_redact) ?
+	    action_edge : action_copy;
+	actions_[mcu] = action;
+	previous = action;
+	if (label < 0)
+	  continue;
+	const Region &region = label_regions_[label];
+	const redaction_method method = region.GetRedactionMethod();
+	if (method != redact_pixellate && method != redact_inverse_pixellate)
+	  continue;
+	// Quantize to a particular number of MCUs per megapixel.
+	// Dimension of a mega pixel in MCUs. Default to 3 for background.
+	int megapixel_size = 3;
+	const int megapixels_per_region = 12;
+	if (method != redact_inverse_pixellate) {
+	  const int w_size = (region.GetWidth() / megapixels_per_region +
+			      mcu_width_ - 1) / mcu_width_;
+	  const int h_size = (region.GetHeight() / megapixels_per_region +
+			      mcu_height_ - 1) / mcu_height_;
+	  megapixel_size = (w_size > h_size) ? w_size : h_size;
+	  if (megapixel_size < 1) megapixel_size = 1;
+	}
+	// The megapixels are aligned to the image, so regions of the
+	// same size share them.
+	const int x = mcu % mcus_wide_;
+	const int y = mcu / mcus_wide_;
+	const int source = (y / megapixel_size) * megapixel_size * mcus_wide_ +
+	  (x / megapixel_size) * megapixel_size;
+	const std::pair<int, int> key(source, megapixel_size);
+	std::map<std::pair<int, int>, int>::const_iterator it =
+	  cell_index.find(key);
+	if (it == cell_index.end()) {
+	  it = cell_index.insert(std::make_pair(key,
+						(int)cell_sources_.size())).first;
+	  cell_sources_.push_back(source);
+	  cell_sizes_.push_back(megapixel_size);
+	}
+	cells_[mcu] = it->second;
+      }
+    }
+
+    int mcu_width_, mcu_height_;
+    int mcus_wide_, mcus_high_;
+    bool average_pixellation_;
+    // The labels left out, while compiling.
+    const std::vector<int> *excluded_;
+    // The regions and masks the plan was compiled from.
+    std::vector<Region> regions_;
+    std::vector<Mask> masks_;
+    // The regions, then a region for each label of each mask.
+    std::vector<Region> label_regions_;
+    // Per MCU, in raster order.
+    std::vector<int> labels_;
+    // The id of the set of labels covering each MCU.
+    std::vector<int> covers_;
+    // Each distinct set of labels by its id, and while compiling the id
+    // of each set.
+    std::vector<std::vector<int> > cover_sets_;
+    std::map<std::vector<int>, int> cover_ids_;
+    std::vector<unsigned char> actions_;
+    std::vector<int> cells_;
+    // Per pixellation cell.
+    std::vector<int> cell_sources_;
+    std::vector<int> cell_sizes_;
+  };
+
+  Redaction() : average_pixellation_(false), shared_plan_(NULL),
+		using_shared_plan_(false), overlay_(NULL),
+		regenerate_thumbnail_(false) {}
+  virtual ~Redaction() {}
+  Redaction *Copy() const {
     Redaction *copy = new Redaction;
     for (int i = 0; i < regions_.size(); ++i) {
       if (debug > 0)
 	printf("adding region %d of %zu\n", i, regions_.size());
       copy->AddRegion(regions_[i]);
     }
+    copy->masks_ = masks_;
+    copy->average_pixellation_ = average_pixellation_;
+    copy->overlay_ = overlay_;
+    copy->regenerate_thumbnail_ = regenerate_thumbnail_;
     return copy;
   }
+  // Give each pixellation cell the mean DC of all its blocks rather
+  // than the DC of its top left block. Decoding then parses the image
+  // twice, the first time to find the DCs.
+  void SetAveragePixellation(bool average) {
+    average_pixellation_ = average;
+    shared_plan_ = NULL;
+  }
+  bool AveragesPixellation() const { return average_pixellation_; }
+  // Set the tile written over redact_overlay regions, which isn't owned
+  // and must outlive the decoding. NULL for OverlayTile::Default().
+  // Like the masks, it isn't stored by Pack().
+  void SetOverlay(const OverlayTile *overlay) { overlay_ = overlay; }
+  const OverlayTile *GetOverlay() const { return overlay_; }
+  // Discard the EXIF thumbnail and make a new one from the DCs of the
+  // redacted image, rather than redacting the thumbnail with the regions
+  // scaled down. Only for Jpeg::DecodeImage with a single redaction of
+  // an 8 bit image, and not stored by Pack().
+  void SetRegenerateThumbnail(bool regenerate) {
+    regenerate_thumbnail_ = regenerate;
+  }
+  bool RegeneratesThumbnail() const { return regenerate_thumbnail_; }
   void AddRegion(const Region &rect) {
     if (rect.l_ >= rect.r_ || rect.t_ >= rect.b_) {
       fprintf(stderr, "Bad region %d %d %d %d\n",
@@ -268,6 +772,31 @@ public:
       throw("region badly formed l>=r or t>=b");
     }
     regions_.push_back(rect);
+    shared_plan_ = NULL;
+  }
+
+  // Masks are applied after (and so take precedence over) all the
+  // rectangular regions. They are not stored by Pack().
+  void AddMask(const Mask &mask) {
+    masks_.push_back(mask);
+    shared_plan_ = NULL;
+  }
+  // Take the regions and masks from a compiled plan, and use the plan
+  // itself when decoding an image of the geometry it was compiled for.
+  // The plan isn't owned and must outlive the decoding. Changing the
+  // regions afterwards stops the plan being used.
+  void UsePlan(const Plan *plan) {
+    regions_ = plan->regions_;
+    masks_ = plan->masks_;
+    average_pixellation_ = plan->average_pixellation_;
+    shared_plan_ = plan;
+  }
+  int NumMasks() const {
+    return masks_.size();
+  }
+  // Is there anything to redact.
+  bool HasRegions() const {
+    return !regions_.empty() || !masks_.empty();
   }
 
   // Make a region from a string of comma coordinates: l,r,t,b:method
@@ -287,6 +816,7 @@ public:
     if (rv == 5)
       rect.SetRedactionMethod(method);
     regions_.push_back(rect);
+    shared_plan_ = NULL;
   }
   // Make regions from semi-colon-separated regions l,r,t,b[:method];l,r,t,b...
   void AddRegions(const std::string &rect_strings) {
@@ -310,111 +840,95 @@ public:
     if (debug > 0)
       printf("Redaction::%zu strips\n", strips_.size());
     for (int i = 0; i < strips_.size(); ++i) {
-      if (!strips_[i]->Valid(&offset))
+      if (!strips_[i].Valid(&offset))
+	return false;
+      if (!strips_[i].FitsIn(strip_data_.size()))
 	return false;
     }
     return true;
   }
-  // Pack up the regions and the strips into a single blob that can 
-  // be unpacked later.
+  // Packs since version 2 are little-endian throughout, and made of
+  // a header of 8 ints: the magic "JRP" and the version digit, the
+  // version, the header size,
+  // the total size, the numbers of regions and strips, the offset of
+  // the strip data and a checksum of everything after the header;
+  // the regions, Region::kPackedSize bytes each;
+  // the strip table, JpegStrip::kPackedEntrySize bytes per strip;
+  // and the strip data, each strip's bits at its offset in it.
+  // With fixed size entries any strip can be read in place, without
+  // reading the others. See RedactionPackView.
+  // Only the current version is read: version 2, without each strip's
+  // region and DC predictors, was never released.
+  enum { kPackVersion = 3, kPackHeaderSize = 8 * 4 };
+  // The version of a pack: 1 for the native-endian format, which has
+  // no magic.
+  static int PackVersion(const unsigned char *pack, int size) {
+    if (size >= 4 && memcmp(pack, "JRP", 3) == 0 &&
+	pack[3] >= '2' && pack[3] <= '9')
+      return pack[3] - '0';
+    return 1;
+  }
+  // FNV-1a of length bytes of data.
+  static unsigned int PackChecksum(const unsigned char *data, int length) {
+    return BitShifts::Fnv1a(data, length);
+  }
+  // Pack up the regions and the strips into a single (version 3) blob
+  // that can be unpacked later.
   void Pack(std::vector<unsigned char> *pack) {
     if (!ValidateStrips())
       throw("Couldn't validate strips before packing");
-    const int num_strips = NumStrips();
-    const int num_regions = NumRegions();
-    // Calculate how many bytes are needed for the whole pack.
-    // Store (as ints) the number of strips and regions,
-    // the length of each strip's blob, then l,r,t,b,type for each region
-    // and then an unsiged char blob for each strip.
-    int size = sizeof(int) * (2 + NumStrips() + 5  * NumRegions());
-    for (int i = 0; i < NumStrips(); ++i) {
-      const int strip_size = strips_[i]->GetPackSize();
-      size += strip_size;
-    }
+    const int table_start = kPackHeaderSize +
+      NumRegions() * Region::kPackedSize;
+    const int data_start = table_start +
+      NumStrips() * JpegStrip::kPackedEntrySize;
+    const int size = data_start + strip_data_.size();
     if (debug > 1)
       printf("Packing redaction size %d, %d strips, %d regions\n", size,
 	     NumStrips(), NumRegions());
-    // Now start assembling the pack:
-    pack->resize(size);
+    pack->assign(size, 0);
     unsigned char *packptr = &(*pack)[0];
-    JpegStrip::MemcpyByteSwapping((int *)packptr, &num_strips);
-    packptr += sizeof(int);
-    JpegStrip::MemcpyByteSwapping((int *)packptr, &num_regions);
-    packptr += sizeof(int);
-    for (int i = 0; i < NumRegions(); ++i) {
-      std::vector<unsigned char> packed_region;
-      regions_[i].Pack(&packed_region);
-      if (packed_region.size() != 5 * sizeof(int))
-	throw("Region size is not 5 unsigned ints");
-      memcpy(packptr, &packed_region[0], packed_region.size());
-      packptr += packed_region.size();
-    }
-    for (int i = 0; i < NumStrips(); ++i) {
-      const int strip_size = strips_[i]->GetPackSize();
-      JpegStrip::MemcpyByteSwapping((int *)packptr, &strip_size);
-      packptr += sizeof(int);
-      std::vector<unsigned char> packed_strip;
-      strips_[i]->Pack(&packed_strip);
-      if (packed_strip.size() != strip_size) {
-	printf("Strip size mismatch %zu vs %d\n",
-	       packed_strip.size(), strip_size);
-	throw("strip's actual size is not the same as predicted");
-      }
-      memcpy(packptr, &packed_strip[0], packed_strip.size());
-      packptr += packed_strip.size();
-    }
-    if (packptr != &(*pack)[0] + size) {
-      throw("After packing pointer is not start + size");
-    }
+    for (int i = 0; i < NumRegions(); ++i)
+      regions_[i].Pack(packptr + kPackHeaderSize + i * Region::kPackedSize);
+    for (int i = 0; i < NumStrips(); ++i)
+      strips_[i].PackEntry(packptr + table_start +
+			   i * JpegStrip::kPackedEntrySize);
+    if (!strip_data_.empty())
+      memcpy(packptr + data_start, &strip_data_[0], strip_data_.size());
+    memcpy(packptr, "JRP", 3);
+    packptr[3] = '0' + kPackVersion;
+    JpegStrip::PutLE32(packptr + 4, kPackVersion);
+    JpegStrip::PutLE32(packptr + 8, kPackHeaderSize);
+    JpegStrip::PutLE32(packptr + 12, size);
+    JpegStrip::PutLE32(packptr + 16, NumRegions());
+    JpegStrip::PutLE32(packptr + 20, NumStrips());
+    JpegStrip::PutLE32(packptr + 24, data_start);
+    JpegStrip::PutLE32(packptr + 28,
+		       PackChecksum(packptr + kPackHeaderSize,
+				    size - kPackHeaderSize));
   }
 
-  // Take a binary pack and turn it into a redaction object.
+  // Take a binary pack, of any version, and turn it into a redaction
+  // object. What packs don't hold (masks, the overlay and the options)
+  // is reset as in a new Redaction.
   void Unpack(const std::vector<unsigned char> &pack) {
-    regions_.clear();
+    Clear();
     strips_.clear();
-    int num_strips = 0;
-    int num_regions = 0;
-    const unsigned char *packptr = &pack[0];
-    JpegStrip::MemcpyByteSwapping(&num_strips, (const int *)packptr);
-    packptr += sizeof(int);
-    JpegStrip::MemcpyByteSwapping(&num_regions, (const int *)packptr);
-    packptr += sizeof(int);
-
-    int pack_size = sizeof(int) * (2 + num_strips + 5  * num_regions);
-    regions_.resize(num_regions);
-    if (debug > 2)
-      printf("Unpacking: %d regions, %d strips. %zu bytes\n",
-	     num_regions, num_strips, pack.size());
-    for (int i = 0; i < num_regions; ++i) {
-      std::vector<unsigned char> packed_region;
-      const unsigned int size = 5 * sizeof(int);
-      packed_region.resize(size);
-      memcpy(&packed_region[0], packptr, size);
-      regions_[i].Unpack(packed_region);
-      packptr += size;
-    }
-    for (int i = 0; i < num_strips; ++i) {
-      std::vector<unsigned char> packed_strip;
-      int strip_size;
-      JpegStrip::MemcpyByteSwapping(&strip_size, (int *)packptr);
-      packptr += sizeof(int);
-      packed_strip.resize(strip_size);
-      memcpy(&packed_strip[0], packptr, strip_size);
-      JpegStrip *one_strip = new JpegStrip(packed_strip);
-      strips_.push_back(one_strip);
-      packptr += strip_size;
-      pack_size += strip_size;
-    }
-    if (packptr != &pack[0] + pack_size ||
-	pack_size != pack.size()) {
-      fprintf(stderr, "pack.size() %zu. Calculated %d ptrdiff %ld\n",
-	      pack.size(), pack_size, packptr-&pack[0]);
-      throw("After packing pointer is not start + size");
-    }
+    strip_data_.clear();
+    average_pixellation_ = false;
+    overlay_ = NULL;
+    regenerate_thumbnail_ = false;
+    if (pack.empty())
+      throw("Empty redaction pack");
+    if (PackVersion(&pack[0], pack.size()) >= 2)
+      UnpackView(&pack[0], pack.size());
+    else
+      UnpackV1(pack);
   }
   void Add(const Redaction &red) {
     for (int i = 0; i < red.NumRegions(); ++i)
       regions_.push_back(red.GetRegion(i));
+    masks_.insert(masks_.end(), red.masks_.begin(), red.masks_.end());
+    shared_plan_ = NULL;
   }
   Region GetRegion(int i) const {
     return regions_[i];
@@ -424,15 +938,64 @@ public:
   }
   void Clear() {
     regions_.clear();
+    masks_.clear();
+    shared_plan_ = NULL;
   }
   int NumStrips() const {
     return strips_.size();
   }
   const JpegStrip* GetStrip(int strip_index) const {
-    return strips_[strip_index];
+    return &strips_[strip_index];
+  }
+  // The original bits of a strip.
+  const unsigned char *GetStripData(int strip_index) const {
+    if (strip_data_.empty())
+      return NULL;
+    return &strip_data_[0] + strips_[strip_index].GetDataOffset();
   }
-  void AddStrip(const JpegStrip *strip) {
-    strips_.push_back(strip);
+  // Start a strip of a region at pixel x, y which replaces the original
+  // data from bit src with redacted data from bit dest, where the DC
+  // predictors are src_dc and dest_dc. Return its index.
+  int BeginStrip(int x, int y, int src, int dest, int region,
+		 const std::vector<int> &src_dc,
+		 const std::vector<int> &dest_dc) {
+    strips_.push_back(JpegStrip(x, y, src, dest, region));
+    strips_.back().SetPredictors(src_dc, dest_dc);
+    return strips_.size() - 1;
+  }
+  // Finish a strip, which ends at bit src_end of the original data, data,
+  // after MCU blocks, and at bit dest_end of the redacted data.
+  // The original bits are appended to the strip data.
+  void EndStrip(int strip_index, int src_end, int blocks,
+		const unsigned char *data, int dest_end) {
+    JpegStrip &strip = strips_[strip_index];
+    strip.SetSrcEnd(src_end, blocks);
+    const int data_offset = strip_data_.size();
+    int data_bits = data_offset * 8;
+    BitShifts::AppendBits(&strip_data_, &data_bits, data,
+			  strip.GetSrcStart(), strip.GetBits());
+    strip.SetDestEnd(data_offset, dest_end);
+  }
+  // Exchange the regions, masks, strips and settings with other's,
+  // without copying them.
+  void Swap(Redaction *other) {
+    strips_.swap(other->strips_);
+    strip_data_.swap(other->strip_data_);
+    regions_.swap(other->regions_);
+    masks_.swap(other->masks_);
+    std::swap(average_pixellation_, other->average_pixellation_);
+    plan_.Swap(&other->plan_);
+    std::swap(shared_plan_, other->shared_plan_);
+    std::swap(using_shared_plan_, other->using_shared_plan_);
+    std::swap(overlay_, other->overlay_);
+    std::swap(regenerate_thumbnail_, other->regenerate_thumbnail_);
+  }
+  // Replace the strips and their data, as Jpeg::RestoreRegions does
+  // with those still redacted.
+  void SetStrips(const std::vector<JpegStrip> &strips,
+		 const std::vector<unsigned char> &strip_data) {
+    strips_ = strips;
+    strip_data_ = strip_data;
   }
   void Scale(int new_width, int new_height,
 	     int old_width, int old_height) {
@@ -446,6 +1009,35 @@ public:
       regions_[i].t_ = (regions_[i].t_ * new_height) / old_height;
       regions_[i].b_ = (regions_[i].b_ * new_height) / old_height;
     }
+    for (int i = 0; i < masks_.size(); ++i)
+      masks_[i].Scale(new_width, new_height, old_width, old_height);
+    shared_plan_ = NULL;
+  }
+  // Get the plan for an image mcus_wide by mcus_high MCUs of mcu_width x
+  // mcu_height pixels: the shared plan from UsePlan if it matches,
+  // otherwise compile one.
+  // Must be called again if the regions change.
+  void CompileRegions(int mcu_width, int mcu_height,
+		      int mcus_wide, int mcus_high) {
+    using_shared_plan_ = (shared_plan_ != NULL &&
+			  shared_plan_->Matches(mcu_width, mcu_height,
+						mcus_wide, mcus_high));
+    if (!using_shared_plan_)
+      plan_.Compile(*this, mcu_width, mcu_height, mcus_wide, mcus_high);
+  }
+  // The plan from the last CompileRegions.
+  const Plan &GetPlan() const {
+    return using_shared_plan_ ? *shared_plan_ : plan_;
+  }
+  // Return the region for an index returned by RegionAtMCU or InRegion.
+  // Indices past NumRegions() are the labels of masks.
+  const Region &GetLabelRegion(int i) const {
+    return GetPlan().GetLabelRegion(i);
+  }
+  // The region index for an MCU from the plan built by CompileRegions.
+  int RegionAtMCU(int mcu_x, int mcu_y) const {
+    const Plan &plan = GetPlan();
+    return plan.GetLabel(mcu_y * plan.GetMCUsWide() + mcu_x);
   }
   // Test if a box of width dx, dy, with top left corner at x,y
   // intersects with any of the rectangular regions.
@@ -476,9 +1068,179 @@ public:
     return region;
   }
 protected:
+  // Unpack the version 1 format: native-endian ints giving the number
+  // of strips and regions, then l,r,t,b,type for each region, then the
+  // size of each strip's pack followed by the pack.
+  void UnpackV1(const std::vector<unsigned char> &pack) {
+    int num_strips = 0;
+    int num_regions = 0;
+    if (pack.size() < 2 * sizeof(int))
+      throw("Redaction pack too short");
+    const unsigned char *packptr = &pack[0];
+    JpegStrip::MemcpyByteSwapping(&num_strips, (const int *)packptr);
+    packptr += sizeof(int);
+    JpegStrip::MemcpyByteSwapping(&num_regions, (const int *)packptr);
+    packptr += sizeof(int);
+
+    int pack_size = sizeof(int) * (2 + num_strips + 5  * num_regions);
+    if (num_strips < 0 || num_regions < 0 || pack_size > pack.size())
+      throw("Regions overrun the pack");
+    regions_.resize(num_regions);
+    if (debug > 2)
+      printf("Unpacking: %d regions, %d strips. %zu bytes\n",
+	     num_regions, num_strips, pack.size());
+    for (int i = 0; i < num_regions; ++i) {
+      std::vector<unsigned char> packed_region;
+      const unsigned int size = 5 * sizeof(int);
+      packed_region.resize(size);
+      memcpy(&packed_region[0], packptr, size);
+      regions_[i].Unpack(packed_region);
+      packptr += size;
+    }
+    strips_.resize(num_strips);
+    for (int i = 0; i < num_strips; ++i) {
+      int strip_size;
+      JpegStrip::MemcpyByteSwapping(&strip_size, (int *)packptr);
+      packptr += sizeof(int);
+      if (strip_size < 0 || pack_size + strip_size > pack.size())
+	throw("Strip overruns the pack");
+      strips_[i].Unpack(packptr, strip_size, &strip_data_);
+      packptr += strip_size;
+      pack_size += strip_size;
+    }
+    if (packptr != &pack[0] + pack_size ||
+	pack_size != pack.size()) {
+      fprintf(stderr, "pack.size() %zu. Calculated %d ptrdiff %ld\n",
+	      pack.size(), pack_size, packptr-&pack[0]);
+      throw("After packing pointer is not start + size");
+    }
+  }
+  // Unpack the later formats, through a RedactionPackView.
+  inline void UnpackView(const unsigned char *pack, int size);
+
   // Information redacted.
-  std::vector<const JpegStrip*> strips_;
+  std::vector<JpegStrip> strips_;
+  // The original bits of all the strips, each starting on a byte.
+  std::vector<unsigned char> strip_data_;
   std::vector<Region> regions_;
+  std::vector<Mask> masks_;
+  bool average_pixellation_;
+  // The plan compiled by CompileRegions, unless the shared one is used.
+  Plan plan_;
+  // A plan from UsePlan, not owned.
+  const Plan *shared_plan_;
+  bool using_shared_plan_;
+  // The overlay tile, not owned.
+  const OverlayTile *overlay_;
+  bool regenerate_thumbnail_;
+};
+// Read-only access to a (current version) Redaction pack where it
+// lies in memory, such as an mmap'd file. Nothing is copied or parsed up
+// front: each region and strip is read from the pack when it's asked for.
+class RedactionPackView {
+public:
+  RedactionPackView() : pack_(NULL), size_(0), version_(0),
+			num_regions_(0), num_strips_(0), data_start_(0) {}
+  // View the size bytes at pack, which must be left unchanged while the
+  // view is used. Return false if they aren't a pack of the current
+  // version, or a region has an unknown method.
+  // The checksum covers the whole pack, so verify_checksum reads every
+  // byte: skip it to open a large pack that's already trusted.
+  bool Open(const unsigned char *pack, int size, bool verify_checksum) {
+    pack_ = NULL;
+    if (size < Redaction::kPackHeaderSize)
+      return false;
+    const int version = Redaction::PackVersion(pack, size);
+    if (version != Redaction::kPackVersion)
+      return false;
+    const int entry_size = JpegStrip::kPackedEntrySize;
+    const int num_regions = JpegStrip::GetLE32(pack + 16);
+    const int num_strips = JpegStrip::GetLE32(pack + 20);
+    const int data_start = JpegStrip::GetLE32(pack + 24);
+    if (JpegStrip::GetLE32(pack + 4) != version ||
+	JpegStrip::GetLE32(pack + 8) != Redaction::kPackHeaderSize ||
+	JpegStrip::GetLE32(pack + 12) != size)
+      return false;
+    if (num_regions < 0 || num_strips < 0 ||
+	num_regions > size / Redaction::Region::kPackedSize ||
+	num_strips > size / entry_size)
+      return false;
+    if (data_start != Redaction::kPackHeaderSize +
+	num_regions * Redaction::Region::kPackedSize +
+	num_strips * entry_size || data_start > size)
+      return false;
+    // An unknown method would leave its region unredacted.
+    for (int i = 0; i < num_regions; ++i)
+      if (!Redaction::Region::ValidMethod(JpegStrip::GetLE32(
+	      pack + Redaction::kPackHeaderSize +
+	      i * Redaction::Region::kPackedSize + 16)))
+	return false;
+    if (verify_checksum &&
+	(unsigned int)JpegStrip::GetLE32(pack + 28) !=
+	Redaction::PackChecksum(pack + Redaction::kPackHeaderSize,
+				size - Redaction::kPackHeaderSize))
+      return false;
+    pack_ = pack;
+    size_ = size;
+    version_ = version;
+    num_regions_ = num_regions;
+    num_strips_ = num_strips;
+    data_start_ = data_start;
+    return true;
+  }
+  int GetVersion() const { return version_; }
+  int NumRegions() const { return num_regions_; }
+  Redaction::Region GetRegion(int i) const {
+    Redaction::Region region;
+    region.Unpack(pack_ + Redaction::kPackHeaderSize +
+		  i * Redaction::Region::kPackedSize);
+    return region;
+  }
+  int NumStrips() const { return num_strips_; }
+  // The strip's entry in the strip table. Its data offset is relative
+  // to GetData().
+  JpegStrip GetStrip(int i) const {
+    JpegStrip strip;
+    strip.UnpackEntry(pack_ + data_start_ -
+		      (num_strips_ - i) * JpegStrip::kPackedEntrySize);
+    return strip;
+  }
+  // The original bits of a strip, in place in the pack.
+  const unsigned char *GetStripData(int i) const {
+    const JpegStrip strip = GetStrip(i);
+    if (!strip.FitsIn(GetDataSize()))
+      throw("Strip overruns the pack");
+    return GetData() + strip.GetDataOffset();
+  }
+  // The data of all the strips.
+  const unsigned char *GetData() const { return pack_ + data_start_; }
+  int GetDataSize() const { return size_ - data_start_; }
+
+protected:
+  const unsigned char *pack_;
+  int size_;
+  int version_;
+  int num_regions_;
+  int num_strips_;
+  int data_start_;
 };
+
+void Redaction::UnpackView(const unsigned char *pack, int size) {
+  RedactionPackView view;
+  if (!view.Open(pack, size, true))
+    throw("Bad redaction pack");
+  if (debug > 2)
+    printf("Unpacking: %d regions, %d strips. %d bytes\n",
+	   view.NumRegions(), view.NumStrips(), size);
+  regions_.resize(view.NumRegions());
+  for (int i = 0; i < view.NumRegions(); ++i)
+    regions_[i] = view.GetRegion(i);
+  strips_.resize(view.NumStrips());
+  for (int i = 0; i < view.NumStrips(); ++i) {
+    view.GetStripData(i);  // Throws if the strip overruns the data.
+    strips_[i] = view.GetStrip(i);
+  }
+  strip_data_.assign(view.GetData(), view.GetData() + view.GetDataSize());
+}
 } // namespace jpeg_redaction
 #endif // INCLUDE_REDACTION
@@ -0,0 +1,86 @@
+// Copyright (C) 2011 Andrew W. Senior andrew.senior[AT]gmail.com
+// Part of the Jpeg-Redaction-Library to read, parse, edit redact and
+// write JPEG/EXIF/JFIF images.
+// See https://github.com/asenior/Jpeg-Redaction-Library
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+// redaction_estimate.h: what a redaction is expected to cost, worked
+// out from an image's headers and the regions, without the scan data,
+// so that large jobs can be sent to workers that can take them.
+#ifndef INCLUDE_REDACTION_ESTIMATE
+#define INCLUDE_REDACTION_ESTIMATE
+
+namespace jpeg_redaction {
+
+// The time each part of a redaction takes. The defaults were measured
+// by bin/calibrate_redaction with the library's default (debug) build
+// flags; run it on the workers' own hardware and images to refit them.
+class RedactionCostModel {
+ public:
+  RedactionCostModel() : seconds_per_image_(1.0e-3),
+			 seconds_per_scan_byte_(6.0e-8),
+			 seconds_per_redacted_mcu_(1.5e-7),
+			 seconds_per_strip_(5.0e-6) {}
+  // Fixed costs: the tables, the setup and the metadata.
+  double seconds_per_image_;
+  // Parsing the Huffman coded scan.
+  double seconds_per_scan_byte_;
+  // Writing an MCU in a region, beyond parsing it.
+  double seconds_per_redacted_mcu_;
+  // Starting and storing a strip of the redacted data.
+  double seconds_per_strip_;
+};
+
+// The result of Jpeg::EstimateRedaction. Byte counts are of the scan
+// data alone; the rest of the file is copied as it is.
+class RedactionEstimate {
+ public:
+  RedactionEstimate() : mcus_(0), mcus_redacted_(0), mcus_edge_(0),
+			strips_(0), restart_intervals_touched_(0),
+			scan_bytes_(0), min_output_bytes_(0),
+			expected_output_bytes_(0), max_output_bytes_(0),
+			max_strip_bytes_(0), peak_memory_bytes_(0),
+			seconds_(0) {}
+  // Add the estimate for an image decoded at the same time as this one.
+  void AddConcurrent(const RedactionEstimate &other) {
+    peak_memory_bytes_ += other.peak_memory_bytes_;
+    if (other.seconds_ > seconds_)
+      seconds_ = other.seconds_;
+  }
+
+  // MCUs in the image, those rewritten in regions, and those after a
+  // region whose DCs are recoded.
+  int mcus_;
+  int mcus_redacted_;
+  int mcus_edge_;
+  // Strips of redacted data kept for reversing the redaction.
+  int strips_;
+  // Restart intervals with redacted MCUs, 0 without restart markers.
+  int restart_intervals_touched_;
+  int scan_bytes_;
+  // Bounds on the size of the redacted scan, and a guess at it.
+  long long min_output_bytes_;
+  long long expected_output_bytes_;
+  long long max_output_bytes_;
+  // At most this much of the original scan is kept in the strips.
+  long long max_strip_bytes_;
+  // An upper bound on the memory used while redacting.
+  long long peak_memory_bytes_;
+  double seconds_;
+};
+}  // namespace jpeg_redaction
+
+#endif // INCLUDE_REDACTION_ESTIMATE
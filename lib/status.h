@@ -0,0 +1,125 @@
+// Copyright (C) 2011 Andrew W. Senior andrew.senior[AT]gmail.com
+// Part of the Jpeg-Redaction-Library to read, parse, edit redact and
+// write JPEG/EXIF/JFIF images.
+// See https://github.com/asenior/Jpeg-Redaction-Library
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+
+// status.h: the result of the non-throwing Jpeg::Load and Jpeg::Decode,
+// for callers that expect some of their images to be malformed and want
+// to know what was wrong and where, rather than catch exceptions.
+#ifndef INCLUDE_STATUS
+#define INCLUDE_STATUS
+
+#include <stdio.h>
+#include <string>
+
+namespace jpeg_redaction {
+
+class Status {
+ public:
+  enum Code {
+    kOk = 0,
+    // The file couldn't be opened.
+    kCantOpen,
+    // The data ends before the image does.
+    kTruncated,
+    // A marker, table or metadata block can't be parsed.
+    kMalformed,
+    // Valid JPEG that the library doesn't decode (eg progressive).
+    kUnsupported,
+    // The scan has a code that isn't in its Huffman tables, or an AC
+    // run past the end of a block.
+    kBadHuffmanCode,
+    // A restart interval's data doesn't end at its marker, so some of
+    // its codes are wrong even though they decode.
+    kBadRestart,
+    // The redacted scan couldn't be written (eg its tables can't code
+    // a redacted DC), so the image is left unredacted.
+    kCantRedact,
+    // The scan was redacted, but an embedded JPEG (eg the thumbnail)
+    // couldn't be, so the image mustn't be saved as a redacted one.
+    kEmbeddedNotRedacted
+  };
+  // Jpeg::Decode has changed the image if it returns kOk, kTruncated,
+  // kBadHuffmanCode or kBadRestart (with the damaged MCUs written grey)
+  // or kEmbeddedNotRedacted. With any other code the scan is left as it
+  // was, though the embedded JPEGs may have been redacted.
+  Status() : code_(kOk), offset_(-1), mcu_(-1) {}
+  Status(Code code, const std::string &message, int offset, int mcu) :
+    code_(code), message_(message), offset_(offset), mcu_(mcu) {}
+
+  bool Ok() const { return code_ == kOk; }
+  Code GetCode() const { return code_; }
+  const std::string &GetMessage() const { return message_; }
+  // Where the error was found, -1 if not known. For Load, the byte
+  // offset in the file; for Decode, in the scan data (after the header,
+  // with the stuff bytes removed), and the MCU being decoded.
+  int GetOffset() const { return offset_; }
+  int GetMCU() const { return mcu_; }
+
+  static const char *CodeName(Code code) {
+    switch (code) {
+    case kOk: return "OK";
+    case kCantOpen: return "Can't open";
+    case kTruncated: return "Truncated";
+    case kMalformed: return "Malformed";
+    case kUnsupported: return "Unsupported";
+    case kBadHuffmanCode: return "Bad Huffman code";
+    case kBadRestart: return "Bad restart interval";
+    case kCantRedact: return "Can't redact";
+    case kEmbeddedNotRedacted: return "Embedded JPEG not redacted";
+    }
+    return "Unknown";
+  }
+  // eg "Truncated at byte 1234, MCU 56: Scan data ends before the image"
+  std::string ToString() const {
+    std::string text = CodeName(code_);
+    char position[64];
+    if (offset_ >= 0) {
+      snprintf(position, sizeof(position), " at byte %d", offset_);
+      text += position;
+    }
+    if (mcu_ >= 0) {
+      snprintf(position, sizeof(position), ", MCU %d", mcu_);
+      text += position;
+    }
+    if (!message_.empty())
+      text += ": " + message_;
+    return text;
+  }
+
+ private:
+  Code code_;
+  std::string message_;
+  int offset_;
+  int mcu_;
+};
+
+// MCUs first_mcu_ up to end_mcu_ of a scan, which couldn't be decoded
+// because of error_ in the first of them. With restart markers the
+// decoding picks up again at the next one.
+class ScanDamage {
+ public:
+  ScanDamage(int first_mcu, int end_mcu, const Status &error) :
+    first_mcu_(first_mcu), end_mcu_(end_mcu), error_(error) {}
+  int first_mcu_;
+  int end_mcu_;
+  Status error_;
+};
+}  // namespace jpeg_redaction
+
+#endif // INCLUDE_STATUS
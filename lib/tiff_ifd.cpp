@@ -35,7 +35,7 @@ namespace jpeg_redaction {
 TiffIfd::TiffIfd(FILE *pFile, unsigned int ifdoffset,
 		     bool loadall, unsigned int subfileoffset,
 		     bool byte_swapping) :
-  subfileoffset_(subfileoffset), byte_swapping_(byte_swapping) {
+  subfileoffset_(subfileoffset), byte_swapping_(byte_swapping), jpeg_(NULL) {
 
   if (pFile == NULL)
     return;
@@ -184,6 +184,11 @@ unsigned int TiffIfd::Write(FILE *pFile,
   return ifdstart;
 }
 
+void TiffIfd::SetJpeg(Jpeg *jpeg) {
+  delete jpeg_;
+  jpeg_ = jpeg;
+}
+
 int TiffIfd::LoadAll(FILE *pFile) {
   for(int tagindex=0; tagindex<tags_.size(); ++tagindex) {
     tags_[tagindex]->Load(pFile, subfileoffset_, byte_swapping_);
@@ -36,7 +36,7 @@ class TiffIfd
 public:
   TiffIfd(FILE *pFile, unsigned int ifdoffset, bool loadall = false,
 	    unsigned int subfileoffset=0, bool byte_swapping = false);
-  TiffIfd() {  }
+  TiffIfd() : jpeg_(NULL) {  }
   virtual ~TiffIfd() {
     Reset();
   }
@@ -92,6 +92,8 @@ public:
   // Print all tags to stdout.
   void Print() const;
   Jpeg *GetJpeg() { return jpeg_;}
+  // Replace the embedded JPEG with jpeg, which the IFD then owns.
+  void SetJpeg(Jpeg *jpeg);
 protected:
   void Reset();
 
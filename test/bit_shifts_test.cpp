@@ -188,6 +188,73 @@ namespace jpeg_redaction {
       return true;
     }
 
+    // Append append_bits bits from src_start in a random source to
+    // a stream of length bits.
+    bool TestAppend(int length, int src_length, int src_start,
+		    int append_bits) {
+      printf("Testing append length %d src %d start %d append_bits %d\n",
+	     length, src_length, src_start, append_bits);
+      if (src_start + append_bits > src_length)
+	throw("Bad specification of TestAppend");
+      bitstream original((length + 7) / 8);
+      bitstream source((src_length + 7) / 8);
+      FillRand(&original);
+      FillRand(&source);
+      // Unused bits at the end must be zero.
+      if (length % 8)
+	original.back() &= 0xff << (8 - length % 8);
+      bitstream test(original);
+      int new_length = length;
+      BitShifts::AppendBits(&test, &new_length, &source[0], src_start,
+			    append_bits);
+      if (new_length != length + append_bits ||
+	  test.size() != (new_length + 7) / 8)
+	throw("TestAppend length mismatch");
+      VerifyRange(original, 0, length, test, 0, new_length, length);
+      VerifyRange(source, src_start, src_length,
+		  test, length, new_length, append_bits);
+      for (int i = new_length; i < test.size() * 8; ++i)
+	if (BitFromStream(test, i) != 0)
+	  throw("TestAppend trailing bits not zero");
+      return true;
+    }
+
+    // Compare length bits appended from src_start of a random source
+    // with the source, and with one bit changed.
+    bool TestEqualBits(int src_length, int src_start, int length) {
+      printf("Testing equal bits src %d start %d length %d\n",
+	     src_length, src_start, length);
+      bitstream source((src_length + 7) / 8);
+      FillRand(&source);
+      bitstream copy;
+      int copy_length = 0;
+      BitShifts::AppendBits(&copy, &copy_length, &source[0], src_start,
+			    length);
+      if (!BitShifts::EqualBits(&source[0], src_start, &copy[0], 0, length))
+	throw("TestEqualBits copy differs");
+      copy[(length - 1) / 8] ^= 0x80 >> ((length - 1) % 8);
+      if (BitShifts::EqualBits(&source[0], src_start, &copy[0], 0, length))
+	throw("TestEqualBits change not found");
+      return true;
+    }
+
+    bool TestTruncate(int src_length, int length) {
+      printf("Testing truncate src %d to %d\n", src_length, length);
+      bitstream source((src_length + 7) / 8);
+      FillRand(&source);
+      bitstream cut(source);
+      BitShifts::Truncate(&cut, length);
+      if (cut.size() != (length + 7) / 8 ||
+	  (length > 0 && !BitShifts::EqualBits(&source[0], 0, &cut[0], 0,
+					       length)))
+	throw("TestTruncate kept bits differ");
+      // The rest of the last byte is clear, so appending works.
+      for (int i = length; i < cut.size() * 8; ++i)
+	if (BitFromStream(cut, i))
+	  throw("TestTruncate unused bit set");
+      return true;
+    }
+
     bool TestBitFromStream(int len, unsigned char b) {
       printf("TestBitFromStream len %d byte %x\n", len, b);
       bitstream ones(len);
@@ -228,6 +295,23 @@ namespace jpeg_redaction {
 	TestOverwrite(7, 3, 3);
 
 	TestInsert(27, 8, 199);
+
+	TestAppend(0, 100, 0, 100);
+	TestAppend(16, 100, 8, 64);
+	TestAppend(13, 100, 8, 64);
+	TestAppend(16, 100, 5, 95);
+	TestAppend(13, 100, 37, 60);
+	TestAppend(5, 20, 17, 3);
+	TestAppend(3, 9, 1, 2);
+
+	TestEqualBits(100, 0, 100);
+	TestEqualBits(100, 13, 60);
+	TestEqualBits(9, 3, 1);
+
+	TestTruncate(100, 100);
+	TestTruncate(100, 37);
+	TestTruncate(100, 64);
+	TestTruncate(20, 0);
       } catch (const char *message) {
 	fprintf(stderr, "Caught message: %s in bit_shifts_test\n", message);
 	exit(1);
@@ -19,11 +19,18 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <string>
 #include <vector>
 #include "../lib/debug_flag.h"
 #include "jpeg.h"
+#include "jpeg_dht.h"
+#include "jpeg_decoder_cache.h"
+#include "jpeg_encoder.h"
+#include "jpeg_marker.h"
+#include "mjpeg.h"
+#include "overlay.h"
 #include "redaction.h"
 #include "test_utils.h"
 
@@ -46,22 +53,1377 @@ int TestRedactionPack(const std::string &filename, const char *const regions) {
   return 0;
 }
 
+// Check that the compiled region grid agrees with InRegion for every MCU.
+int TestRegionGrid(const char *const regions) {
+  const int mcu_width = 16;
+  const int mcu_height = 8;
+  const int mcus_wide = 40;
+  const int mcus_high = 50;
+  jpeg_redaction::Redaction redaction;
+  redaction.AddRegions(regions);
+  redaction.CompileRegions(mcu_width, mcu_height, mcus_wide, mcus_high);
+  for (int y = 0; y < mcus_high; ++y)
+    for (int x = 0; x < mcus_wide; ++x) {
+      const int expected = redaction.InRegion(x * mcu_width, y * mcu_height,
+					      mcu_width, mcu_height);
+      if (redaction.RegionAtMCU(x, y) != expected) {
+	fprintf(stderr, "Failed on TestRegionGrid %s at MCU %d,%d: %d vs %d\n",
+		regions, x, y, redaction.RegionAtMCU(x, y), expected);
+	return 1;
+      }
+    }
+  return 0;
+}
+
+// Check that mask cells land in the right MCUs, with their label's method.
+int TestMaskGrid() {
+  const int mcus_wide = 12;
+  const int mcus_high = 10;
+  jpeg_redaction::Redaction redaction;
+  redaction.AddRegions("0,32,0,16:s");
+  // A 6x4 mask of 8 pixel cells at 16,8, so 2x2 cells per 16x16 MCU.
+  jpeg_redaction::Redaction::Mask mask(16, 8, 6, 4, 8);
+  // Row 0: 0 1 1 0 0 0, row 1: all 0, row 2: 0 0 0 0 0 1, row 3: all 0.
+  std::vector<int> runs;
+  runs.push_back(1);
+  runs.push_back(2);
+  runs.push_back(14);
+  runs.push_back(1);
+  mask.SetFromRLE(runs, 1);
+  mask.SetLabel(0, 3, 2);
+  mask.SetLabelMethod(2, jpeg_redaction::Redaction::redact_pixellate);
+  // Labels must fit in a byte and not be 0, and cells be in the mask.
+  for (int test = 0; test < 5; ++test) {
+    bool failed = false;
+    try {
+      if (test == 0)
+	mask.SetLabel(0, 0, 256);
+      else if (test == 1)
+	mask.SetLabel(6, 0, 1);
+      else if (test == 2)
+	mask.SetLabelMethod(0, jpeg_redaction::Redaction::redact_solid);
+      else if (test == 3)
+	mask.GetLabelMethod(-1);
+      else
+	mask.SetFromRLE(runs, 300);
+    } catch (const char *error) {
+      failed = true;
+    }
+    if (!failed) {
+      fprintf(stderr, "Failed on TestMaskGrid: bad label case %d accepted\n",
+	      test);
+      return 1;
+    }
+  }
+  redaction.AddMask(mask);
+  redaction.CompileRegions(16, 16, mcus_wide, mcus_high);
+  // MCU label expected for each of the first 5x3 MCUs.
+  const int expected[3][5] = {{0, 1, 1, -1, -1},
+			      {-1, -1, -1, 1, -1},
+			      {-1, 2, -1, -1, -1}};
+  for (int y = 0; y < 3; ++y)
+    for (int x = 0; x < 5; ++x)
+      if (redaction.RegionAtMCU(x, y) != expected[y][x]) {
+	fprintf(stderr, "Failed on TestMaskGrid at MCU %d,%d: %d vs %d\n",
+		x, y, redaction.RegionAtMCU(x, y), expected[y][x]);
+	return 1;
+      }
+  if (redaction.GetLabelRegion(2).GetRedactionMethod() !=
+      jpeg_redaction::Redaction::redact_pixellate ||
+      redaction.GetLabelRegion(1).l_ != 24 ||
+      redaction.GetLabelRegion(1).r_ != 64) {
+    fprintf(stderr, "Failed on TestMaskGrid label regions\n");
+    return 1;
+  }
+  return 0;
+}
+
+// MCUs covered by different sets of regions start different strips,
+// even when the top region is the same. Regions 0, 1 and 40 cover the
+// first MCU and 32 and 40 the second; the rest are off the image.
+int TestCoverSets() {
+  jpeg_redaction::Redaction redaction;
+  for (int i = 0; i <= 40; ++i) {
+    if (i <= 1)
+      redaction.AddRegion(jpeg_redaction::Redaction::Region(0, 16, 0, 8));
+    else if (i == 32)
+      redaction.AddRegion(jpeg_redaction::Redaction::Region(16, 32, 0, 8));
+    else if (i == 40)
+      redaction.AddRegion(jpeg_redaction::Redaction::Region(0, 32, 0, 8));
+    else
+      redaction.AddRegion(jpeg_redaction::Redaction::Region(-100, -90,
+							      -100, -90));
+  }
+  jpeg_redaction::Redaction::Plan plan;
+  plan.Compile(redaction, 16, 8, 4, 4);
+  if (plan.GetLabel(0) != 40 || plan.GetLabel(1) != 40 ||
+      plan.GetCoverLabels(0).size() != 3 ||
+      plan.GetCoverLabels(1).size() != 2 ||
+      plan.GetCover(0) == plan.GetCover(1) ||
+      plan.GetAction(1) != jpeg_redaction::Redaction::Plan::action_start) {
+    fprintf(stderr, "Failed on TestCoverSets\n");
+    return 1;
+  }
+  return 0;
+}
+
+bool ReadFileData(const char *const filename, std::vector<unsigned char> *data) {
+  FILE *pFile = fopen(filename, "rb");
+  if (pFile == NULL)
+    return false;
+  int c;
+  while ((c = getc(pFile)) != EOF)
+    data->push_back(c);
+  fclose(pFile);
+  return !data->empty();
+}
+
+// Redact filename with regions, or with plan if it's not NULL, and
+// return the saved image.
+bool RedactWithPlan(const std::string &filename, const char *const regions,
+		    const jpeg_redaction::Redaction::Plan *plan,
+		    std::vector<unsigned char> *output, int *strips) {
+  const char *const output_filename = "testout/testplan.jpg";
+  jpeg_redaction::Jpeg jpeg;
+  jpeg.LoadFromFile(filename.c_str(), true);
+  jpeg_redaction::Redaction redaction;
+  if (plan)
+    redaction.UsePlan(plan);
+  else
+    redaction.AddRegions(regions);
+  jpeg.DecodeImage(&redaction, NULL);
+  if (plan && &redaction.GetPlan() != plan) {
+    fprintf(stderr, "Shared plan wasn't used\n");
+    return false;
+  }
+  *strips = redaction.NumStrips();
+  output->clear();
+  return jpeg.Save(output_filename) == 0 &&
+    ReadFileData(output_filename, output);
+}
+
+// Check that a plan compiled once redacts images the same as their own
+// regions do, and that its actions start a strip for each run of MCUs.
+int TestRedactionPlan(const std::string &filename, const char *const regions) {
+  try {
+    jpeg_redaction::Jpeg jpeg;
+    jpeg.LoadFromFile(filename.c_str(), true);
+    int mcu_width, mcu_height, mcus_wide, mcus_high;
+    jpeg.GetMCUGeometry(&mcu_width, &mcu_height, &mcus_wide, &mcus_high);
+    jpeg_redaction::Redaction redaction;
+    redaction.AddRegions(regions);
+    jpeg_redaction::Redaction::Plan plan;
+    plan.Compile(redaction, mcu_width, mcu_height, mcus_wide, mcus_high);
+    if (!plan.Matches(mcu_width, mcu_height, mcus_wide, mcus_high))
+      throw("Plan doesn't match its geometry");
+    int starts = 0;
+    for (int mcu = 0; mcu < mcus_wide * mcus_high; ++mcu) {
+      const int x = mcu % mcus_wide;
+      const int y = mcu / mcus_wide;
+      const int expected = redaction.InRegion(x * mcu_width, y * mcu_height,
+					      mcu_width, mcu_height);
+      if (plan.GetLabel(mcu) != expected)
+	throw("Plan label differs from InRegion");
+      if (plan.GetAction(mcu) == jpeg_redaction::Redaction::Plan::action_start)
+	++starts;
+    }
+    std::vector<unsigned char> expected_output;
+    int expected_strips = 0;
+    if (!RedactWithPlan(filename, regions, NULL, &expected_output,
+			&expected_strips))
+      throw("Couldn't redact without a plan");
+    if (expected_strips != starts)
+      throw("Plan starts a different number of strips");
+    // The plan can be used for any number of images.
+    for (int i = 0; i < 2; ++i) {
+      std::vector<unsigned char> output;
+      int strips = 0;
+      if (!RedactWithPlan(filename, regions, &plan, &output, &strips) ||
+	  strips != expected_strips || output != expected_output)
+	throw("Redacting with the plan differs");
+    }
+  } catch (const char *error) {
+    fprintf(stderr, "Failed on TestRedactionPlan %s: %s\n", regions, error);
+    return 1;
+  }
+  return 0;
+}
+
+int TestRedactionMulti(const std::string &filename,
+		       const char *const regions0,
+		       const char *const regions1,
+		       const char *const regions2) {
+  std::vector<std::string> regions;
+  regions.push_back(regions0);
+  regions.push_back(regions1);
+  regions.push_back(regions2);
+  int rv = jpeg_redaction::tests::test_redaction_multi(filename.c_str(),
+						       regions);
+  if (rv)  {
+    fprintf(stderr, "Failed on test_redaction_multi %s %s %s\n",
+	    regions0, regions1, regions2);
+    return 1;
+  }
+  return 0;
+}
+
+// Check that the thumbnail, redacted while the main image decodes, comes
+// out as it does when redacted on its own.
+int TestEmbeddedRedaction(const std::string &filename,
+			  const char *const regions) {
+  try {
+    jpeg_redaction::Jpeg together;
+    jpeg_redaction::Jpeg alone;
+    jpeg_redaction::Jpeg original;
+    if (!together.LoadFromFile(filename.c_str(), true) ||
+	!alone.LoadFromFile(filename.c_str(), true) ||
+	!original.LoadFromFile(filename.c_str(), true))
+      throw("Couldn't load the image");
+    if (together.GetThumbnail() == NULL)
+      throw("No thumbnail");
+    jpeg_redaction::Redaction redaction;
+    redaction.AddRegions(regions);
+    together.DecodeImage(&redaction, NULL);
+    jpeg_redaction::Redaction scaled;
+    scaled.AddRegions(regions);
+    scaled.Scale(alone.GetThumbnail()->GetWidth(),
+		 alone.GetThumbnail()->GetHeight(),
+		 alone.GetWidth(), alone.GetHeight());
+    alone.GetThumbnail()->DecodeImage(&scaled, NULL);
+    const std::vector<unsigned char> &redacted =
+      together.GetThumbnail()->GetMarker(jpeg_redaction::Jpeg::jpeg_sos)->data_;
+    if (redacted !=
+	alone.GetThumbnail()->GetMarker(jpeg_redaction::Jpeg::jpeg_sos)->data_)
+      throw("Thumbnail differs from redacting it alone");
+    if (redacted == original.GetThumbnail()->GetMarker(
+	    jpeg_redaction::Jpeg::jpeg_sos)->data_)
+      throw("Thumbnail not redacted");
+    if (original.RedactThumbnail(&redaction) != 1)
+      throw("RedactThumbnail didn't find one thumbnail");
+  } catch (const char *error) {
+    fprintf(stderr, "Failed on TestEmbeddedRedaction %s: %s\n",
+	    regions, error);
+    return 1;
+  }
+  return 0;
+}
+
+// Redact a stream with num_threads workers and return the output.
+bool RedactMjpeg(const jpeg_redaction::Mjpeg &input, int num_threads,
+		 std::vector<unsigned char> *output) {
+  jpeg_redaction::Mjpeg mjpeg(input);
+  FILE *pFile = tmpfile();
+  if (pFile == NULL || mjpeg.Redact(pFile, num_threads) != 0)
+    return false;
+  output->resize(ftell(pFile));
+  rewind(pFile);
+  const int bytes = fread(&(*output)[0], 1, output->size(), pFile);
+  fclose(pFile);
+  return bytes == output->size();
+}
+
+// Check frames are found in concatenated and AVI-wrapped streams, and
+// that parallel redaction writes the same frames as redacting each alone.
+int TestMjpeg(const std::string &filename) {
+  std::vector<unsigned char> images[2];
+  if (!ReadFileData(filename.c_str(), &images[0]) ||
+      !ReadFileData("testdata/windows.jpg", &images[1])) {
+    fprintf(stderr, "Failed on TestMjpeg: couldn't read images\n");
+    return 1;
+  }
+  // Drop anything after EOI (windows.jpg has trailing data) so the
+  // images are bare frames.
+  for (int i = 0; i < 2; ++i)
+    images[i].resize(jpeg_redaction::Mjpeg::FindJpegEnd(&images[i][0],
+							 images[i].size()));
+  const int num_frames = 5;
+  const char *const regions[num_frames] = {
+    ";50,300,50,200:p;", "", "0,100,0,100:s", "10,90,10,90:s;50,300,50,200:i",
+    ""};
+  std::vector<unsigned char> stream;
+  std::vector<unsigned char> avi(12);
+  std::vector<int> offsets;
+  for (int i = 0; i < num_frames; ++i) {
+    const std::vector<unsigned char> &image = images[i % 2];
+    offsets.push_back(stream.size());
+    stream.insert(stream.end(), image.begin(), image.end());
+    // Junk between frames should be skipped.
+    stream.push_back(0);
+    const unsigned char header[8] = {
+      '0', '0', 'd', 'c', (unsigned char)(image.size() & 0xff),
+      (unsigned char)((image.size() >> 8) & 0xff),
+      (unsigned char)((image.size() >> 16) & 0xff),
+      (unsigned char)((image.size() >> 24) & 0xff)};
+    avi.insert(avi.end(), header, header + 8);
+    avi.insert(avi.end(), image.begin(), image.end());
+    if (image.size() & 1)
+      avi.push_back(0);
+  }
+  memcpy(&avi[0], "RIFF", 4);
+  const int riff_size = avi.size() - 8;
+  for (int i = 0; i < 4; ++i)
+    avi[4 + i] = (riff_size >> (8 * i)) & 0xff;
+  memcpy(&avi[8], "AVI ", 4);
+
+  jpeg_redaction::Mjpeg mjpeg;
+  jpeg_redaction::Mjpeg avi_mjpeg;
+  if (!mjpeg.LoadFromMemory(&stream[0], stream.size()) ||
+      !avi_mjpeg.LoadFromMemory(&avi[0], avi.size()) ||
+      mjpeg.IsAvi() || !avi_mjpeg.IsAvi() ||
+      mjpeg.NumFrames() != num_frames || avi_mjpeg.NumFrames() != num_frames) {
+    fprintf(stderr, "Failed on TestMjpeg: found %d and %d frames\n",
+	    mjpeg.NumFrames(), avi_mjpeg.NumFrames());
+    return 1;
+  }
+  std::vector<unsigned char> expected;
+  for (int i = 0; i < num_frames; ++i) {
+    const std::vector<unsigned char> &image = images[i % 2];
+    if (mjpeg.GetFrameLength(i) != image.size() ||
+	avi_mjpeg.GetFrameLength(i) != image.size() ||
+	mjpeg.GetFrameData(i) - mjpeg.GetFrameData(0) != offsets[i] ||
+	memcmp(avi_mjpeg.GetFrameData(i), &image[0], image.size()) != 0) {
+      fprintf(stderr, "Failed on TestMjpeg: frame %d misplaced\n", i);
+      return 1;
+    }
+    mjpeg.SetRegions(i, regions[i]);
+    avi_mjpeg.SetRegions(i, regions[i]);
+    if (regions[i][0] == '\0') {
+      expected.insert(expected.end(), image.begin(), image.end());
+      continue;
+    }
+    std::vector<unsigned char> redacted;
+    if (jpeg_redaction::Mjpeg::RedactFrame(&image[0], image.size(),
+					   regions[i], &redacted) != 0) {
+      fprintf(stderr, "Failed on TestMjpeg: couldn't redact frame %d\n", i);
+      return 1;
+    }
+    expected.insert(expected.end(), redacted.begin(), redacted.end());
+  }
+  const int threads[3] = {1, 3, 8};
+  for (int t = 0; t < 3; ++t) {
+    std::vector<unsigned char> output;
+    std::vector<unsigned char> avi_output;
+    if (!RedactMjpeg(mjpeg, threads[t], &output) ||
+	!RedactMjpeg(avi_mjpeg, threads[t], &avi_output) ||
+	output != expected || avi_output != expected) {
+      fprintf(stderr, "Failed on TestMjpeg with %d threads\n", threads[t]);
+      return 1;
+    }
+  }
+  // Writing to a read-only file fails, once the workers are stopped.
+  FILE *read_only = fopen(filename.c_str(), "rb");
+  bool failed = false;
+  try {
+    mjpeg.Redact(read_only, 3);
+  } catch (const char *error) {
+    failed = true;
+  }
+  fclose(read_only);
+  if (!failed) {
+    fprintf(stderr, "Failed on TestMjpeg: wrote to a read-only file\n");
+    return 1;
+  }
+  return 0;
+}
+
+// Check that images with the same tables share a cached decoder setup,
+// and that redacting with it gives the same result as without.
+int TestDecoderCache(const std::string &filename) {
+  std::vector<unsigned char> images[2];
+  if (!ReadFileData(filename.c_str(), &images[0]) ||
+      !ReadFileData("testdata/simple.jpg", &images[1])) {
+    fprintf(stderr, "Failed on TestDecoderCache: couldn't read images\n");
+    return 1;
+  }
+  const char *const regions = ";50,300,50,200:p;10,40,10,40:s";
+  jpeg_redaction::JpegDecoderCache cache;
+  for (int pass = 0; pass < 2; ++pass)
+    for (int i = 0; i < 2; ++i) {
+      std::vector<unsigned char> uncached;
+      std::vector<unsigned char> cached;
+      if (jpeg_redaction::Mjpeg::RedactFrame(&images[i][0], images[i].size(),
+					     regions, &uncached) != 0 ||
+	  jpeg_redaction::Mjpeg::RedactFrame(&images[i][0], images[i].size(),
+					     regions, &cached, &cache) != 0 ||
+	  cached != uncached) {
+	fprintf(stderr, "Failed on TestDecoderCache: image %d pass %d\n",
+		i, pass);
+	return 1;
+      }
+    }
+  if (cache.NumEntries() != 2 || cache.NumMisses() != 2 ||
+      cache.NumHits() != 2) {
+    fprintf(stderr, "Failed on TestDecoderCache: %d entries %d misses "
+	    "%d hits\n", cache.NumEntries(), cache.NumMisses(),
+	    cache.NumHits());
+    return 1;
+  }
+  return 0;
+}
+
+// Check that a pack can be read in place, that corruption is caught by
+// the checksum, that unknown methods and versions are rejected, and
+// that version 1 packs still unpack.
+int TestPackView(const std::string &filename, const char *const regions) {
+  try {
+    jpeg_redaction::Jpeg jpeg;
+    if (!jpeg.LoadFromFile(filename.c_str(), true))
+      throw("Couldn't load");
+    jpeg_redaction::Redaction redaction;
+    redaction.AddRegions(regions);
+    jpeg.DecodeImage(&redaction, NULL);
+    std::vector<unsigned char> pack;
+    redaction.Pack(&pack);
+    // Fields are little-endian whatever the machine.
+    if (pack[4] != jpeg_redaction::Redaction::kPackVersion ||
+	pack[5] != 0 || pack[6] != 0 || pack[7] != 0)
+      throw("Version isn't stored little-endian");
+
+    jpeg_redaction::RedactionPackView view;
+    if (!view.Open(&pack[0], pack.size(), true))
+      throw("Couldn't open the pack");
+    if (view.NumRegions() != redaction.NumRegions() ||
+	view.NumStrips() != redaction.NumStrips() || view.NumStrips() < 2)
+      throw("View has the wrong number of regions or strips");
+    for (int i = 0; i < view.NumRegions(); ++i)
+      if (view.GetRegion(i).l_ != redaction.GetRegion(i).l_ ||
+	  view.GetRegion(i).b_ != redaction.GetRegion(i).b_ ||
+	  view.GetRegion(i).GetRedactionMethod() !=
+	  redaction.GetRegion(i).GetRedactionMethod())
+	throw("View region differs");
+    // Read the strips back to front, straight from the pack.
+    for (int i = view.NumStrips() - 1; i >= 0; --i) {
+      const jpeg_redaction::JpegStrip strip = view.GetStrip(i);
+      const jpeg_redaction::JpegStrip *original = redaction.GetStrip(i);
+      if (strip.GetSrcStart() != original->GetSrcStart() ||
+	  strip.GetBits() != original->GetBits() ||
+	  strip.GetReplacedByBits() != original->GetReplacedByBits())
+	throw("View strip differs");
+      if (memcmp(view.GetStripData(i), redaction.GetStripData(i),
+		 strip.GetDataSize()) != 0)
+	throw("View strip data differs");
+    }
+
+    // Unpacking into a used redaction drops its masks.
+    jpeg_redaction::Redaction reused;
+    reused.AddMask(jpeg_redaction::Redaction::Mask(0, 0, 2, 2, 8));
+    reused.Unpack(pack);
+    if (reused.NumMasks() != 0 ||
+	reused.NumRegions() != redaction.NumRegions())
+      throw("Unpacking kept a mask");
+
+    // Flip a bit of the strip data.
+    std::vector<unsigned char> corrupt(pack);
+    corrupt.back() ^= 1;
+    if (view.Open(&corrupt[0], corrupt.size(), true))
+      throw("Checksum didn't catch corruption");
+    if (!view.Open(&corrupt[0], corrupt.size(), false))
+      throw("Couldn't open without verifying");
+    if (view.Open(&pack[0], pack.size() - 1, false))
+      throw("Opened a truncated pack");
+    // A method past the last, with the checksum made good.
+    std::vector<unsigned char> unknown(pack);
+    jpeg_redaction::JpegStrip::PutLE32(
+	&unknown[jpeg_redaction::Redaction::kPackHeaderSize + 16], 5);
+    jpeg_redaction::JpegStrip::PutLE32(
+	&unknown[28], jpeg_redaction::Redaction::PackChecksum(
+	    &unknown[jpeg_redaction::Redaction::kPackHeaderSize],
+	    unknown.size() - jpeg_redaction::Redaction::kPackHeaderSize));
+    if (view.Open(&unknown[0], unknown.size(), true))
+      throw("Opened a pack with an unknown method");
+    bool failed = false;
+    try {
+      jpeg_redaction::Redaction bad;
+      bad.Unpack(unknown);
+    } catch (const char *error) {
+      failed = true;
+    }
+    if (!failed)
+      throw("Unpacked a pack with an unknown method");
+    // Version 2 was never released.
+    std::vector<unsigned char> version2(pack);
+    version2[3] = '2';
+    version2[4] = 2;
+    if (view.Open(&version2[0], version2.size(), false))
+      throw("Opened a version 2 pack");
+    // A strip whose bit count overflows its byte size, with the
+    // checksum made good: it's no defence against a crafted pack.
+    std::vector<unsigned char> forged(pack);
+    const int table = jpeg_redaction::JpegStrip::GetLE32(&forged[24]) -
+      view.NumStrips() * jpeg_redaction::JpegStrip::kPackedEntrySize;
+    jpeg_redaction::JpegStrip::PutLE32(&forged[table + 4], 0x7ffffffa);
+    jpeg_redaction::JpegStrip::PutLE32(
+	&forged[28], jpeg_redaction::Redaction::PackChecksum(
+	    &forged[jpeg_redaction::Redaction::kPackHeaderSize],
+	    forged.size() - jpeg_redaction::Redaction::kPackHeaderSize));
+    failed = false;
+    try {
+      jpeg_redaction::Redaction bad;
+      bad.Unpack(forged);
+    } catch (const char *error) {
+      failed = true;
+    }
+    if (!failed)
+      throw("Unpacked a strip that overruns the pack");
+
+    // Build the same redaction in the version 1 format, native-endian.
+    std::vector<int> ints;
+    ints.push_back(redaction.NumStrips());
+    ints.push_back(redaction.NumRegions());
+    std::vector<unsigned char> v1((const unsigned char *)&ints[0],
+				  (const unsigned char *)&ints[0] +
+				  ints.size() * sizeof(int));
+    for (int i = 0; i < redaction.NumRegions(); ++i) {
+      const jpeg_redaction::Redaction::Region region = redaction.GetRegion(i);
+      const int fields[5] = {region.l_, region.r_, region.t_, region.b_,
+			     region.GetRedactionMethod()};
+      v1.insert(v1.end(), (const unsigned char *)fields,
+		(const unsigned char *)(fields + 5));
+    }
+    for (int i = 0; i < redaction.NumStrips(); ++i) {
+      const jpeg_redaction::JpegStrip *strip = redaction.GetStrip(i);
+      const int fields[9] = {8 * (int)sizeof(int) + strip->GetDataSize(), 1,
+			     strip->GetBits(), strip->GetSrcStart(), 0,
+			     strip->GetReplacedByBits(), 0, 0, 0};
+      v1.insert(v1.end(), (const unsigned char *)fields,
+		(const unsigned char *)(fields + 9));
+      v1.insert(v1.end(), redaction.GetStripData(i),
+		redaction.GetStripData(i) + strip->GetDataSize());
+    }
+    jpeg_redaction::Redaction unpacked;
+    unpacked.Unpack(v1);
+    if (unpacked.NumStrips() != redaction.NumStrips() ||
+	!unpacked.ValidateStrips())
+      throw("Version 1 pack didn't unpack");
+    for (int i = 0; i < unpacked.NumStrips(); ++i)
+      if (unpacked.GetStrip(i)->GetBits() != redaction.GetStrip(i)->GetBits() ||
+	  memcmp(unpacked.GetStripData(i), redaction.GetStripData(i),
+		 unpacked.GetStrip(i)->GetDataSize()) != 0)
+	throw("Version 1 strip differs");
+  } catch (const char *error) {
+    fprintf(stderr, "Failed on TestPackView %s: %s\n", regions, error);
+    return 1;
+  }
+  return 0;
+}
+
+// Read the pgm of block DCs written by DecodeImage.
+bool ReadDCImage(const char *const filename, int *width, int *height,
+		 std::vector<unsigned char> *pixels) {
+  FILE *pFile = fopen(filename, "rb");
+  if (pFile == NULL)
+    return false;
+  int max_value;
+  bool success = (fscanf(pFile, "P5 %d %d %d", width, height, &max_value) == 3 &&
+		  fgetc(pFile) == '\n');
+  if (success) {
+    pixels->resize(*width * *height);
+    success = (fread(&(*pixels)[0], 1, pixels->size(), pFile) ==
+	       pixels->size());
+  }
+  fclose(pFile);
+  return success;
+}
+
+// Make a new thumbnail from a solid redaction, and check that once
+// saved it's a small image, dark where the region is and not elsewhere.
+int TestRegenerateThumbnail(const std::string &filename,
+			    const char *const regions) {
+  const char *const output_filename = "testout/testregenerated.jpg";
+  const char *const pgm_filename = "testout/testregenerated.pgm";
+  try {
+    jpeg_redaction::Jpeg jpeg;
+    if (!jpeg.LoadFromFile(filename.c_str(), true))
+      throw("Couldn't load the image");
+    jpeg_redaction::Redaction redaction;
+    redaction.AddRegions(regions);
+    if (redaction.NumRegions() != 1 ||
+	redaction.GetRegion(0).GetRedactionMethod() !=
+	jpeg_redaction::Redaction::redact_solid)
+      throw("Needs one solid region");
+    redaction.SetRegenerateThumbnail(true);
+    jpeg.DecodeImage(&redaction, NULL);
+    if (jpeg.Save(output_filename) != 0)
+      throw("Couldn't save");
+    jpeg_redaction::Jpeg saved;
+    if (!saved.LoadFromFile(output_filename, true))
+      throw("Couldn't load the saved image");
+    jpeg_redaction::Jpeg *thumbnail = saved.GetThumbnail();
+    if (thumbnail == NULL)
+      throw("No thumbnail");
+    if (thumbnail->GetWidth() > jpeg_redaction::Jpeg::kThumbnailSize ||
+	thumbnail->GetHeight() > jpeg_redaction::Jpeg::kThumbnailSize)
+      throw("Thumbnail too big");
+    thumbnail->DecodeImage(NULL, pgm_filename);
+    int width, height;
+    std::vector<unsigned char> pixels;
+    if (!ReadDCImage(pgm_filename, &width, &height, &pixels))
+      throw("Couldn't read the thumbnail's DC image");
+    // Thumbnail blocks wholly inside the region are black.
+    const jpeg_redaction::Redaction::Region &region = redaction.GetRegion(0);
+    const int scale_x = 8 * saved.GetWidth();
+    const int scale_y = 8 * saved.GetHeight();
+    int bright = 0;
+    for (int by = 0; by < height; ++by)
+      for (int bx = 0; bx < width; ++bx) {
+	const bool inside =
+	  bx * scale_x >= region.l_ * thumbnail->GetWidth() &&
+	  (bx + 1) * scale_x <= region.r_ * thumbnail->GetWidth() &&
+	  by * scale_y >= region.t_ * thumbnail->GetHeight() &&
+	  (by + 1) * scale_y <= region.b_ * thumbnail->GetHeight();
+	const int value = pixels[by * width + bx];
+	if (inside && value > 24) {
+	  fprintf(stderr, "Block %d,%d is %d\n", bx, by, value);
+	  throw("Region not black in the thumbnail");
+	}
+	if (!inside && value > 48)
+	  ++bright;
+      }
+    if (bright == 0)
+      throw("Thumbnail black outside the region");
+  } catch (const char *error) {
+    fprintf(stderr, "Failed on TestRegenerateThumbnail %s: %s\n",
+	    regions, error);
+    return 1;
+  }
+  return 0;
+}
+
+// Estimate a redaction from the headers alone, and check the estimate
+// against redacting the image.
+int TestEstimateRedaction(const std::string &filename,
+			  const char *const regions) {
+  try {
+    jpeg_redaction::Redaction redaction;
+    redaction.AddRegions(regions);
+    jpeg_redaction::Jpeg header;
+    if (!header.LoadFromFile(filename.c_str(), false))
+      throw("Couldn't load the header");
+    const jpeg_redaction::RedactionEstimate estimate =
+      header.EstimateRedaction(redaction);
+    jpeg_redaction::Jpeg jpeg;
+    if (!jpeg.LoadFromFile(filename.c_str(), true))
+      throw("Couldn't load the image");
+    jpeg.DecodeImage(&redaction, NULL);
+    int mcu_width, mcu_height, mcus_wide, mcus_high;
+    jpeg.GetMCUGeometry(&mcu_width, &mcu_height, &mcus_wide, &mcus_high);
+    if (estimate.mcus_ != mcus_wide * mcus_high)
+      throw("Wrong number of MCUs");
+    if (estimate.strips_ != redaction.NumStrips())
+      throw("Wrong number of strips");
+    if (estimate.mcus_redacted_ <= 0 || estimate.mcus_edge_ <= 0 ||
+	estimate.mcus_redacted_ >= estimate.mcus_)
+      throw("Wrong number of redacted MCUs");
+    jpeg_redaction::JpegMarker *sos =
+      jpeg.GetMarker(jpeg_redaction::Jpeg::jpeg_sos);
+    const long long output_bytes =
+      sos->GetBitLength() / 8 - sos->ScanHeaderLength();
+    if (output_bytes < estimate.min_output_bytes_ ||
+	output_bytes > estimate.max_output_bytes_ ||
+	estimate.expected_output_bytes_ < estimate.min_output_bytes_ ||
+	estimate.expected_output_bytes_ > estimate.max_output_bytes_) {
+      fprintf(stderr, "%lld bytes, estimated %lld %lld %lld\n", output_bytes,
+	      estimate.min_output_bytes_, estimate.expected_output_bytes_,
+	      estimate.max_output_bytes_);
+      throw("Redacted scan outside the estimated bounds");
+    }
+    if (estimate.peak_memory_bytes_ < 2LL * estimate.scan_bytes_ ||
+	estimate.seconds_ <= 0)
+      throw("No cost estimated");
+  } catch (const char *error) {
+    fprintf(stderr, "Failed on TestEstimateRedaction %s: %s\n",
+	    regions, error);
+    return 1;
+  }
+  return 0;
+}
+
+// Pixellate with cells averaged over all their blocks and check that
+// every redacted block of a cell decodes to the mean of the cell's
+// blocks in the original, and that the redaction reverses.
+int TestAveragePixellation(const std::string &filename,
+			   const char *const regions) {
+  try {
+    jpeg_redaction::Jpeg original;
+    if (!original.LoadFromFile(filename.c_str(), true))
+      throw("Couldn't load");
+    jpeg_redaction::Jpeg jpeg;
+    jpeg.LoadFromFile(filename.c_str(), true);
+    jpeg_redaction::Redaction redaction;
+    redaction.AddRegions(regions);
+    redaction.SetAveragePixellation(true);
+    jpeg.DecodeImage(&redaction, "testout/average_original.pgm");
+    jpeg.DecodeImage(NULL, "testout/average_redacted.pgm");
+    int width, height;
+    std::vector<unsigned char> original_dc, redacted_dc;
+    if (!ReadDCImage("testout/average_original.pgm", &width, &height,
+		     &original_dc) ||
+	!ReadDCImage("testout/average_redacted.pgm", &width, &height,
+		     &redacted_dc))
+      throw("Couldn't read the DC images");
+    int mcu_width, mcu_height, mcus_wide, mcus_high;
+    jpeg.GetMCUGeometry(&mcu_width, &mcu_height, &mcus_wide, &mcus_high);
+    jpeg_redaction::Redaction::Plan plan;
+    plan.Compile(redaction, mcu_width, mcu_height, mcus_wide, mcus_high);
+    if (plan.NumCells() == 0)
+      throw("No cells");
+    const int hf = mcu_width / 8;
+    const int vf = mcu_height / 8;
+    for (int mcu = 0; mcu < mcus_wide * mcus_high; ++mcu) {
+      const int cell = plan.GetCell(mcu);
+      if (cell < 0)
+	continue;
+      // The mean of the cell in the original.
+      const int x0 = plan.GetCellSource(cell) % mcus_wide;
+      const int y0 = plan.GetCellSource(cell) / mcus_wide;
+      const int size = plan.GetCellSize(cell);
+      int sum = 0;
+      int blocks = 0;
+      for (int by = y0 * vf; by < (y0 + size) * vf && by < height; ++by)
+	for (int bx = x0 * hf; bx < (x0 + size) * hf && bx < width; ++bx) {
+	  sum += original_dc[by * width + bx];
+	  ++blocks;
+	}
+      const int mean = (sum + blocks / 2) / blocks;
+      const int x = mcu % mcus_wide;
+      const int y = mcu / mcus_wide;
+      for (int by = y * vf; by < (y + 1) * vf; ++by)
+	for (int bx = x * hf; bx < (x + 1) * hf; ++bx)
+	  if (abs(redacted_dc[by * width + bx] - mean) > 2)
+	    throw("Block doesn't have its cell's mean");
+    }
+    jpeg.ReverseRedaction(redaction);
+    if (jpeg.GetMarker(jpeg_redaction::Jpeg::jpeg_sos)->data_ !=
+	original.GetMarker(jpeg_redaction::Jpeg::jpeg_sos)->data_)
+      throw("Reversing didn't give the original");
+  } catch (const char *error) {
+    fprintf(stderr, "Failed on TestAveragePixellation %s: %s\n", regions,
+	    error);
+    return 1;
+  }
+  return 0;
+}
+
+// Overlay a tile of dark and light blocks and check that the blocks
+// decode with the tile's pattern, that the tile is encoded once for
+// each set of tables, and that the overlay reverses.
+int TestOverlay(const std::string &filename) {
+  try {
+    // Dark blocks on the left, light on the right, with an edge across
+    // the middle of the lower ones to give them AC.
+    const int size = 16;
+    unsigned char pixels[size * size];
+    for (int y = 0; y < size; ++y)
+      for (int x = 0; x < size; ++x)
+	pixels[y * size + x] = ((x < 8) ? 80 : 176) +
+	  ((y >= 8 && x % 8 >= 4) ? 16 : 0);
+    jpeg_redaction::OverlayTile tile(size, size, pixels);
+    jpeg_redaction::Jpeg original;
+    if (!original.LoadFromFile(filename.c_str(), true))
+      throw("Couldn't load");
+    int encodings = 0;
+    for (int pass = 0; pass < 2; ++pass) {
+      jpeg_redaction::Jpeg jpeg;
+      jpeg.LoadFromFile(filename.c_str(), true);
+      jpeg_redaction::Redaction redaction;
+      redaction.AddRegions("64,320,64,192:o");
+      redaction.SetOverlay(&tile);
+      jpeg.DecodeImage(&redaction, NULL);
+      jpeg.DecodeImage(NULL, "testout/overlay.pgm");
+      // Once for the image's tables and once for the thumbnail's, if
+      // they differ: not again for the second image.
+      if (pass == 0)
+	encodings = tile.NumEncodings();
+      if (encodings < 1 || tile.NumEncodings() != encodings)
+	throw("Tile not encoded once per tables");
+      int width, height;
+      std::vector<unsigned char> dc;
+      if (!ReadDCImage("testout/overlay.pgm", &width, &height, &dc))
+	throw("Couldn't read the DC image");
+      // The blocks inside the region, away from its first column.
+      for (int by = 8; by < 24; ++by)
+	for (int bx = 10; bx < 40; ++bx) {
+	  const int value = dc[by * width + bx];
+	  if ((bx % 2 == 0 && (value < 60 || value > 120)) ||
+	      (bx % 2 == 1 && (value < 160 || value > 220)))
+	    throw("Overlay block doesn't decode as the tile");
+	}
+      jpeg.ReverseRedaction(redaction);
+      if (jpeg.GetMarker(jpeg_redaction::Jpeg::jpeg_sos)->data_ !=
+	  original.GetMarker(jpeg_redaction::Jpeg::jpeg_sos)->data_)
+	throw("Reversing the overlay didn't give the original");
+    }
+  } catch (const char *error) {
+    fprintf(stderr, "Failed on TestOverlay: %s\n", error);
+    return 1;
+  }
+  return 0;
+}
+
+// Encode AC coefficients with small tables: one with no EOB code, and
+// one with codes only for EOB and run 0, size 1.
+int TestEncodeAC() {
+  try {
+    unsigned char no_eob[] = {0x10, 0, 2, 0, 0, 0, 0, 0, 0,
+			      0, 0, 0, 0, 0, 0, 0, 0, 0x01, 0x02};
+    unsigned char small[] = {0x10, 0, 2, 0, 0, 0, 0, 0, 0,
+			     0, 0, 0, 0, 0, 0, 0, 0, 0x00, 0x01};
+    jpeg_redaction::JpegDHT no_eob_dht, small_dht;
+    no_eob_dht.Build(no_eob, sizeof(no_eob));
+    small_dht.Build(small, sizeof(small));
+    int coefficients[64] = {0};
+    coefficients[1] = 1;
+    coefficients[2] = -1;
+    std::vector<unsigned char> data;
+    int bits = 0;
+    bool threw = false;
+    try {
+      jpeg_redaction::JpegEncoder::EncodeAC(coefficients, &no_eob_dht,
+					     &data, &bits);
+    } catch (const char *error) {
+      threw = true;
+    }
+    if (!threw)
+      throw("Encoded with no EOB code");
+    // Size 2, then a run of 1: neither has a code.
+    coefficients[3] = 2;
+    coefficients[5] = 1;
+    threw = false;
+    try {
+      jpeg_redaction::JpegEncoder::EncodeAC(coefficients, &small_dht,
+					     &data, &bits);
+    } catch (const char *error) {
+      threw = true;
+    }
+    if (!threw)
+      throw("Encoded a coefficient with no code");
+    if (jpeg_redaction::JpegEncoder::MakeCodableAC(coefficients,
+						   &small_dht) != 2 ||
+	coefficients[1] != 1 || coefficients[2] != -1 ||
+	coefficients[3] != 0 || coefficients[5] != 0)
+      throw("Wrong coefficients made codable");
+    data.clear();
+    bits = 0;
+    jpeg_redaction::JpegEncoder::EncodeAC(coefficients, &small_dht,
+					   &data, &bits);
+    // Two 2 bit codes with a 1 bit value each, then the 2 bit EOB.
+    if (bits != 8 || data.size() != 1 || data[0] != 0x68)
+      throw("Wrong codes written");
+  } catch (const char *error) {
+    fprintf(stderr, "Failed on TestEncodeAC: %s\n", error);
+    return 1;
+  }
+  return 0;
+}
+
+// Redact regions, restore one of them, and check that its MCUs decode
+// as in the original, except those that the other regions cover too,
+// which decode as redacted. Then restore the rest from a pack.
+int TestRestoreRegions(const std::string &filename, const char *const regions,
+		       int restore) {
+  try {
+    jpeg_redaction::Jpeg original;
+    if (!original.LoadFromFile(filename.c_str(), true))
+      throw("Couldn't load");
+    jpeg_redaction::Jpeg jpeg;
+    jpeg.LoadFromFile(filename.c_str(), true);
+    jpeg_redaction::Redaction redaction;
+    redaction.AddRegions(regions);
+    jpeg.DecodeImage(&redaction, "testout/restore_original.pgm");
+    jpeg.DecodeImage(NULL, "testout/restore_redacted.pgm");
+    const int num_strips = redaction.NumStrips();
+    std::vector<int> restoring(1, restore);
+    jpeg.RestoreRegions(&redaction, restoring);
+    if (redaction.NumStrips() >= num_strips || !redaction.ValidateStrips())
+      throw("Wrong strips left after restoring");
+    jpeg.DecodeImage(NULL, "testout/restore_partial.pgm");
+
+    int width, height;
+    std::vector<unsigned char> original_dc, redacted_dc, partial_dc;
+    if (!ReadDCImage("testout/restore_original.pgm", &width, &height,
+		     &original_dc) ||
+	!ReadDCImage("testout/restore_redacted.pgm", &width, &height,
+		     &redacted_dc) ||
+	!ReadDCImage("testout/restore_partial.pgm", &width, &height,
+		     &partial_dc))
+      throw("Couldn't read the DC images");
+    int mcu_width, mcu_height, mcus_wide, mcus_high;
+    jpeg.GetMCUGeometry(&mcu_width, &mcu_height, &mcus_wide, &mcus_high);
+    // Where the other regions are.
+    jpeg_redaction::Redaction other_regions;
+    for (int i = 0; i < redaction.NumRegions(); ++i)
+      if (i != restore)
+	other_regions.AddRegion(redaction.GetRegion(i));
+    other_regions.CompileRegions(mcu_width, mcu_height, mcus_wide, mcus_high);
+    int restored = 0;
+    for (int by = 0; by < height; ++by)
+      for (int bx = 0; bx < width; ++bx) {
+	const int i = by * width + bx;
+	const int mcu_x = bx * 8 / mcu_width;
+	const int mcu_y = by * 8 / mcu_height;
+	const bool covered = (other_regions.RegionAtMCU(mcu_x, mcu_y) >= 0);
+	const bool restoring =
+	  (redaction.RegionAtMCU(mcu_x, mcu_y) == restore && !covered);
+	if ((restoring && partial_dc[i] != original_dc[i]) ||
+	    (covered && partial_dc[i] != redacted_dc[i]) ||
+	    (partial_dc[i] != original_dc[i] && partial_dc[i] != redacted_dc[i]))
+	  throw("Block doesn't decode as expected after restoring");
+	if (restoring && partial_dc[i] != redacted_dc[i])
+	  ++restored;
+      }
+    if (restored == 0)
+      throw("Nothing restored");
+
+    std::vector<unsigned char> pack;
+    redaction.Pack(&pack);
+    jpeg_redaction::Redaction unpacked;
+    unpacked.Unpack(pack);
+    jpeg.ReverseRedaction(unpacked);
+    if (jpeg.GetMarker(jpeg_redaction::Jpeg::jpeg_sos)->data_ !=
+	original.GetMarker(jpeg_redaction::Jpeg::jpeg_sos)->data_)
+      throw("Restoring the rest didn't give the original");
+  } catch (const char *error) {
+    fprintf(stderr, "Failed on TestRestoreRegions %s restoring %d: %s\n",
+	    regions, restore, error);
+    return 1;
+  }
+  return 0;
+}
+
+// Redact the regions of extra in an image already redacted with regions,
+// and check it's as if they'd all been redacted at once.
+int TestAddRedaction(const std::string &filename, const char *const regions,
+		     const char *const extra_regions) {
+  try {
+    jpeg_redaction::Jpeg original;
+    if (!original.LoadFromFile(filename.c_str(), true))
+      throw("Couldn't load");
+    jpeg_redaction::Jpeg jpeg;
+    jpeg.LoadFromFile(filename.c_str(), true);
+    jpeg_redaction::Redaction redaction;
+    redaction.AddRegions(regions);
+    jpeg.DecodeImage(&redaction, NULL);
+    const std::vector<unsigned char> first_generation =
+      jpeg.GetMarker(jpeg_redaction::Jpeg::jpeg_sos)->data_;
+    const int first_regions = redaction.NumRegions();
+    jpeg_redaction::Redaction extra;
+    extra.AddRegions(extra_regions);
+    {
+      // Adding to a scan cut short fails, and leaves the redaction and
+      // the scan as they were.
+      jpeg_redaction::Jpeg cut;
+      cut.LoadFromFile(filename.c_str(), true);
+      jpeg_redaction::Redaction cut_redaction;
+      cut_redaction.AddRegions(regions);
+      cut.DecodeImage(&cut_redaction, NULL);
+      jpeg_redaction::JpegMarker *sos =
+	cut.GetMarker(jpeg_redaction::Jpeg::jpeg_sos);
+      const int length = sos->ScanHeaderLength() + 16;
+      sos->data_.resize(length);
+      sos->SetBitLength(length * 8);
+      const std::vector<unsigned char> cut_scan = sos->data_;
+      std::vector<unsigned char> before, after;
+      cut_redaction.Pack(&before);
+      bool failed = false;
+      try {
+	cut.AddRedaction(&cut_redaction, extra);
+      } catch (const char *error) {
+	failed = true;
+      }
+      cut_redaction.Pack(&after);
+      if (!failed || cut_redaction.NumRegions() != first_regions ||
+	  after != before || sos->data_ != cut_scan)
+	throw("Failed add changed the redaction or the scan");
+    }
+    jpeg.AddRedaction(&redaction, extra);
+    if (!redaction.ValidateStrips())
+      throw("Strips not valid");
+
+    jpeg_redaction::Jpeg together;
+    together.LoadFromFile(filename.c_str(), true);
+    jpeg_redaction::Redaction both;
+    both.AddRegions(regions);
+    both.AddRegions(extra_regions);
+    together.DecodeImage(&both, NULL);
+    if (jpeg.GetMarker(jpeg_redaction::Jpeg::jpeg_sos)->data_ !=
+	together.GetMarker(jpeg_redaction::Jpeg::jpeg_sos)->data_)
+      throw("Scan differs from redacting together");
+    std::vector<unsigned char> pack, both_pack;
+    redaction.Pack(&pack);
+    both.Pack(&both_pack);
+    if (pack != both_pack)
+      throw("Strips differ from redacting together");
+
+    // Unless they share MCUs, which stay redacted, restoring the new
+    // regions gives back the first redaction. Reversing gives the
+    // original.
+    int mcu_width, mcu_height, mcus_wide, mcus_high;
+    jpeg.GetMCUGeometry(&mcu_width, &mcu_height, &mcus_wide, &mcus_high);
+    jpeg_redaction::Redaction first;
+    first.AddRegions(regions);
+    first.CompileRegions(mcu_width, mcu_height, mcus_wide, mcus_high);
+    extra.CompileRegions(mcu_width, mcu_height, mcus_wide, mcus_high);
+    bool shared = false;
+    for (int y = 0; y < mcus_high; ++y)
+      for (int x = 0; x < mcus_wide; ++x)
+	if (first.RegionAtMCU(x, y) >= 0 && extra.RegionAtMCU(x, y) >= 0)
+	  shared = true;
+    std::vector<int> added;
+    for (int i = first_regions; i < redaction.NumRegions(); ++i)
+      added.push_back(i);
+    jpeg.RestoreRegions(&redaction, added);
+    if (!shared && jpeg.GetMarker(jpeg_redaction::Jpeg::jpeg_sos)->data_ !=
+	first_generation)
+      throw("Restoring the added regions didn't give the first redaction");
+    jpeg.ReverseRedaction(redaction);
+    if (jpeg.GetMarker(jpeg_redaction::Jpeg::jpeg_sos)->data_ !=
+	original.GetMarker(jpeg_redaction::Jpeg::jpeg_sos)->data_)
+      throw("Reversing didn't give the original");
+  } catch (const char *error) {
+    fprintf(stderr, "Failed on TestAddRedaction %s adding %s: %s\n",
+	    regions, extra_regions, error);
+    return 1;
+  }
+  return 0;
+}
+
+// Check a redacted image verifies, and the original doesn't, with
+// violations only in the regions.
+int TestVerifyRedaction(const std::string &filename,
+			const char *const regions) {
+  try {
+    jpeg_redaction::Jpeg original;
+    if (!original.LoadFromFile(filename.c_str(), true))
+      throw("Couldn't load");
+    jpeg_redaction::Jpeg jpeg;
+    jpeg.LoadFromFile(filename.c_str(), true);
+    jpeg_redaction::Redaction redaction;
+    redaction.AddRegions(regions);
+    jpeg.DecodeImage(&redaction, NULL);
+    std::vector<jpeg_redaction::RedactionViolation> violations;
+    if (jpeg.VerifyRedaction(redaction, &violations) != 0 ||
+	!violations.empty()) {
+      for (int i = 0; i < violations.size(); ++i)
+	fprintf(stderr, "MCU %d,%d: %s\n", violations[i].mcu_x_,
+		violations[i].mcu_y_, violations[i].problem_);
+      throw("Redacted image doesn't verify");
+    }
+    const int failures = original.VerifyRedaction(redaction, &violations);
+    if (failures == 0 || failures != violations.size())
+      throw("Original image verifies");
+    int mcu_width, mcu_height, mcus_wide, mcus_high;
+    jpeg.GetMCUGeometry(&mcu_width, &mcu_height, &mcus_wide, &mcus_high);
+    redaction.CompileRegions(mcu_width, mcu_height, mcus_wide, mcus_high);
+    for (int i = 0; i < violations.size(); ++i)
+      if (redaction.RegionAtMCU(violations[i].mcu_x_,
+				violations[i].mcu_y_) < 0)
+	throw("Violation outside the regions");
+  } catch (const char *error) {
+    fprintf(stderr, "Failed on TestVerifyRedaction %s: %s\n",
+	    regions, error);
+    return 1;
+  }
+  return 0;
+}
+
+// Index of the first 0xff, marker in data after start, or -1.
+int FindMarker(const std::vector<unsigned char> &data, int start,
+	       unsigned char marker) {
+  for (int i = start; i + 1 < data.size(); ++i)
+    if (data[i] == 0xff && data[i + 1] == marker)
+      return i;
+  return -1;
+}
+
+// The non-throwing Load and Decode on files that are missing, cut
+// short, not JPEGs, or have a scan that ends early or has a bad code.
+int TestStatus(const std::string &filename) {
+  try {
+    std::vector<unsigned char> data;
+    if (!ReadFileData(filename.c_str(), &data))
+      throw("Couldn't read");
+    const int sos = FindMarker(data, 2, 0xda);
+    if (sos < 0)
+      throw("No scan");
+    jpeg_redaction::Status status;
+    {
+      jpeg_redaction::Jpeg jpeg;
+      status = jpeg.Load("testdata/no_such_file.jpg", true);
+      if (status.GetCode() != jpeg_redaction::Status::kCantOpen)
+	throw("Missing file opened");
+    }
+    {
+      jpeg_redaction::Jpeg jpeg;
+      std::vector<unsigned char> zeros(1000, 0);
+      status = jpeg.Load(&zeros[0], zeros.size(), true);
+      if (status.GetCode() != jpeg_redaction::Status::kMalformed)
+	throw("Zeros loaded");
+    }
+    {
+      // Cut short in the headers.
+      jpeg_redaction::Jpeg jpeg;
+      status = jpeg.Load(&data[0], sos / 2, true);
+      if (status.GetCode() != jpeg_redaction::Status::kTruncated ||
+	  status.GetOffset() <= 0 || status.GetOffset() > sos / 2)
+	throw("Cut headers not truncated");
+    }
+    // The scan cut in half and ended with an EOI.
+    std::vector<unsigned char> cut(data.begin(),
+				   data.begin() + (sos + data.size()) / 2);
+    if (cut.back() == 0xff)
+      cut.pop_back();
+    cut.push_back(0xff);
+    cut.push_back(0xd9);
+    // Eight 0xff bytes (stuffed) in the middle of the scan: no Huffman
+    // code is all ones.
+    std::vector<unsigned char> bad(data);
+    for (int i = 0; i < 8; ++i) {
+      const unsigned char stuffed[] = {0xff, 0x00};
+      bad.insert(bad.begin() + (sos + data.size()) / 2, stuffed, stuffed + 2);
+    }
+    int last_mcu = -1;
+    int strips = 0;
+    const char *const regions = "50,300,50,200:s";
+    for (int test = 0; test < 3; ++test) {
+      const std::vector<unsigned char> &image =
+	(test == 0) ? data : (test == 1) ? cut : bad;
+      jpeg_redaction::Jpeg jpeg;
+      status = jpeg.Load(&image[0], image.size(), true);
+      if (!status.Ok())
+	throw("Couldn't load the image");
+      jpeg_redaction::Redaction redaction;
+      redaction.AddRegions(regions);
+      status = jpeg.Decode(&redaction);
+      if (test == 0) {
+	if (!status.Ok())
+	  throw("Good scan failed");
+	strips = redaction.NumStrips();
+	continue;
+      }
+      const jpeg_redaction::Status::Code expected = (test == 1) ?
+	jpeg_redaction::Status::kTruncated :
+	jpeg_redaction::Status::kBadHuffmanCode;
+      int mcu_width, mcu_height, mcus_wide, mcus_high;
+      jpeg.GetMCUGeometry(&mcu_width, &mcu_height, &mcus_wide, &mcus_high);
+      if (status.GetCode() != expected)
+	throw("Wrong error in the scan");
+      if (status.GetMCU() <= 0 || status.GetMCU() >= mcus_wide * mcus_high ||
+	  status.GetOffset() <= 0 || status.GetOffset() >= image.size() - sos)
+	throw("Scan error out of place");
+      if (test == 1)
+	last_mcu = status.GetMCU();
+      // The bad bytes are found before where the cut scan ends.
+      if (test == 2 && status.GetMCU() > last_mcu)
+	throw("Bad code found after the cut");
+      // The region is before the error, so it's all redacted.
+      if (redaction.NumStrips() != strips)
+	throw("Region before the error isn't redacted");
+    }
+  } catch (const char *error) {
+    fprintf(stderr, "Failed on TestStatus: %s\n", error);
+    return 1;
+  }
+  return 0;
+}
+
+// An image with a restart marker every 7 MCUs (simple.jpg recoded)
+// decodes as the original does, keeps its restarts through a redaction,
+// and resynchronizes at the next restart after bad scan data.
+int TestRestarts(const std::string &filename,
+		 const std::string &original_filename) {
+  const int interval = 7;
+  const char *const regions = "10,90,10,90:s;50,300,50,200:p";
+  try {
+    std::vector<unsigned char> data;
+    if (!ReadFileData(filename.c_str(), &data))
+      throw("Couldn't read");
+    const int sos = FindMarker(data, 2, 0xda);
+    if (sos < 0)
+      throw("No scan");
+    {
+      jpeg_redaction::Jpeg jpeg, original;
+      if (!jpeg.Load(filename.c_str(), true).Ok() ||
+	  !original.Load(original_filename.c_str(), true).Ok())
+	throw("Couldn't load the images");
+      if (jpeg.GetMarker(jpeg_redaction::Jpeg::jpeg_sos)->
+	  restart_offsets_.empty())
+	throw("No restart markers found");
+      jpeg_redaction::Redaction none;
+      jpeg.DecodeImage(&none, "testout/restarts.pgm");
+      original.DecodeImage(&none, "testout/restarts_original.pgm");
+      int width, height, original_width, original_height;
+      std::vector<unsigned char> pixels, original_pixels;
+      if (!ReadDCImage("testout/restarts.pgm", &width, &height, &pixels) ||
+	  !ReadDCImage("testout/restarts_original.pgm", &original_width,
+		       &original_height, &original_pixels))
+	throw("Couldn't read the decoded images");
+      if (pixels != original_pixels)
+	throw("Restarts decode differently");
+    }
+    {
+      jpeg_redaction::Jpeg jpeg;
+      jpeg.Load(filename.c_str(), true);
+      const int restarts =
+	jpeg.GetMarker(jpeg_redaction::Jpeg::jpeg_sos)->restart_offsets_.size();
+      jpeg_redaction::Redaction redaction;
+      redaction.AddRegions(regions);
+      if (!jpeg.Decode(&redaction).Ok())
+	throw("Couldn't redact");
+      if (jpeg.VerifyRedaction(redaction) != 0)
+	throw("Redaction doesn't verify");
+      jpeg.Save("testout/restarts_redacted.jpg");
+      jpeg_redaction::Jpeg redacted;
+      if (!redacted.Load("testout/restarts_redacted.jpg", true).Ok())
+	throw("Couldn't reload the redaction");
+      if (redacted.GetMarker(jpeg_redaction::Jpeg::jpeg_sos)->
+	  restart_offsets_.size() != restarts)
+	throw("Restarts lost in the redaction");
+      if (redacted.VerifyRedaction(redaction) != 0)
+	throw("Saved redaction doesn't verify");
+    }
+    // Eight stuffed 0xff bytes in the middle of the scan damage only the
+    // interval they're in.
+    std::vector<unsigned char> bad(data);
+    for (int i = 0; i < 8; ++i) {
+      const unsigned char stuffed[] = {0xff, 0x00};
+      bad.insert(bad.begin() + (sos + data.size()) / 2, stuffed, stuffed + 2);
+    }
+    jpeg_redaction::Jpeg jpeg;
+    if (!jpeg.Load(&bad[0], bad.size(), true).Ok())
+      throw("Couldn't load the bad image");
+    int mcu_width, mcu_height, mcus_wide, mcus_high;
+    jpeg.GetMCUGeometry(&mcu_width, &mcu_height, &mcus_wide, &mcus_high);
+    jpeg_redaction::Redaction redaction;
+    redaction.AddRegions(regions);
+    std::vector<jpeg_redaction::ScanDamage> damage;
+    const jpeg_redaction::Status status = jpeg.Decode(&redaction, &damage);
+    if (status.GetCode() != jpeg_redaction::Status::kBadHuffmanCode)
+      throw("Bad data not found");
+    if (damage.size() != 1 || damage[0].first_mcu_ != status.GetMCU() ||
+	damage[0].end_mcu_ % interval != 0 ||
+	damage[0].end_mcu_ - damage[0].first_mcu_ > interval ||
+	damage[0].end_mcu_ >= mcus_wide * mcus_high)
+      throw("Damage not stopped at the next restart");
+    // The damaged MCUs are written grey, so the output is whole.
+    jpeg.Save("testout/restarts_damaged.jpg");
+    jpeg_redaction::Jpeg damaged;
+    if (!damaged.Load("testout/restarts_damaged.jpg", true).Ok())
+      throw("Couldn't reload the damaged image");
+    jpeg_redaction::Redaction none;
+    if (!damaged.Decode(&none, &damage).Ok() || !damage.empty())
+      throw("Damaged image not repaired");
+    if (damaged.VerifyRedaction(redaction) != 0)
+      throw("Damaged image redaction doesn't verify");
+
+    // A copy of an interval's data after it decodes without a bad code,
+    // but ends before the interval's marker: the interval is damaged.
+    const int bad_interval = 3;
+    int start = sos;
+    for (int i = 0; i < bad_interval && start >= 0; ++i)
+      start = FindMarker(data, start + 2, 0xd0 + i % 8);
+    const int end = (start < 0) ? -1 :
+      FindMarker(data, start + 2, 0xd0 + bad_interval % 8);
+    if (end < 0)
+      throw("Restart markers not found");
+    std::vector<unsigned char> copied(data);
+    copied.insert(copied.begin() + end, data.begin() + start + 2,
+		  data.begin() + end);
+    jpeg_redaction::Jpeg misaligned;
+    if (!misaligned.Load(&copied[0], copied.size(), true).Ok())
+      throw("Couldn't load the misaligned image");
+    jpeg_redaction::Redaction misaligned_redaction;
+    misaligned_redaction.AddRegions(regions);
+    const jpeg_redaction::Status misaligned_status =
+      misaligned.Decode(&misaligned_redaction, &damage);
+    if (misaligned_status.GetCode() != jpeg_redaction::Status::kBadRestart)
+      throw("Misaligned interval not found");
+    if (damage.size() != 1 ||
+	damage[0].first_mcu_ != bad_interval * interval ||
+	damage[0].end_mcu_ != (bad_interval + 1) * interval)
+      throw("Misaligned interval not damaged");
+    // Its MCUs are written grey.
+    misaligned.DecodeImage(&none, "testout/restarts_misaligned.pgm");
+    int width, height;
+    std::vector<unsigned char> dc;
+    if (!ReadDCImage("testout/restarts_misaligned.pgm", &width, &height, &dc))
+      throw("Couldn't read the misaligned DC image");
+    for (int mcu = damage[0].first_mcu_; mcu < damage[0].end_mcu_; ++mcu) {
+      const int value = dc[(mcu / mcus_wide) * (mcu_height / 8) * width +
+			   (mcu % mcus_wide) * (mcu_width / 8)];
+      if (value < 120 || value > 136)
+	throw("Misaligned interval not grey");
+    }
+  } catch (const char *error) {
+    fprintf(stderr, "Failed on TestRestarts: %s\n", error);
+    return 1;
+  }
+  return 0;
+}
+
 int main(int argc, char **argv) {
   // An 1152 x 693 JPEG without EXIF.
   // redaction strings are l,r,t,b[:method];...
-  // [c]opystrip, [S]olid, [p]ixellate,[i]nverse pixellate
+  // [c]opystrip, [S]olid, [p]ixellate,[i]nverse pixellate, [o]verlay
   std::string filename("testdata/devices/samsung1.jpg");
   if (argc > 1)
     filename = argv[1];
   jpeg_redaction::debug = 0;
 
+  if (TestRegionGrid(";50,300,50,200:p;")) return 1;
+  if (TestRegionGrid("-50,17,-3,9:s;630,700,390,500:c")) return 1;
+  if (TestRegionGrid(";50,300,50,200:s;200,500,120,500:p")) return 1;
+  if (TestRegionGrid(";50,300,50,200:i;")) return 1;
+  if (TestRegionGrid("10,90,10,90:s;50,300,50,200:i;100,400,100,300:p;"
+		     "150,170,150,170:i")) return 1;
+  if (TestRegionGrid("50,300,50,200:i;10,20,10,20:i;300,310,5,9:s")) return 1;
+  if (TestMaskGrid()) return 1;
+  if (TestCoverSets()) return 1;
+
   if (TestRedactionPack(filename, ";50,300,50,200:p;")) return 1;
+  // Many strips to restore in one sweep.
+  if (TestRedactionPack(filename, "50,300,50,200:c;600,900,300,500:s;"
+			"10,90,10,90:s")) return 1;
+  // Long runs of solid MCUs, written from the pre-coded MCU.
+  if (TestRedactionPack(filename, "0,600,0,400:s;700,900,300,500:s"))
+    return 1;
+  if (TestPackView(filename, "50,300,50,200:c;600,900,300,500:s")) return 1;
+  // Restoring one of two regions that meet.
+  if (TestRestoreRegions(filename, "50,300,50,200:s;300,600,50,200:p", 0))
+    return 1;
+  if (TestRestoreRegions(filename, "50,300,50,200:s;300,600,50,200:p", 1))
+    return 1;
+  if (TestRestoreRegions(filename, "50,300,50,200:p;300,600,50,200:c;"
+			 "100,400,150,300:p", 1)) return 1;
+  // Adding regions to a redacted image: after, between and overlapping
+  // its regions, and before any.
+  if (TestAddRedaction(filename, "50,300,50,200:s", "600,900,300,500:p"))
+    return 1;
+  if (TestAddRedaction(filename, "50,300,50,200:s;600,900,300,500:c",
+		       "200,500,250,280:s")) return 1;
+  if (TestAddRedaction(filename, "50,300,50,200:p;600,900,300,500:s",
+		       "250,700,150,350:o;10,40,10,20:s")) return 1;
+  if (TestAddRedaction(filename, "600,900,300,500:i", "50,300,50,200:p"))
+    return 1;
 
   // Different redaction types.
   if (TestRedaction(filename, ";50,300,50,200:p;")) return 1;
   if (TestRedaction(filename, ";50,300,50,200:s;")) return 1;
   if (TestRedaction(filename, ";50,300,50,200:c;")) return 1;
   if (TestRedaction(filename, ";50,300,50,200:i;")) return 1;
+  if (TestRedaction(filename, ";50,300,50,200:o;")) return 1;
+  if (TestOverlay(filename)) return 1;
+  if (TestEncodeAC()) return 1;
+  if (TestVerifyRedaction(filename, "50,300,50,200:s;600,900,300,500:p;"
+			  "100,200,400,600:o;700,800,50,100:c")) return 1;
+  if (TestVerifyRedaction(filename, "50,300,50,200:i;100,150,100,150:s"))
+    return 1;
+  if (TestAveragePixellation(filename, "50,300,50,200:p;600,700,300,500:p"))
+    return 1;
+
+  // Malformed images.
+  if (TestStatus(filename)) return 1;
+  if (TestRestarts("testdata/simple_restarts.jpg", "testdata/simple.jpg"))
+    return 1;
 
   // Corner cases.
   // Completely off left.
@@ -78,4 +1440,37 @@ int main(int argc, char **argv) {
   if (TestRedaction(filename, ";50,300,50,200:s;200,500,120,500:p")) return 1;
   if (TestRedaction(filename, ";50,300,50,200:p;200,500,120,500:s")) return 1;
   if (TestRedaction(filename, ";50,300,50,200:s;200,500,120,500:s")) return 1;
+
+  // Plans compiled once and shared.
+  if (TestRedactionPlan(filename, ";50,300,50,200:p;200,500,120,500:s"))
+    return 1;
+  if (TestRedactionPlan(filename, "10,90,10,90:s;50,300,50,200:i;"
+			"100,400,100,300:p")) return 1;
+
+  // Several variants in one pass.
+  if (TestRedactionMulti(filename, ";50,300,50,200:s;",
+			 ";50,300,50,200:p;200,500,120,500:c",
+			 "")) return 1;
+  if (TestRedactionMulti("testdata/windows.jpg", "0,100,0,100:s",
+			 ";50,300,50,200:i;",
+			 "10,90,10,90:s;50,300,50,200:p;")) return 1;
+  if (TestRedactionMulti(filename, ";50,300,50,200:o;",
+			 ";50,300,50,200:p;200,500,120,500:o",
+			 "")) return 1;
+
+  // Redacting the embedded thumbnail, and making a new one.
+  if (TestEmbeddedRedaction("testdata/windows.jpg",
+			    "0,1600,0,1200:s;2000,3000,600,1800:p"))
+    return 1;
+  if (TestRegenerateThumbnail("testdata/windows.jpg", "0,1600,0,1200:s"))
+    return 1;
+  // Costs estimated from the headers.
+  if (TestEstimateRedaction(filename, "50,300,50,200:s;600,900,300,500:p;"
+			    "100,200,400,600:o")) return 1;
+  if (TestEstimateRedaction("testdata/windows.jpg",
+			    "0,1600,0,1200:s;2000,3000,600,1800:p")) return 1;
+  // Sharing decoder setups between images.
+  if (TestDecoderCache(filename)) return 1;
+  // Motion JPEG streams.
+  if (TestMjpeg(filename)) return 1;
 }
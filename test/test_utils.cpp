@@ -156,6 +156,52 @@ namespace jpeg_redaction {
       return 0;
     }
 
+    // Test redacting several region sets in one pass: each variant must
+    // be identical to redacting that region set on its own.
+    int test_redaction_multi(const char * const filename,
+			     const std::vector<std::string> &regions) {
+      printf("Testing multiple redaction\n");
+      try {
+	Jpeg multi;
+	multi.LoadFromFile(filename, true);
+	std::vector<Redaction *> redactions;
+	std::vector<std::string> filenames;
+	for (int i = 0; i < regions.size(); ++i) {
+	  redactions.push_back(new Redaction);
+	  redactions.back()->AddRegions(regions[i]);
+	  char name[100];
+	  snprintf(name, sizeof(name), "testout/testmulti%d.jpg", i);
+	  filenames.push_back(name);
+	}
+	multi.DecodeImage(redactions, NULL);
+	if (multi.SaveVariants(filenames) != 0)
+	  throw("Couldn't save variants");
+	for (int i = 0; i < regions.size(); ++i) {
+	  if (!redactions[i]->ValidateStrips())
+	    throw("Strips not valid");
+	  Jpeg single;
+	  single.LoadFromFile(filename, true);
+	  Redaction redaction;
+	  redaction.AddRegions(regions[i]);
+	  single.DecodeImage(&redaction, NULL);
+	  const char *single_filename = "testout/testsingle.jpg";
+	  if (single.Save(single_filename) != 0)
+	    throw("Couldn't save single redaction");
+	  if (redaction.NumStrips() != redactions[i]->NumStrips() ||
+	      !compare_to_golden(filenames[i].c_str(), single_filename)) {
+	    fprintf(stderr, "Variant %d (%s) differs\n", i, regions[i].c_str());
+	    return 1;
+	  }
+	}
+	for (int i = 0; i < redactions.size(); ++i)
+	  delete redactions[i];
+      } catch (const char *error) {
+	fprintf(stderr, "Error: <%s> at outer level\n", error);
+	return 1;
+      }
+      return 0;
+    }
+
     // Test wiping a region from a jpeg file, packing data up in a blob
     // and unpacking it.
     int test_redaction_pack_unpack(const char * const filename,
@@ -164,6 +210,8 @@ namespace jpeg_redaction {
       try {
 	Jpeg j2;
 	bool success = j2.LoadFromFile(filename, true);
+	const std::vector<unsigned char> original(
+	  j2.GetMarker(Jpeg::jpeg_sos)->data_);
 	Redaction redaction;
 
 	redaction.AddRegions(regions);
@@ -176,7 +224,16 @@ namespace jpeg_redaction {
 	
 	Redaction unpacked_redaction;
 	unpacked_redaction.Unpack(redaction_pack);
+	if (!unpacked_redaction.ValidateStrips())
+	  throw("Unpacked strips not valid");
+	// Packing again gives the same blob.
+	std::vector<unsigned char> repack;
+	unpacked_redaction.Pack(&repack);
+	if (repack != redaction_pack)
+	  throw("Repacked redaction differs");
 	j2.ReverseRedaction(unpacked_redaction);
+	if (!compare_bytes(original, j2.GetMarker(Jpeg::jpeg_sos)->data_))
+	  throw("Unpacked redaction didn't restore the image");
       } catch (const char *error) {
 	fprintf(stderr, "Error: <%s> at outer level\n", error);
 	return 1;
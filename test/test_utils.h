@@ -35,6 +35,8 @@ namespace jpeg_redaction {
     int test_readwrite(const char * const filename);
     int test_redaction(const char * const filename,
 		       const char * const regions);
+    int test_redaction_multi(const char * const filename,
+			     const std::vector<std::string> &regions);
     int test_redaction_pack_unpack(const char * const filename,
 				   const char *const regions);
     int test_reversingredaction(const char * const filename,